@@ -16,11 +16,26 @@
 #endif
 #endif
 
+// Only for "timezone bench"
+#include <TimeLib.h>
+#include <Timezone.h>
+
 #include "types.h"
 #include "cli.h"
+#include "telnet.h"
 #include "globals.h"
 #include "webserver.h"
 #include "util.h"
+#include "display.h"
+#include "ntp.h"
+#include "timebase.h"
+#include "tz.h"
+#include "history.h"
+#include "tslog.h"
+#include "ntpserver.h"
+#include "dnscache.h"
+#include "tasks.h"
+#include "morse.h"
 
 #ifdef __WITH_TELNET_CLI
 #define CLI_DEV telnet
@@ -33,11 +48,13 @@ cmdType cmdList[] =
 #ifdef __MK2_HW
     { "cat",       cmdTypeFile },
 #endif
+    { "broadcast", cmdBroadcast },
     { "clear",     cmdClearConfig },
 #ifdef __MK2_HW
     { "cp",        cmdCopy },
 #endif
     { "display",   cmdDisplay },
+    { "dns",       cmdDns },
 #ifdef __MK2_HW
     { "format", cmdFormat },
     { "ftpuser", cmdFtpUsername },
@@ -49,12 +66,16 @@ cmdType cmdList[] =
     { "hostname",  cmdHostname },
 	{ "hw", cmdShowHardware },
 #endif
+    { "history",   cmdHistory },
     { "initupdate", cmdInitUpdate },
+    { "isr",       cmdIsr },
+    { "jitter",    cmdJitter },
     { "load",      cmdGetConfig },
 #ifdef __MK2_HW
     { "ls",       cmdDirectory },
     { "mv",       cmdRename },
 #endif
+    { "morse",     cmdMorse },
     { "ntpserver", cmdNtpServer },
     { "password",  cmdPassword },
 #ifdef __MK2_HW
@@ -66,7 +87,12 @@ cmdType cmdList[] =
     { "ssid",      cmdSsid },
     { "syncupdate", cmdSyncUpdate },
     { "syncvalid", cmdSyncValid },
+    { "tasks", cmdTasks },
     { "time", cmdShowTime },
+    { "timezone", cmdTimezone },
+#ifdef __MK2_HW
+    { "tslog", cmdTslog },
+#endif
     { "ver", cmdShowVersion },
 #ifdef __WITH_HTTP
     { "webconfig", cmdWebConfig },
@@ -110,76 +136,91 @@ void printWifiStatus()
     }
 }
 
+// Command line...
+//   The CLI doesn't stop the clock.  cliPoll() is called every time round loop() and takes whatever's
+//   arrived - a character at a time from the serial port, or a whole line at a time from telnet - and
+//   runs a command once there's a line.  The time, NTP and the servers carry on in between, and while
+//   a command runs it's just a long time round loop().
+//   The configuration is kept when a session starts.  When it finishes, with "exit" or by telnet
+//   disconnecting, only the things whose configuration has changed are restarted - see configChanged().
+
+boolean cliActive;                       // A session has started
+boolean cliRestartAll;                   // A command has done something only a full restart will fix
+int cliLen;                              // Characters in serialBuff so far
+eepromData cliConfig;                    // Configuration when the session started
+
 #ifndef __WITH_TELNET_CLI
 
-// Read a line from serial port up to '\n' character
-// seperate command and parameter into two strings by replacing space with '\0'
-// set paramPtr to point to parameter if present
-void serialReadline()
+// One character from the serial port, echoed back as it's typed
+// Returns true at the end of a line, with the line in serialBuff
+boolean cliSerialChar(int inchar)
+{
+    switch(inchar)
+    {
+        case DEL:;
+        case BS:
+            if(cliLen)
+            {
+                Serial.write(BS);
+                Serial.write(' ');
+                Serial.write(BS);
+
+                cliLen--;
+            }
+            break;
+
+        case CR:;
+        case LF:
+            Serial.println("");
+            serialBuff[cliLen] = '\0';
+            cliLen = 0;
+            return true;
+
+        default:
+            if(cliLen < SERBUFF_LEN - 1)
+            {
+                Serial.write(inchar);
+                serialBuff[cliLen] = inchar;
+                cliLen++;
+            }
+    }
+
+    return false;
+}
+
+#endif
+
+// Split the line in serialBuff into the command and parameters
+// Returns the command, NULL for an empty line
+char *cliParseLine()
 {
     int c;
-    int inchar;
-    boolean eoln;
+    char *cmdName;
+    char *cPtr;
 
-    eoln = false;
     paramCount = 0;
-
     for(c = 0; c < MAX_PARAMS; c++)
     {
         paramPtr[c] = NULL;
     }
 
-    c = 0;
-    do
+    cmdName = strtok(serialBuff, " ");
+    if(cmdName != NULL)
     {
-        if(Serial.available() > 0)
+        do
         {
-            inchar = Serial.read();
-            switch(inchar)
+            cPtr = strtok(NULL, " ");
+            if(cPtr != NULL)
             {
-                case DEL:;
-                case BS:
-                    if(c)
-                    {
-                        Serial.write(BS);
-                        Serial.write(' ');
-                        Serial.write(BS);
-                            
-                        c--;
-                    }
-                    break;
-                        
-                case ' ':
-                    Serial.write(' ');
-                    serialBuff[c] = '\0';
-                    c++;
-                    paramPtr[paramCount] = &serialBuff[c];
-                    paramCount++;
-                    break;
-
-                case CR:;
-                case LF:
-                    Serial.println("");
-                    serialBuff[c] = '\0';
-                    eoln = true;
-                    break;
-                       
-                default:
-                    Serial.write(inchar);
-                    serialBuff[c] = inchar;
-                    c++;
+                paramPtr[paramCount] = cPtr;
+                paramCount++;
             }
         }
-
-        if(c == SERBUFF_LEN)
-        {
-            serialBuff[SERBUFF_LEN - 1] = '\0';
-        }
+        while(paramCount < MAX_PARAMS && cPtr != NULL);
     }
-    while(c < SERBUFF_LEN && eoln == false && paramCount < MAX_PARAMS);
-}
 
-#endif
+    return cmdName;
+}
 
 void cmdShowTime()
 {
@@ -190,10 +231,115 @@ void cmdShowTime()
                   
     CLI_DEV.print(" - ");
 
-    sprintf(timeString, "%02d:%02d:%02d", timeNow.tm_hour, timeNow.tm_min, timeNow.tm_sec);
+    sprintf(timeString, "%02d:%02d:%02d %s", timeNow.tm_hour, timeNow.tm_min, timeNow.tm_sec, timeNow.timeName);
     CLI_DEV.println(timeString);    
 }
 
+void cmdTimezone()
+{
+    tzInfo_t *tz;
+    time_t change;
+    timeNow_t local;
+
+    if(paramPtr[0] != NULL)
+    {
+        if(strcmp(paramPtr[0], "bench") == 0)
+        {
+            cmdTimezoneBench();
+            return;
+        }
+
+        if(strlen(paramPtr[0]) < TZ_LEN && tzSet(paramPtr[0]) == true)
+        {
+            strcpy(clockConfig.timeZone, paramPtr[0]);
+        }
+        else
+        {
+            CLI_DEV.println("Not a POSIX TZ string - e.g. GMT0BST,M3.5.0/1,M10.5.0");
+        }
+    }
+
+    tz = tzGetInfo();
+    CLI_DEV.printf("Time zone: %s (%s %+ld s", clockConfig.timeZone, tz -> stdName, tz -> stdOffset);
+    if(tz -> hasDst == true)
+    {
+        CLI_DEV.printf(", %s %+ld s", tz -> dstName, tz -> dstOffset);
+    }
+    CLI_DEV.println(")");
+
+    // Next change is worked out along with the local time
+    tzInvalidate();
+    tzLocalTime(tbSeconds(), &local);
+    if(tzGetNextChange() != INT64_MAX)
+    {
+        change = tzGetNextChange();
+        tzLocalTime(change, &local);
+        CLI_DEV.printf("Next change: %02d/%02d/%04d %02d:%02d:%02d %s\r\n", local.tm_mday, local.tm_mon, local.tm_year,
+                       local.tm_hour, local.tm_min, local.tm_sec, local.timeName);
+    }
+    tzInvalidate();
+}
+
+// Time tzLocalTime() against the Timezone and TimeLib libraries it replaced
+// The old way only knew the UK rules
+void cmdTimezoneBench()
+{
+    TimeChangeRule ukBST = { "BST", Last, Sun, Mar, 2, 60 };
+    TimeChangeRule ukGMT = { "GMT", Last, Sun, Oct, 2, 0 };
+    Timezone ukTime(ukGMT, ukBST);
+    TimeChangeRule *tcr;
+    time_t utc;
+    time_t epoch;
+    timeNow_t local;
+    unsigned long int us;
+    long int c;
+    volatile int sink;
+
+    utc = tbSeconds();
+    sink = 0;
+
+    CLI_DEV.printf("%d conversions of consecutive seconds\r\n", TZ_BENCH_COUNT);
+
+    us = micros();
+    for(c = 0; c < TZ_BENCH_COUNT; c++)
+    {
+        epoch = ukTime.toLocal(utc + c, &tcr);
+        local.tm_mday = day(epoch);
+        local.tm_mon = month(epoch);
+        local.tm_year = year(epoch);
+        local.tm_wday = weekday(epoch) - 1;
+        local.tm_hour = hour(epoch);
+        local.tm_min = minute(epoch);
+        local.tm_sec = second(epoch);
+        sink = sink + local.tm_sec;
+    }
+    us = micros() - us;
+    CLI_DEV.printf("  Timezone + TimeLib     : %ld ns each\r\n", (us * 1000) / TZ_BENCH_COUNT);
+
+    us = micros();
+    for(c = 0; c < TZ_BENCH_COUNT; c++)
+    {
+        tzInvalidate();
+        tzLocalTime(utc + c, &local);
+        sink = sink + local.tm_sec;
+    }
+    us = micros() - us;
+    CLI_DEV.printf("  tzLocalTime() in full  : %ld ns each\r\n", (us * 1000) / TZ_BENCH_COUNT);
+
+    tzInvalidate();
+    us = micros();
+    for(c = 0; c < TZ_BENCH_COUNT; c++)
+    {
+        tzLocalTime(utc + c, &local);
+        sink = sink + local.tm_sec;
+    }
+    us = micros() - us;
+    CLI_DEV.printf("  tzLocalTime() stepping : %ld ns each\r\n", (us * 1000) / TZ_BENCH_COUNT);
+
+    tzInvalidate();
+    CLI_DEV.printf("Since boot: %ld worked out in full, %ld stepped\r\n", tzGetFullCount(), tzGetStepCount());
+}
+
 void cmdSaveConfig()
 {
     saveClockConfig();
@@ -225,38 +371,179 @@ void cmdSsid()
     CLI_DEV.println("");
 }
 
+void cmdDisplayUsage()
+{
+    CLI_DEV.println("display <six lowercase hex digits without spaces>");
+    CLI_DEV.println("display bright <0-15>");
+    CLI_DEV.println("display night <0-15> <start hour> <end hour>");
+    CLI_DEV.println("display led <column 0-5> <row 0-3> <0-15>");
+}
+
+void cmdDisplayBrightness()
+{
+    int col;
+    int row;
+
+    CLI_DEV.printf("Brightness: %d (now %d)\r\n", clockConfig.brightness, dispGetBrightness());
+    if(clockConfig.nightStart == clockConfig.nightEnd)
+    {
+        CLI_DEV.println("Night dimming: off");
+    }
+    else
+    {
+        CLI_DEV.printf("Night dimming: %d from %02d:00 to %02d:00\r\n", clockConfig.nightBrightness, clockConfig.nightStart, clockConfig.nightEnd);
+    }
+
+    CLI_DEV.println("LED brightness (row 3 at top):");
+    for(row = MAX_ROWS - 1; row >= 0; row--)
+    {
+        CLI_DEV.print(" ");
+        for(col = 0; col < MAX_COLS; col++)
+        {
+            if(row < ledColSize[col])
+            {
+                CLI_DEV.printf(" %2d", clockConfig.ledBrightness[col][row]);
+            }
+            else
+            {
+                CLI_DEV.print("   ");
+            }
+        }
+        CLI_DEV.println("");
+    }
+}
+
 void cmdDisplay()
 {
     int c;
+    int col;
+    int row;
     char *dPtr;
+    dispFrame_t *frame;
     
     if(paramPtr[0] == NULL)
     {
-        CLI_DEV.println("display <six lowercase hex digits without spaces>");
+        cmdDisplayUsage();
+        cmdDisplayBrightness();
+    }
+    else if(strcmp(paramPtr[0], "bright") == 0 && paramCount == 2)
+    {
+        clockConfig.brightness = constrain(atoi(paramPtr[1]), 0, DISP_MAX_LEVEL);
+        dispSetBrightness(clockConfig.brightness);
+        cmdDisplayBrightness();
+    }
+    else if(strcmp(paramPtr[0], "night") == 0 && paramCount == 4)
+    {
+        clockConfig.nightBrightness = constrain(atoi(paramPtr[1]), 0, DISP_MAX_LEVEL);
+        clockConfig.nightStart = constrain(atoi(paramPtr[2]), 0, 23);
+        clockConfig.nightEnd = constrain(atoi(paramPtr[3]), 0, 23);
+        dispScheduleBrightness(timeNow.tm_hour);
+        cmdDisplayBrightness();
+    }
+    else if(strcmp(paramPtr[0], "led") == 0 && paramCount == 4)
+    {
+        col = atoi(paramPtr[1]);
+        row = atoi(paramPtr[2]);
+        if(col < 0 || col >= MAX_COLS || row < 0 || row >= ledColSize[col])
+        {
+            CLI_DEV.println("No LED there");
+        }
+        else
+        {
+            clockConfig.ledBrightness[col][row] = constrain(atoi(paramPtr[3]), 0, DISP_MAX_LEVEL);
+            dispSetBrightness(dispGetBrightness());
+            cmdDisplayBrightness();
+        }
     }
     else
     {
         if(strlen(paramPtr[0]) != 6)
         {
-            CLI_DEV.println("Need 6 digits");
+            cmdDisplayUsage();
         }
         else
         {
+            frame = dispBackFrame();
             dPtr = paramPtr[0];
             for(c = 0; c < 6; c++)
             {
                 if(isdigit(*dPtr))
                 {
-                    ledColData[c] = *dPtr - 48;
+                    frame -> col[c] = *dPtr - 48;
                 }
                 else
                 {
-                    ledColData[c] = *dPtr - 87;
+                    frame -> col[c] = *dPtr - 87;
                 }
                 dPtr++;
             }
+            dispPublish();
+        }
+    }
+}
+
+// Show display interrupt cost, or switch between register and digitalWrite() versions of the ISR
+void cmdIsr()
+{
+    unsigned long int avgCycles;
+    unsigned long int maxCycles;
+    unsigned long int mhz;
+
+    if(paramPtr[0] != NULL)
+    {
+        if(strcmp(paramPtr[0], "fast") == 0)
+        {
+            dispFastIsr = true;
+        }
+        else if(strcmp(paramPtr[0], "gpio") == 0)
+        {
+            dispFastIsr = false;
+        }
+        else if(strcmp(paramPtr[0], "reset") != 0)
+        {
+            CLI_DEV.println("isr [fast|gpio|reset]");
+            return;
         }
+
+        dispResetIsrStats();
+        CLI_DEV.println("ISR statistics reset");
+        return;
+    }
+
+#ifdef __DISPLAY_DMA
+    CLI_DEV.println("Display backend  : LCD_CAM + GDMA");
+    CLI_DEV.printf("Interrupts       : %ld (timer version would use %d per second)\r\n", interruptCount, DISP_INTS_PER_SECOND);
+    CLI_DEV.printf("Pattern rewrites : %ld (%ld per minute)\r\n", dispBufferWrites, (dispBufferWrites * 60) / ((millis() / 1000) + 1));
+#else
+    avgCycles = dispIsrAvgCycles;
+    maxCycles = dispIsrMaxCycles;
+    mhz = dispCpuMHz();
+
+    CLI_DEV.print("Display ISR      : ");
+    if(dispFastIsr == true)
+    {
+        CLI_DEV.println("register masks");
+    }
+    else
+    {
+        CLI_DEV.println("digitalWrite()");
+    }
+
+    CLI_DEV.printf("Brightness       : %d\r\n", dispGetBrightness());
+    CLI_DEV.printf("Interrupts       : %ld (%ld per second, %d columns per second)\r\n", interruptCount, dispInterruptRate(), DISP_INTS_PER_SECOND);
+
+    if(avgCycles == 0)
+    {
+        CLI_DEV.printf("ISR cost         : waiting for %d interrupts\r\n", DISP_STATS_WINDOW);
+    }
+    else
+    {
+        CLI_DEV.printf("ISR cost average : %ld cycles (%ld.%02ld us)\r\n", avgCycles, avgCycles / mhz, ((avgCycles % mhz) * 100) / mhz);
+        CLI_DEV.printf("ISR cost maximum : %ld cycles (%ld.%02ld us)\r\n", maxCycles, maxCycles / mhz, ((maxCycles % mhz) * 100) / mhz);
+        CLI_DEV.printf("CPU used by ISR  : %ld.%03ld%%\r\n", (avgCycles * dispInterruptRate()) / (mhz * 10000),
+                       ((avgCycles * dispInterruptRate()) / (mhz * 10)) % 1000);
     }
+#endif
 }
 
 void cmdPassword()
@@ -273,18 +560,342 @@ void cmdPassword()
 
 void cmdNtpServer()
 {
+    int c;
+
+    // All the servers are given each time, any not given aren't used
     if(paramPtr[0] != NULL)
     {
-         strncpy(clockConfig.ntpServer, paramPtr[0], 32);
+        strncpy(clockConfig.ntpServer, paramPtr[0], 32);
+        for(c = 0; c < NTP_EXTRA_SERVERS; c++)
+        {
+            if(c + 1 < paramCount)
+            {
+                strncpy(clockConfig.ntpExtraServer[c], paramPtr[c + 1], 32);
+                clockConfig.ntpExtraServer[c][31] = '\0';
+            }
+            else
+            {
+                clockConfig.ntpExtraServer[c][0] = '\0';
+            }
+        }
     }
 
     CLI_DEV.print("NTP server: ");
     CLI_DEV.print(clockConfig.ntpServer);
+    for(c = 1; ntpServerName(c) != NULL; c++)
+    {
+        CLI_DEV.print(" ");
+        CLI_DEV.print(ntpServerName(c));
+    }
     CLI_DEV.println("");
 }
 
+// history [csv|json] [since]
+// NTP polls after sequence number "since", or everything still kept
+void cmdHistory()
+{
+    int c;
+    boolean json;
+    unsigned long int since;
+
+    json = false;
+    since = 0;
+    for(c = 0; c < paramCount; c++)
+    {
+        if(strcmp(paramPtr[c], "json") == 0)
+        {
+            json = true;
+        }
+        else if(strcmp(paramPtr[c], "csv") == 0)
+        {
+            json = false;
+        }
+        else
+        {
+            since = strtoul(paramPtr[c], NULL, 10);
+        }
+    }
+
+    histExport(CLI_DEV, since, json);
+    CLI_DEV.printf("%lu-%lu of %d kept\r\n", histOldest(), histLatest(), histGetSize());
+}
+
+// jitter [clear|early|late]
+// Histograms of NTP sample jitter and how long replies waited for loop()
+// "late" takes T4 when loop() reads the reply instead of when it arrived, to compare
+void cmdJitter()
+{
+    if(paramPtr[0] != NULL)
+    {
+        if(strcmp(paramPtr[0], "clear") == 0)
+        {
+            ntpClearHist();
+        }
+        else if(strcmp(paramPtr[0], "early") == 0)
+        {
+            ntpSetLateStamps(false);
+        }
+        else if(strcmp(paramPtr[0], "late") == 0)
+        {
+            ntpSetLateStamps(true);
+        }
+        else
+        {
+            CLI_DEV.println("jitter [clear|early|late]");
+            return;
+        }
+    }
+
+    CLI_DEV.printf("Timestamps: %s, %lu replies dropped\r\n", ntpGetLateStamps() == true ? "late (when read)" : "early (on arrival)",
+                   ntpGetRxDropped());
+    CLI_DEV.println("under us|jitter|waited");
+    ntpHistExport(CLI_DEV);
+}
+
+// dns [flush]
+// What's in the DNS cache for the NTP server names, '!' marks an address left out after it stopped answering
+void cmdDns()
+{
+    int c;
+    int n;
+    dnsEntry_t *entry;
+
+    if(paramPtr[0] != NULL)
+    {
+        if(strcmp(paramPtr[0], "flush") == 0)
+        {
+            dnsCacheFlush();
+        }
+        else
+        {
+            CLI_DEV.println("dns [flush]");
+            return;
+        }
+    }
+
+    for(c = 0; c < DNS_CACHE_SIZE; c++)
+    {
+        entry = dnsCacheEntry(c);
+        if(entry == NULL)
+        {
+            continue;
+        }
+
+        CLI_DEV.printf("%s: ", entry -> name);
+        if(entry -> resolvedMs == 0)
+        {
+            CLI_DEV.print("not resolved");
+        }
+        else
+        {
+            CLI_DEV.printf("TTL %lu s, resolved %lu s ago in %lu ms", entry -> ttl, (millis() - entry -> resolvedMs) / 1000,
+                           entry -> answerMs);
+        }
+        CLI_DEV.println(entry -> refreshing == true ? ", refreshing" : "");
+        CLI_DEV.printf("  %lu lookups, %lu cached, %lu stale, %lu waited, %lu failed\r\n", entry -> lookups, entry -> hits,
+                       entry -> stale, entry -> misses, entry -> failures);
+        for(n = 0; n < entry -> addrCount; n++)
+        {
+            CLI_DEV.printf("  %c%s\r\n", (entry -> avoid & (1 << n)) != 0 ? '!' : ' ', entry -> addr[n].toString().c_str());
+        }
+    }
+
+    CLI_DEV.printf("NTP requests: %lu us to resolve and send, %lu us average, %lu us worst\r\n", ntpGetRequestUs(),
+                   ntpGetRequestAvgUs(), ntpGetRequestWorstUs());
+}
+
+// broadcast [off|broadcast|group]
+// Listen for NTP broadcasts, or multicasts to a group such as 224.0.1.1, as well as polling
+void cmdBroadcast()
+{
+    IPAddress group;
+
+    if(paramPtr[0] != NULL)
+    {
+        if(strcmp(paramPtr[0], "off") == 0)
+        {
+            clockConfig.ntpBroadcast[0] = '\0';
+        }
+        else if(strlen(paramPtr[0]) < NTP_BCAST_LEN && ntpBroadcastAddress(paramPtr[0], &group) == true)
+        {
+            strcpy(clockConfig.ntpBroadcast, paramPtr[0]);
+        }
+        else
+        {
+            CLI_DEV.println("broadcast [off|broadcast|multicast group]");
+            return;
+        }
+
+        ntpBroadcastEnd();
+        ntpBroadcastBegin();
+    }
+
+    if(clockConfig.ntpBroadcast[0] == '\0')
+    {
+        CLI_DEV.println("Broadcast client: off");
+    }
+    else
+    {
+        CLI_DEV.printf("Broadcast client: %s, ", clockConfig.ntpBroadcast);
+        switch(ntpBroadcastState())
+        {
+            case NTP_BCAST_LISTENING:
+                CLI_DEV.println("listening, polling servers");
+                break;
+
+            case NTP_BCAST_CALIBRATING:
+                CLI_DEV.printf("calibrating with %s\r\n", ntpBroadcastSource() -> addr.toString().c_str());
+                break;
+
+            case NTP_BCAST_LOCKED:
+                CLI_DEV.printf("time from %s, delay %ld us\r\n", ntpBroadcastSource() -> addr.toString().c_str(),
+                               ntpBroadcastSource() -> delayUs);
+                break;
+
+            default:
+                CLI_DEV.println("not running");
+                break;
+        }
+    }
+}
+
+void cmdShowNtpSources()
+{
+    int c;
+    ntpSource_t *source;
+
+    CLI_DEV.println("NTP sources:");
+    CLI_DEV.println("   address          reach st   offset us   delay us  jitter us    dist us  name");
+    for(c = 0; c < ntpGetSourceCount(); c++)
+    {
+        source = ntpGetSource(c);
+        CLI_DEV.printf(" %c %-16s 0x%02x %2d %11ld %10ld %10ld %10ld  %s", source -> tally, source -> addr.toString().c_str(),
+                       source -> reach, source -> stratum, (long int)source -> offsetUs, source -> delayUs,
+                       source -> jitterUs, source -> distanceUs, source -> name);
+        if(source -> kiss[0] != '\0')
+        {
+            CLI_DEV.printf(" (kiss %s)", source -> kiss);
+        }
+        CLI_DEV.println("");
+    }
+
+    if(ntpBroadcastState() != NTP_BCAST_OFF)
+    {
+        source = ntpBroadcastSource();
+        CLI_DEV.printf(" %c %-16s 0x%02x %2d %11ld %10ld %10ld %10ld  %s\r\n", source -> tally, source -> addr.toString().c_str(),
+                       source -> reach, source -> stratum, (long int)source -> offsetUs, source -> delayUs,
+                       source -> jitterUs, source -> distanceUs, source -> name);
+    }
+}
+
+// morse [wpm n|farnsworth n|pitch hz|time|send text]
+void cmdMorse()
+{
+    int c;
+    char text[MORSE_TEXT_LEN + 1];
+
+    if(paramPtr[0] != NULL && strcmp(paramPtr[0], "send") == 0 && paramCount > 1)
+    {
+        // The command line has been split into words, put them back together
+        text[0] = '\0';
+        for(c = 1; c < paramCount; c++)
+        {
+            if(c > 1)
+            {
+                strncat(text, " ", MORSE_TEXT_LEN - strlen(text));
+            }
+            strncat(text, paramPtr[c], MORSE_TEXT_LEN - strlen(text));
+        }
+
+        if(morseSendText(text) == true)
+        {
+            CLI_DEV.printf("Sending \"%s\"\r\n", text);
+        }
+        else
+        {
+            CLI_DEV.println("Can't send that now");
+        }
+        return;
+    }
+
+    if(paramPtr[0] != NULL)
+    {
+        if(strcmp(paramPtr[0], "wpm") == 0 && paramCount == 2)
+        {
+            clockConfig.morseWpm = constrain(atoi(paramPtr[1]), MORSE_MIN_WPM, MORSE_MAX_WPM);
+            clockConfig.morseFarnsworth = min(clockConfig.morseFarnsworth, clockConfig.morseWpm);
+        }
+        else if(strcmp(paramPtr[0], "farnsworth") == 0 && paramCount == 2)
+        {
+            clockConfig.morseFarnsworth = constrain(atoi(paramPtr[1]), MORSE_MIN_WPM, clockConfig.morseWpm);
+        }
+        else if(strcmp(paramPtr[0], "pitch") == 0 && paramCount == 2)
+        {
+            clockConfig.morsePitch = constrain(atoi(paramPtr[1]), 0, MORSE_MAX_PITCH);
+        }
+        else if(strcmp(paramPtr[0], "time") == 0)
+        {
+            timeInMorse();
+        }
+        else
+        {
+            CLI_DEV.println("morse [wpm n|farnsworth n|pitch hz|time|send text]");
+            return;
+        }
+
+        morseSettings();
+    }
+
+    CLI_DEV.printf("Speed: %d wpm (dot %ld ms), overall %d wpm (gap unit %ld ms)\r\n", clockConfig.morseWpm, morseGetDotUs() / 1000,
+                   clockConfig.morseFarnsworth, morseGetSpaceUs() / 1000);
+    if(morseGetPitch() == 0)
+    {
+        CLI_DEV.println("Tone: none, DC level");
+    }
+    else
+    {
+        CLI_DEV.printf("Tone: %d Hz\r\n", morseGetPitch());
+    }
+}
+
+// How busy loop() and the network task are
+void cmdTasks()
+{
+    int c;
+    taskStats_t *stats;
+    long int stackFree;
+
+    CLI_DEV.println("Task     Core    CPU  Passes/s  Longest us  Stack free");
+    for(c = 0; c < TASK_COUNT; c++)
+    {
+        stats = taskGetStats(c);
+        if(c != TASK_CLOCK && stats -> handle == NULL)
+        {
+            continue;
+        }
+
+        CLI_DEV.printf("%-8s %4d %3d.%d%% %9lu %11lu", stats -> name, stats -> core, stats -> cpuPermille / 10,
+                       stats -> cpuPermille % 10, stats -> passesPerSecond, stats -> worstPassUs);
+        stackFree = taskStackFree(c);
+        if(stackFree < 0)
+        {
+            CLI_DEV.println("           -");
+        }
+        else
+        {
+            CLI_DEV.printf(" %11ld\r\n", stackFree);
+        }
+    }
+
+    if(taskNetRunning() == false)
+    {
+        CLI_DEV.println("Servers not started");
+    }
+}
+
 void cmdShowState()
 {
+    int c;
     char tmpStr[32];
     
     printWifiStatus();
@@ -296,6 +907,11 @@ void cmdShowState()
     CLI_DEV.println(clockConfig.password);
     CLI_DEV.print("  NTP server       : ");
     CLI_DEV.println(clockConfig.ntpServer);
+    for(c = 1; ntpServerName(c) != NULL; c++)
+    {
+        CLI_DEV.print("                     ");
+        CLI_DEV.println(ntpServerName(c));
+    }
     CLI_DEV.print("  Clock hostname   : ");
     CLI_DEV.println(clockConfig.hostName);
     CLI_DEV.print("  Updates for sync : ");
@@ -306,6 +922,12 @@ void cmdShowState()
     CLI_DEV.print("  Update period    : ");
     CLI_DEV.print(clockConfig.syncUpdate);
     CLI_DEV.println(" seconds");
+    CLI_DEV.printf("  Brightness       : %d (night %d, %02d:00-%02d:00)\r\n", clockConfig.brightness, clockConfig.nightBrightness,
+                   clockConfig.nightStart, clockConfig.nightEnd);
+    CLI_DEV.print("  Time zone        : ");
+    CLI_DEV.println(clockConfig.timeZone);
+    CLI_DEV.print("  Broadcast client : ");
+    CLI_DEV.println(clockConfig.ntpBroadcast[0] == '\0' ? "off" : clockConfig.ntpBroadcast);
         
     CLI_DEV.println("");
     
@@ -313,6 +935,32 @@ void cmdShowState()
     CLI_DEV.print(interruptCount);
     CLI_DEV.println("");
 
+    CLI_DEV.printf("Main loop: %ld iterations per second, display rendered %ld times\r\n", loopsPerSecond, renderCount);
+
+    ppbToStr(tbFreqPpb, tmpStr);
+    CLI_DEV.printf("Timebase: second edge %ld us from true second, frequency correction %s ppm\r\n", tbPhaseErrorUs, tmpStr);
+    CLI_DEV.printf("Last NTP: offset %ld us, delay %ld us\r\n", tbOffsetUs, tbDelayUs);
+    CLI_DEV.printf("Poll interval: %d seconds, %s %ld seconds ago\r\n", ntpPollInterval(), ntpPollReason(), ntpPollAge());
+    CLI_DEV.printf("NTP requests: %lu us to resolve and send, %lu us average, %lu us worst\r\n", ntpGetRequestUs(),
+                   ntpGetRequestAvgUs(), ntpGetRequestWorstUs());
+    CLI_DEV.printf("Time to sync: %ld.%03ld s from boot, %ld.%03ld s from NTP client start\r\n", syncBootMs / 1000, syncBootMs % 1000,
+                   syncTimeMs / 1000, syncTimeMs % 1000);
+    if(tbInHoldover() == true)
+    {
+        CLI_DEV.printf("Holdover: %ld seconds, estimated error %ld us\r\n", tbHoldoverSeconds(), tbErrorUs());
+    }
+    else
+    {
+        CLI_DEV.printf("Holdover: no, estimated error %ld us\r\n", tbErrorUs());
+    }
+    CLI_DEV.printf("Valid time displayed: %ld.%03ld s from boot (%s start)\r\n", validBootMs / 1000, validBootMs % 1000,
+                   tbIsWarm() == true ? "warm" : "cold");
+#ifdef __WITH_NTP_SERVER
+    CLI_DEV.printf("Serving time: %lu requests per second (peak %lu), latency %lu us average, %lu us worst, %lu served, %lu ignored\r\n",
+                   ntpServerRate(), ntpServerPeakRate(), ntpServerAvgUs(), ntpServerWorstUs(), ntpServerServed(), ntpServerIgnored());
+#endif
+    cmdShowNtpSources();
+
     sprintf(tmpStr, "Reachability: 0x%08x (0b", reachability);
     CLI_DEV.print(tmpStr);
     binToStr(reachability, tmpStr, 16);
@@ -440,6 +1088,8 @@ void cmdShowHardware()
 void cmdReboot()
 {
     CLI_DEV.printf("Rebooting...\r\n");
+    tbSave(true);
+    tslogFlush();
     ESP.restart();
 }
 
@@ -569,6 +1219,38 @@ void cmdRename()
     }
 }
 
+// tslog [flush|clear]
+// Time-series log segments, write what's waiting to FFat now or remove them all
+void cmdTslog()
+{
+    unsigned long int seg;
+
+    if(paramCount > 0)
+    {
+        if(strcmp(paramPtr[0], "flush") == 0)
+        {
+            tslogFlush();
+        }
+        else if(strcmp(paramPtr[0], "clear") == 0)
+        {
+            tslogClear();
+        }
+        else
+        {
+            CLI_DEV.println("tslog [flush|clear]");
+            return;
+        }
+    }
+
+    CLI_DEV.println("Time-series log segments:");
+    for(seg = tslogFirst(); seg <= tslogLast(); seg++)
+    {
+        CLI_DEV.printf(" %08lu\t%ld\r\n", seg, tslogSegmentBytes(seg));
+    }
+    CLI_DEV.printf("%d records waiting, %lu written, %lu dropped\r\n", tslogPending(), tslogGetWritten(), tslogGetDropped());
+    CLI_DEV.printf("%ld bytes free on FFat\r\n", FFat.freeBytes());
+}
+
 void cmdFormat()
 {
     FFat.end();
@@ -584,6 +1266,7 @@ void cmdFormat()
     if(FFat.begin() == true)
     {
         CLI_DEV.println("Mounted filesystem");
+        initTslog();
     }
 }
 
@@ -716,6 +1399,9 @@ void cmdWebConfig()
 #else
     WiFi.disconnect();
 #endif
+
+    // WiFi has gone from under everything
+    cliRestartAll = true;
 }
 
 #endif
@@ -738,62 +1424,115 @@ void cmdListCommands()
     CLI_DEV.println("'exit' to finish");
 }
 
-void commandInterpretter()
+void cliStart()
 {
-    int cmd;
-    int done;
+    memcpy(&cliConfig, &clockConfig, sizeof(cliConfig));
+    cliRestartAll = false;
+    cliLen = 0;
+    cliActive = true;
 
     CLI_DEV.print(HELLO_STR);
     CLI_DEV.println("");
+    CLI_DEV.print(CLI_PROMPT);
+}
+
+// Session over, put any configuration changes into use
+void cliEnd()
+{
+    cliActive = false;
+    configChanged(&cliConfig, cliRestartAll);
+}
 
-    // Something other than the time...
-    ledColData[0] = 0;
-    ledColData[1] = 2;
-    ledColData[2] = 2;
-    ledColData[3] = 7;
-    ledColData[4] = 2;
-    ledColData[5] = 2;
+// Run the command in serialBuff
+void cliDoLine()
+{
+    int cmd;
+    char *cmdName;
 
-    done = false;
-    do
+    cmdName = cliParseLine();
+    if(cmdName != NULL)
     {
-        CLI_DEV.print(CLI_PROMPT);
-		
+        if(strcmp("exit", cmdName) == 0)
+        {
+            CLI_DEV.println("CLI exit");
 #ifdef __WITH_TELNET_CLI
-        telnetReadline();
-#else
-        serialReadline();
+            telnet.disconnectClient();
 #endif
- 
-        if(serialBuff[0] != '\0')
+            cliEnd();
+            return;
+        }
+
+        cmd = 0;
+        while(cmdList[cmd].cmdName != NULL && strcmp(cmdList[cmd].cmdName, cmdName) != 0)
         {
-            if(strcmp("exit", serialBuff) == 0)
-            {
-                done = true;
-            }
-            else
-            {
-                cmd = 0;
-                while(cmdList[cmd].cmdName != NULL && strcmp(cmdList[cmd].cmdName, serialBuff) != 0)
-                {
-                    cmd++;
-                }
-  
-                if(cmdList[cmd].cmdName == NULL)
-                {
-                    CLI_DEV.println("Bad command");
-                }
-                else
-                {
-                    cmdList[cmd].fn();
-                }
-            }
+            cmd++;
+        }
+
+        if(cmdList[cmd].cmdName == NULL)
+        {
+            CLI_DEV.println("Bad command");
+        }
+        else
+        {
+            cmdList[cmd].fn();
         }
     }
-    while(done == false);
 
-    CLI_DEV.println("CLI exit");
+    CLI_DEV.print(CLI_PROMPT);
+}
+
+// Every time round loop() - start a session, or carry on with one
+void cliPoll()
+{
 #ifdef __WITH_TELNET_CLI
-    telnet.disconnectClient();
+    telnet.loop();
+    if(newTelnetConnection == true)
+    {
+        newTelnetConnection = false;
+        cliStart();
+    }
+
+    if(cliActive == true)
+    {
+        if(telnetLineReady() == true)
+        {
+            cliDoLine();
+        }
+
+        if(cliActive == true && telnetHungUp() == true)
+        {
+            Serial.println("[TNET] CLI session ended by disconnecting");
+            cliEnd();
+        }
+    }
+#else
+    // If someone's plugged the serial cable in and pressed a key, start a session
+    while(Serial.available() > 0)
+    {
+        if(cliActive == false)
+        {
+            cliStart();
+        }
+
+        if(cliSerialChar(Serial.read()) == true)
+        {
+            cliDoLine();
+        }
+    }
 #endif
 }
+
+boolean cliRunning()
+{
+    return cliActive;
+}
+
+// A whole session, for when there's nothing else to do - no configuration at start up
+void commandInterpretter()
+{
+    cliStart();
+    while(cliActive == true)
+    {
+        cliPoll();
+    }
+}
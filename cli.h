@@ -1,19 +1,31 @@
 void printWifiStatus();
-void telnetReadline();
-void serialReadline();
+boolean cliSerialChar(int inchar);
+char *cliParseLine();
 void cmdSaveConfig();
 void cmdClearConfig();
 void cmdGetConfig();
 void cmdSsid();
+void cmdDisplayUsage();
+void cmdDisplayBrightness();
 void cmdDisplay();
+void cmdIsr();
 void cmdPassword();
 void cmdNtpServer();
+void cmdHistory();
+void cmdBroadcast();
+void cmdJitter();
+void cmdDns();
+void cmdShowNtpSources();
+void cmdTasks();
+void cmdMorse();
 void cmdShowState();
 void cmdInitUpdate();
 void cmdSyncUpdate();
 void cmdSyncValid();
 void cmdShowVersion();
 void cmdShowTime();
+void cmdTimezone();
+void cmdTimezoneBench();
 #ifdef __MK1_HW
 void cmdWiFiVersion();
 #else
@@ -29,7 +41,13 @@ void cmdTypeFile();
 void cmdFtpUsername();
 void cmdFtpPassword();
 void cmdReboot();
+void cmdTslog();
 #endif
 void cmdWebConfig();
 void cmdListCommands();
+void cliStart();
+void cliEnd();
+void cliDoLine();
+void cliPoll();
+boolean cliRunning();
 void commandInterpretter();
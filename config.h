@@ -14,6 +14,9 @@
 #define __WITH_HTTP              // To enable configuration and status web pages
 #define __WITH_OTA               // To enable OTA updates with Arduino IDE
 #define __WITH_FTP               // To enable simple FTP server
+//#define __DISPLAY_DMA            // MK2 only - multiplex display with LCD_CAM and DMA instead of a timer interrupt
+#define __WITH_NTP_SERVER        // MK2 only - answer SNTP requests from the LAN
+#define __WITH_NET_TASK          // MK2 only - HTTP, FTP, OTA and telnet status servers in their own task on the other core
 
 // Software version information
 #define SW_VER         "1.02"
@@ -26,14 +29,78 @@
 #define EEPROM_VALID   0xdeadbeef
 
 // NTP configuration
-#define NTP_PORT       123       // local port number
-#define NTP_TIMEOUT    5000      // Timeout for NTP response in ms
-#define SYNC_UPDATE    900       // number of seconds between NTP polls once stable
-#define INIT_UPDATE    20        // initial time between NTP polls 
+#define NTP_PORT       123       // NTP server port number
+#define NTP_CLIENT_PORT 1123     // local port for NTP client requests, leaves NTP_PORT for the server
+#define NTP_TIMEOUT    1000      // Timeout for NTP response in ms
+#define NTP_PACKET_SIZE 48       // NTP packet without extensions
+#define NTP_LI_VN_MODE 0x23      // Request - no leap indicator, version 4, mode 3 (client)
+#define NTP_MODE_CLIENT 3        // Mode in requests from a client
+#define NTP_MODE_SERVER 4        // Mode in replies from a server
+#define NTP_MODE_BROADCAST 5     // Mode in broadcasts from a server
+#define NTP_BCAST_LEN  16        // Longest broadcast setting - "broadcast" or a multicast group address
+#define NTP_RX_QUEUE   8         // Replies timestamped on arrival and waiting for loop()
+#define NTP_HIST_BINS  16        // Jitter histogram bins, each twice as wide as the last
+#define NTP_HIST_SHIFT 4         // First bin is under 2^NTP_HIST_SHIFT (16) us
+#define NTP_BCAST_TIMEOUT 200    // Seconds without a broadcast before going back to polling - about 3 broadcasts at 64s
+#define NTP_UNIX_OFFSET 2208988800LL // Seconds from 1900 (NTP) to 1970 (unix)
+#define NTP_EXTRA_SERVERS 3      // NTP servers that can be configured as well as the main one
+#define NTP_MAX_SOURCES 8        // Server addresses used at once
+#define NTP_MAX_PER_NAME 4       // Addresses used from one server (pool) name
+#define NTP_FILTER_SIZE 8        // Samples kept for each source
+#define NTP_MIN_CLUSTER 3        // Clustering stops with this many survivors
+#define NTP_MAX_DIST_US 1500000  // Sources with more root distance than this aren't used
+#define NTP_PRECISION_US 1000    // Dispersion of a new sample - the display is only good to a ms anyway
+#define NTP_PHI_PPM    15        // Dispersion growth with age, us per second
+#define SYNC_UPDATE    900       // longest number of seconds between NTP polls once stable
+#define INIT_UPDATE    20        // initial (and shortest) time between NTP polls 
 #define SYNC_VALID     5         // How many initial NTP responses needed before "stable"
-#define MAX_NTP_TIMEOUTS 5       // How many NTP timeouts allowed before doing a complete reset
+#define NTP_START_SPREAD 16      // First poll after the NTP client starts is up to this many seconds late, different on each clock
+#define NTP_POLL_JITTER 8        // Poll intervals are moved by up to 1/NTP_POLL_JITTER of themselves either way
+#define NTP_BACKOFF_LEVELS 16    // Most doublings of the poll interval while nothing replies - syncUpdate limits it first
+#define NTP_KOD_HOLDOFF 64       // Seconds a source that sent a RATE kiss-o'-death is left alone, doubles each time
+#define NTP_KOD_MAX_SHIFT 4      // up to NTP_KOD_HOLDOFF * 16
+#define NTP_BURST_COUNT 8        // Requests sent close together when the NTP client starts
+#define NTP_BURST_INTERVAL 2     // Seconds between them
+#define NTP_BURST_MIN  3         // Samples the system peer needs since the last step before the clock counts as synchronised
+#define HIST_REPLY     'R'       // History results - a reply was used
+#define HIST_TIMEOUT   'T'       // no reply
+#define HIST_FAILED    'F'       // replies, but sources didn't agree or the request couldn't be sent
+#define NTP_POLL_LIMIT 4         // Stable replies in a row before the poll interval doubles
+#define NTP_POLL_GATE  4         // Offsets within this many times the jitter are stable
+#define NTP_POLL_FREQ_PPB 250    // Frequency correction change that halves the poll interval (1ppm drift with TB_FLL_GAIN 4)
+#define NTP_SERVER_VN_MODE 0x24  // Server reply - no leap indicator, version 4, mode 4 (server)
+#define NTP_SERVER_ALARM 0xc0    // Leap indicator 3 - clock not synchronised
+#define NTP_SERVER_PRECISION -10 // log2 seconds, about a millisecond like NTP_PRECISION_US
+#define NTP_STRATUM_UNSYNC 16    // Stratum while not synchronised
+
+// DNS cache for the NTP server names
+#define DNS_CACHE_SIZE 4         // Names cached - ntpServer and NTP_EXTRA_SERVERS
+#define DNS_NAME_LEN   32        // Same as the ntpServer setting
+#define DNS_MAX_ADDRS  8         // Addresses kept for a name, pool names give 4
+#define DNS_PORT       53        // DNS server port number
+#define DNS_LOCAL_PORT 1053      // Local port for DNS queries
+#define DNS_PACKET_SIZE 512      // Biggest DNS message over UDP
+#define DNS_TIMEOUT    2000      // ms to wait for an answer
+#define DNS_MIN_TTL    60        // Seconds - never refresh more often than this
+#define DNS_MAX_TTL    86400     // or keep an answer for longer than this
+#define DNS_DEFAULT_TTL 300      // TTL used when it isn't known (MK1, WiFi101 only gives back an address)
+#define DNS_MAX_STALE  86400     // Seconds past its TTL an entry is still used while refreshes fail
 
 #define TICKTIME       1000      // ms tick time for normal operation of state machine
+#define HOLDOVER_RETRY 30        // Seconds between WiFi reconnect attempts in holdover
+#define HOLDOVER_SETTLE 2        // Seconds in holdover before a connected WiFi counts as back
+
+// Timebase - the second edge generator disciplined by NTP
+#define TB_STEP_US     128000    // Offsets bigger than this step the time instead of slewing it
+#define TB_PHASE_SLEW  16        // Phase offsets are slewed out over about this many seconds
+#define TB_MAX_SLEW_US 500       // Most phase correction in one second (500us per second = 500ppm)
+#define TB_FLL_GAIN    4         // Correct 1/TB_FLL_GAIN of the frequency error seen between polls
+#define TB_FLL_MIN_S   16        // Shortest time between polls to estimate frequency from
+#define TB_MAX_FREQ_PPB 500000   // Frequency correction limit in parts per billion (500ppm)
+#define TB_MIN_ARM_US  1000      // Never arm the second edge timer for less than this from now
+#define TB_HOLDOVER_PPB 1000     // Frequency uncertainty assumed in holdover on top of the measured wander (temperature)
+#define TB_SAVE_VALID  0x7b5ea7ed // Marks saved timebase state as valid
+#define TB_SAVE_S      3600      // Seconds between saves of the timebase state to FFat
 
 #define TELNET_PORT    23        // Port for telnet server to listen on
 
@@ -46,14 +113,41 @@
 // Command line interpretter
 #define SERBUFF_LEN    80        // Command line buffer size
 #define CLI_PROMPT     "clock> " // Prompt
-#define MAX_PARAMS     4         // Maximum number of command lineparameters
+#define MAX_PARAMS     8         // Maximum number of command lineparameters
 
 // Clock display dimensions
 #define MAX_COLS       6         // Number of columns in display      
 #define MAX_ROWS       4         // Number of rows in display
+#define DISP_FRAMES    4         // Display frame slots - latest, being shown, armed for the next second and being built
+#define DISP_GPIO_BANKS 2        // Number of 32 bit GPIO output registers the display pins can be spread over
+#define DISP_STATS_WINDOW 1024   // Number of display interrupts averaged for ISR cost figures
+#define DISP_PLANES    4         // Bit planes for bit angle modulation - 4 gives brightness 0-15
+#define DISP_MAX_LEVEL 15        // Full brightness
+
+// Time zone
+#define TZ_LEN         48        // Longest POSIX TZ string that can be configured
+#define TZ_NAME_LEN    8         // Longest time zone abbreviation
+#define TZ_BENCH_COUNT 10000     // Conversions timed by "timezone bench"
+
+// Reasons for redrawing the display
+#define RENDER_TICK    0x01      // Time has moved on
+#define RENDER_INPUT   0x02      // Mode switch or a button changed
+#define RENDER_SYNC    0x04      // NTP sync state changed
 
 // Morse code timing
-#define MORSE_DELAY    60        // Dot period in ms (T=1200/WPM)
+#define MORSE_TEXT_LEN 40        // Longest text that can be sent from the CLI or web page
+#define MORSE_MSG_LEN  (MORSE_TEXT_LEN * 14) // Most on/off elements in one message - up to 14 for a character ("$" is 7 symbols), an IP address is up to 132
+#define MORSE_QUEUE    1024      // Elements waiting to be sent, a message goes in whole or not at all
+#define MORSE_ON       0x80      // Element has the beeper on
+#define MORSE_SPACE    0x40      // Element is a gap between characters or words, stretched for Farnsworth spacing
+#define MORSE_UNITS    0x3f      // The rest is how many dot periods
+#define MORSE_MIN_WPM  5         // Slowest speed that can be set
+#define MORSE_MAX_WPM  40        // Fastest - a 30ms dot
+#define MORSE_MAX_PITCH 4000     // Highest tone in Hz
+#define MORSE_EDGE_MS  5         // MK2 - tone fades in and out over this long so it doesn't click
+#define MORSE_LEDC_CHANNEL 0     // MK2 - LEDC channel for the tone
+#define MORSE_LEDC_BITS 10       // MK2 - duty resolution
+#define MORSE_LEDC_DUTY 512      // MK2 - duty with the tone on, half of 2^MORSE_LEDC_BITS for a square wave
 
 // Default values for configuration if nothing found at startup
 #define DEFAULT_SSID   "ballacurmudgeon"
@@ -62,6 +156,15 @@
 #define DEFAULT_HOSTNAME "ntpclock"
 #define DEFAULT_FTPUSER "user"
 #define DEFAULT_FTPPSWD "secret"
+#define DEFAULT_BRIGHTNESS DISP_MAX_LEVEL
+#define DEFAULT_NIGHT_BRIGHTNESS 4
+#define DEFAULT_NIGHT_START 0    // Night dimming off by default (start == end)
+#define DEFAULT_NIGHT_END 0
+#define DEFAULT_NTP_BCAST ""     // Unicast polling only
+#define DEFAULT_TZ     "GMT0BST,M3.5.0/1,M10.5.0"  // UK - GMT, BST from 01:00 last Sunday in March to 02:00 last Sunday in October
+#define DEFAULT_MORSE_WPM 20     // 60ms dot, as it always was
+#define DEFAULT_MORSE_FARNSWORTH 20 // Overall speed with longer gaps between characters - same as DEFAULT_MORSE_WPM for none
+#define DEFAULT_MORSE_PITCH 700  // Tone in Hz, 0 for a DC level for a buzzer with its own oscillator (MK1 always is)
 
 // Access point setup for configuration mode
 #define AP_SSID        "NTPClock"
@@ -83,7 +186,7 @@
 #ifdef __MK1_HW
 // For MK1 hardware (Veroboard)
 
-#define DISP_INTS_PER_SECOND 400 // Display timer interrupts per second
+#define DISP_INTS_PER_SECOND 400 // Display columns per second
 
 // GPIO Pins...
 
@@ -109,14 +212,32 @@
 #define PIN_DATETIME   5         // LOW = show date instead of time
 #define PIN_MODESEL    4         // LOW = 12 hour mode, HIGH = 24 hour mode
 
+// Second edge timer is TC3 at 48MHz / 1024 = 46875Hz
+#define TB_US_TO_TICKS(x) (((x) * 3) / 64) // 46875 / 1000000 = 3 / 64
+#define TB_MAX_TICKS   65535     // 16 bit counter, about 1.4 seconds
+
+#define HIST_SIZE      32        // NTP polls kept in the history ring buffer - only 32K of RAM
+
 #else
 
 // For MK2 hardware (PCB)
 
 #define TIMER0_PRESCALE 80       // Display timer prescaler value - timer clock = 80MHz / TIMER_PRESCALE = 1MHz (1us period)
-#define TIMER0_RELOAD   3000     // Display timer will interrupt after TIMER_PRESCALE * TIMER_RELOAD = 1us * 3000 = 3ms
+#define TIMER0_RELOAD   2000     // Display timer will interrupt after TIMER_PRESCALE * TIMER_RELOAD = 1us * 2000 = 2ms
+#define DISP_INTS_PER_SECOND (1000000 / TIMER0_RELOAD) // Display columns per second
+#define DISP_BAM_UNIT   (TIMER0_RELOAD / DISP_MAX_LEVEL) // Timer ticks for the shortest bit plane
+#define TB_TIMER        1        // Hardware timer for the second edge
+#define TB_TIMER_PRESCALE 80     // Second edge timer clock = 80MHz / 80 = 1MHz (1us period)
+#define DISP_DMA_CLKM_DIV 250    // LCD_CAM clock divider for DMA display - 40MHz / 250 = 160kHz
+#define DISP_DMA_CLKCNT 3        // LCD_CAM second divider - 160kHz / (3 + 1) = 40kHz (25us) per output word
+#define DISP_DMA_SLOT_WORDS 80   // Output words per column - 80 * 25us = 2ms, same as the timer version
+#define DISP_DMA_BLANK_WORDS 5   // Words at the start of each column with everything off
+#define DISP_DMA_UNIT_WORDS 5    // Words per brightness step - 5 + 15 * 5 = DISP_DMA_SLOT_WORDS
+#define DISP_DMA_PATTERN_BYTES (MAX_COLS * DISP_DMA_SLOT_WORDS * 2) // Size of one complete multiplex pattern
+#define DISP_DMA_SETTLE_MS 25    // Time for DMA to finish one pattern (6 * 2ms) and move to the next, with margin
 #define BIT_SYNCLED     0x04     // Bit for NTP synchronisation LED in "hours" LEDs
 #define CONFIG_FILENAME "/config.dat"  // The filename for configuration information
+#define TB_SAVE_FILENAME "/timebase.dat" // The filename for frequency correction and last good time
 #define RGB_OFF         0        // RGB value to use to turn colour off 
 #define RGB_VAL         10       // RGB value to use to turn colour on at sensible brightness
 
@@ -145,4 +266,27 @@
 
 #define PIN_BOOT       0         // Boot button
 
+#define HIST_SIZE      2048      // NTP polls kept in the history ring buffer, in PSRAM
+
+// Time-series log on FFat - 8 segments of 64K is about 3 days at one record every 15 seconds
+#define TSLOG_DIR      "/tslog"  // Directory the log segments go in, named by segment number
+#define TSLOG_MAGIC    0x474c5354 // "TSLG" at the start of each segment
+#define TSLOG_VERSION  1         // Record format version in the segment header
+#define TSLOG_SAMPLE_S 15        // Seconds between records
+#define TSLOG_FLUSH_S  60        // Seconds between writes to FFat
+#define TSLOG_BATCH    8         // Records held in RAM between writes
+#define TSLOG_SEGMENT_BYTES 65536 // Most bytes in one segment, header included
+#define TSLOG_SEGMENTS 8         // Segments kept, the oldest goes when a new one starts
+#define TSLOG_MIN_FREE 65536     // FFat space always left for config, web pages and uploads
+#define TSLOG_SYNCED   0x01      // Record flags - NTP synchronised
+#define TSLOG_HOLDOVER 0x02      // in holdover
+#define TSLOG_WIFI     0x04      // WiFi connected
+
+// Tasks - loop() is on core 1 with the display and second edge interrupts, WiFi and lwIP are on core 0
+#define NET_TASK_CORE  0         // Core for the network services task
+#define NET_TASK_STACK 8192      // Its stack in bytes
+#define NET_TASK_PRIORITY 1      // Same as loop()
+#define TASK_QUEUE     8         // Requests from the network task waiting for loop()
+#define TASK_CALL_MS   1000      // Longest the network task waits for loop() to do one
+
 #endif
@@ -0,0 +1,866 @@
+#include "config.h"
+
+#ifdef __MK1_HW
+#include <WiFi101.h>
+#include "Timer5.h"
+#else
+#include <WiFi.h>
+#include "soc/soc.h"
+#include "soc/gpio_reg.h"
+#include "driver/timer.h"
+#ifdef __DISPLAY_DMA
+#include <driver/periph_ctrl.h>
+#include <driver/gpio.h>
+#include <esp_private/gdma.h>
+#include <esp_heap_caps.h>
+#include <esp_rom_gpio.h>
+#include <esp_rom_sys.h>
+#include <hal/dma_types.h>
+#include <hal/gpio_hal.h>
+#include <soc/lcd_cam_struct.h>
+#include <soc/gpio_sig_map.h>
+#endif
+#ifdef __WITH_TELNET_CLI
+#include <ESPTelnet.h>
+#endif
+#endif
+
+#include "types.h"
+#include "globals.h"
+#include "display.h"
+
+// The multiplex engine...
+//   Every interrupt turns off the current column, loads the row data for the next one and turns it on
+//   Instead of working out which pins change with digitalWrite() every time, a table of GPIO register
+//   masks is built once for every column and every possible 4 bit value.
+//   Each interrupt is then one "clear" store and one "set" store per GPIO bank.
+//   The original digitalWrite() version is kept so the two can be compared with the "isr" command
+//
+// Brightness...
+//   Each LED has a level of 0-15 (its own brightness scaled by the global brightness).
+//   Bit angle modulation splits the time a column is on into DISP_PLANES steps of 1, 2, 4 and 8
+//   units and lights an LED during the steps matching the bits of its level.
+//   That's one timer interrupt per step instead of one per column, and steps lighting the same
+//   LEDs are merged, so at full brightness it's back to one interrupt per column.
+
+#ifdef __MK2_HW
+hw_timer_t *timer0 = NULL;
+#endif
+
+#if defined(__DISPLAY_DMA) && defined(__MK1_HW)
+#error "__DISPLAY_DMA needs the ESP32-S3 LCD_CAM peripheral"
+#endif
+
+// [column][4 bit value] -> register masks
+dispMask_t dispMasks[MAX_COLS][16];
+
+// Display frames...
+//   Whatever is changing the display builds a complete new frame in a spare slot with
+//   dispBackFrame() and then makes it current with dispPublish(), which only changes dispLatest.
+//   The ISR moves to the latest frame when it gets back to column 0, so it never shows half
+//   of one frame and half of another.
+//   A frame can also be armed with dispArm() - it's then published by dispFireArmed() from the
+//   second edge interrupt so the seconds change exactly on the second.
+//   There are four slots so there's always one that is neither the latest, being shown nor armed.
+//   Anything that wants to look at the display takes a copy with dispGetFrame(), which tries
+//   again if something was published while it was copying.
+dispFrame_t dispFrames[DISP_FRAMES];
+volatile int dispLatest;
+volatile int dispShowing;
+volatile unsigned long int dispPublishCount;
+volatile int dispArmed;                             // Frame waiting for the second edge, -1 for none
+int dispBack;
+
+// Bit angle modulation
+volatile int dispStep;                              // Step of the current column being shown
+unsigned char dispLevel[MAX_COLS][MAX_ROWS];        // Brightness level of each LED, 0-15
+int dispGlobalLevel;                                // Global brightness
+unsigned long int dispUnitTicks;                    // Timer ticks for the shortest bit plane
+unsigned long int dispTimerStartMs;                 // When the display timer started, for interrupt rates
+
+// ISR cost accumulated over DISP_STATS_WINDOW interrupts
+unsigned long int dispCycleSum;
+unsigned long int dispCycleMax;
+int dispCycleSamples;
+
+// Read the free running CPU cycle counter
+#ifdef __MK1_HW
+static inline unsigned long int dispCycleCount()
+{
+    // SysTick counts down from LOAD to 0 once a millisecond at the CPU clock
+    return SysTick->VAL;
+}
+
+static inline unsigned long int dispCycleDiff(unsigned long int start, unsigned long int end)
+{
+    if(end <= start)
+    {
+        return start - end;
+    }
+    else
+    {
+        return start + (SysTick->LOAD + 1) - end;
+    }
+}
+#else
+static inline unsigned long int IRAM_ATTR dispCycleCount()
+{
+    return ESP.getCycleCount();
+}
+
+static inline unsigned long int IRAM_ATTR dispCycleDiff(unsigned long int start, unsigned long int end)
+{
+    return end - start;
+}
+#endif
+
+// Display interrupts per second since the timer started
+unsigned long int dispInterruptRate()
+{
+    unsigned long int seconds;
+
+    seconds = (millis() - dispTimerStartMs) / 1000;
+    if(seconds == 0)
+    {
+        return 0;
+    }
+
+    return interruptCount / seconds;
+}
+
+// CPU clock in MHz, to turn cycles into microseconds
+unsigned long int dispCpuMHz()
+{
+#ifdef __MK1_HW
+    return F_CPU / 1000000;
+#else
+    return ESP.getCpuFreqMHz();
+#endif
+}
+
+// Work out which GPIO bank and bit a pin lives in
+void dispPinBank(int pin, int *bank, unsigned long int *bit)
+{
+#ifdef __MK1_HW
+    *bank = g_APinDescription[pin].ulPort;
+    *bit = 1ul << g_APinDescription[pin].ulPin;
+#else
+    *bank = pin / 32;
+    *bit = 1ul << (pin % 32);
+#endif
+}
+
+// Build the register masks for every column and value
+// Turning a column on also turns the previous column off, so that's included in the clear mask
+// Rows that don't have an LED on this column are always turned off
+void dispBuildMasks()
+{
+    int col;
+    int prevCol;
+    int value;
+    int row;
+    int bank;
+    unsigned long int bit;
+    dispMask_t *mPtr;
+
+    for(col = 0; col < MAX_COLS; col++)
+    {
+        prevCol = col - 1;
+        if(prevCol < 0)
+        {
+            prevCol = MAX_COLS - 1;
+        }
+
+        for(value = 0; value < 16; value++)
+        {
+            mPtr = &dispMasks[col][value];
+            memset(mPtr, 0, sizeof(dispMask_t));
+
+            dispPinBank(ledColPins[prevCol], &bank, &bit);
+            mPtr -> clrMask[bank] |= bit;
+
+            for(row = 0; row < MAX_ROWS; row++)
+            {
+                dispPinBank(ledRowPins[row], &bank, &bit);
+                if(row < ledColSize[col] && (value & (1 << row)) != 0)
+                {
+                    mPtr -> setMask[bank] |= bit;
+                }
+                else
+                {
+                    mPtr -> clrMask[bank] |= bit;
+                }
+            }
+
+            dispPinBank(ledColPins[col], &bank, &bit);
+            mPtr -> setMask[bank] |= bit;
+        }
+    }
+}
+
+// Initialise display
+void initDisplay()
+{
+    int c;
+
+    for(c = 0; c < MAX_ROWS; c++)
+    {
+        pinMode(ledRowPins[c], OUTPUT);
+        digitalWrite(ledRowPins[c], LOW);
+    }
+
+    for(c = 0; c < MAX_COLS; c++)
+    {
+        pinMode(ledColPins[c], OUTPUT);
+        digitalWrite(ledColPins[c], LOW);
+    }
+
+    dispGlobalLevel = DISP_MAX_LEVEL;
+    memset(dispLevel, DISP_MAX_LEVEL, sizeof(dispLevel));
+#ifdef __MK1_HW
+    dispUnitTicks = 0;
+#else
+    dispUnitTicks = DISP_BAM_UNIT;
+#endif
+
+    memset(dispFrames, 0, sizeof(dispFrames));
+    for(c = 0; c < DISP_FRAMES; c++)
+    {
+        dispBamBuild(&dispFrames[c]);
+    }
+    dispLatest = 0;
+    dispArmed = -1;
+    dispShowing = 0;
+    dispBack = 0;
+    dispPublishCount = 0;
+
+    // First interrupt moves on to column 0
+    ledColSelect = MAX_COLS - 1;
+    dispStep = DISP_PLANES;
+
+    dispBuildMasks();
+    dispFastIsr = true;
+    dispResetIsrStats();
+}
+
+// Write one set of precomputed masks to the GPIO registers
+static inline void IRAM_ATTR dispWriteMasks(dispMask_t *mPtr)
+{
+#ifdef __MK1_HW
+    int bank;
+
+    for(bank = 0; bank < DISP_GPIO_BANKS; bank++)
+    {
+        PORT -> Group[bank].OUTCLR.reg = mPtr -> clrMask[bank];
+    }
+
+    for(bank = 0; bank < DISP_GPIO_BANKS; bank++)
+    {
+        PORT -> Group[bank].OUTSET.reg = mPtr -> setMask[bank];
+    }
+#else
+    REG_WRITE(GPIO_OUT_W1TC_REG, mPtr -> clrMask[0]);
+    REG_WRITE(GPIO_OUT1_W1TC_REG, mPtr -> clrMask[1]);
+    REG_WRITE(GPIO_OUT_W1TS_REG, mPtr -> setMask[0]);
+    REG_WRITE(GPIO_OUT1_W1TS_REG, mPtr -> setMask[1]);
+#endif
+}
+
+// Original version of the column update, one digitalWrite() per pin
+static inline void IRAM_ATTR dispWriteGpio(int col, int data)
+{
+    int c;
+    int prevCol;
+
+    prevCol = col - 1;
+    if(prevCol < 0)
+    {
+        prevCol = MAX_COLS - 1;
+    }
+
+    digitalWrite(ledColPins[prevCol], LOW);
+
+    for(c = 0; c < ledColSize[col]; c++)
+    {
+        if((data & 0x01) != 0)
+        {
+            digitalWrite(ledRowPins[c], HIGH);
+        }
+        else
+        {
+            digitalWrite(ledRowPins[c], LOW);
+        }
+
+        data = data >> 1;
+    }
+
+    digitalWrite(ledColPins[col], HIGH);
+}
+
+// Set how long until the next display interrupt
+static inline void IRAM_ATTR dispNextInterrupt(unsigned long int ticks)
+{
+#ifdef __MK1_HW
+    // TC5 runs in match frequency mode so CC0 is the period
+    TC5 -> COUNT16.CC[0].reg = ticks - 1;
+    while(TC5 -> COUNT16.STATUS.bit.SYNCBUSY);
+#else
+    timer_group_set_alarm_value_in_isr(TIMER_GROUP_0, TIMER_0, ticks);
+#endif
+}
+
+// Interrupt handler for display timer
+#ifdef __MK1_HW
+void displayInterrupt()
+#else
+void IRAM_ATTR displayInterrupt()
+#endif
+{
+    unsigned long int startCycles;
+    unsigned long int cycles;
+    int col;
+    int step;
+    dispBam_t *bam;
+
+    startCycles = dispCycleCount();
+
+    interruptCount++;
+
+    col = ledColSelect;
+    step = dispStep + 1;
+    if(step >= dispFrames[dispShowing].bam[col].count)
+    {
+        step = 0;
+        col++;
+        if(col == MAX_COLS)
+        {
+            col = 0;
+
+            // Only move to a newly published frame at the start of a scan
+            dispShowing = dispLatest;
+        }
+        ledColSelect = col;
+    }
+    dispStep = step;
+
+    bam = &dispFrames[dispShowing].bam[col];
+
+    if(dispFastIsr == true)
+    {
+        dispWriteMasks(&dispMasks[col][bam -> value[step]]);
+    }
+    else
+    {
+        dispWriteGpio(col, bam -> value[step]);
+    }
+
+    if(dispUnitTicks != 0)
+    {
+        dispNextInterrupt(bam -> ticks[step]);
+    }
+
+    cycles = dispCycleDiff(startCycles, dispCycleCount());
+    dispCycleSum = dispCycleSum + cycles;
+    if(cycles > dispCycleMax)
+    {
+        dispCycleMax = cycles;
+    }
+
+    dispCycleSamples++;
+    if(dispCycleSamples == DISP_STATS_WINDOW)
+    {
+        dispIsrAvgCycles = dispCycleSum / DISP_STATS_WINDOW;
+        dispIsrMaxCycles = dispCycleMax;
+        dispCycleSum = 0;
+        dispCycleMax = 0;
+        dispCycleSamples = 0;
+    }
+}
+
+void dispResetIsrStats()
+{
+    dispIsrAvgCycles = 0;
+    dispIsrMaxCycles = 0;
+    dispCycleSum = 0;
+    dispCycleMax = 0;
+    dispCycleSamples = 0;
+}
+
+#ifdef __DISPLAY_DMA
+
+// Hardware multiplexing...
+//   LCD_CAM is run as a 16 bit i8080 bus with only the data lines connected to anything.
+//   Data bits 0-5 drive the column pins and bits 6-9 drive the row pins.
+//   A pattern with a slot of DISP_DMA_SLOT_WORDS for every column is fed to it by GDMA using a
+//   descriptor that points back to itself, so the pattern repeats without any help from the CPU.
+//   The first DISP_DMA_BLANK_WORDS of each slot are all off, like turning off the old column
+//   before changing the rows in the ISR.
+//   There are two patterns.  A new one is built in whichever isn't being shown and the current
+//   descriptor is pointed at it, so the switch happens at the end of a complete pattern.
+
+gdma_channel_handle_t dispDmaChannel;
+dma_descriptor_t *dispDmaDesc = NULL;
+unsigned short *dispDmaBuff[2];
+int dispDmaActive;
+unsigned long int dispDmaSwitchMs;
+int dispDmaShown[MAX_COLS];
+boolean dispDmaRedraw;
+
+// The 16 bit word that shows one value on one column
+unsigned short dispDmaColumnWord(int col, int value)
+{
+    unsigned short word;
+    int row;
+
+    word = 1 << col;
+    for(row = 0; row < ledColSize[col]; row++)
+    {
+        if((value & (1 << row)) != 0)
+        {
+            word = word | (1 << (MAX_COLS + row));
+        }
+    }
+
+    return word;
+}
+
+// Build a complete multiplex pattern from six column values
+// Each column is blanked then has DISP_MAX_LEVEL brightness steps - an LED is lit for as many steps as its level
+void dispDmaRender(unsigned short *buff, int *data)
+{
+    int col;
+    int row;
+    int step;
+    int value;
+    int c;
+    unsigned short word;
+
+    for(col = 0; col < MAX_COLS; col++)
+    {
+        for(c = 0; c < DISP_DMA_BLANK_WORDS; c++)
+        {
+            *buff = 0;
+            buff++;
+        }
+
+        for(step = 0; step < DISP_MAX_LEVEL; step++)
+        {
+            value = 0;
+            for(row = 0; row < ledColSize[col]; row++)
+            {
+                if((data[col] & (1 << row)) != 0 && dispLevel[col][row] > step)
+                {
+                    value = value | (1 << row);
+                }
+            }
+
+            word = dispDmaColumnWord(col, value);
+            for(c = 0; c < DISP_DMA_UNIT_WORDS; c++)
+            {
+                *buff = word;
+                buff++;
+            }
+        }
+    }
+}
+
+void dispDmaBegin()
+{
+    int c;
+    gdma_channel_alloc_config_t dmaConfig;
+    gdma_transfer_ability_t dmaAbility;
+
+    periph_module_enable(PERIPH_LCD_CAM_MODULE);
+    periph_module_reset(PERIPH_LCD_CAM_MODULE);
+    LCD_CAM.lcd_user.lcd_reset = 1;
+    esp_rom_delay_us(100);
+
+    // 40MHz crystal / DISP_DMA_CLKM_DIV / (DISP_DMA_CLKCNT + 1) gives the word clock
+    LCD_CAM.lcd_clock.clk_en = 1;
+    LCD_CAM.lcd_clock.lcd_clk_sel = 1;
+    LCD_CAM.lcd_clock.lcd_ck_out_edge = 0;
+    LCD_CAM.lcd_clock.lcd_ck_idle_edge = 0;
+    LCD_CAM.lcd_clock.lcd_clk_equ_sysclk = 0;
+    LCD_CAM.lcd_clock.lcd_clkm_div_num = DISP_DMA_CLKM_DIV;
+    LCD_CAM.lcd_clock.lcd_clkm_div_a = 0;
+    LCD_CAM.lcd_clock.lcd_clkm_div_b = 0;
+    LCD_CAM.lcd_clock.lcd_clkcnt_n = DISP_DMA_CLKCNT;
+
+    // i8080 mode, 16 bit data, keep sending for as long as DMA has data
+    LCD_CAM.lcd_ctrl.lcd_rgb_mode_en = 0;
+    LCD_CAM.lcd_rgb_yuv.lcd_conv_bypass = 0;
+    LCD_CAM.lcd_misc.lcd_next_frame_en = 0;
+    LCD_CAM.lcd_data_dout_mode.val = 0;
+    LCD_CAM.lcd_user.lcd_always_out_en = 1;
+    LCD_CAM.lcd_user.lcd_8bits_order = 0;
+    LCD_CAM.lcd_user.lcd_bit_order = 0;
+    LCD_CAM.lcd_user.lcd_2byte_en = 1;
+    LCD_CAM.lcd_user.lcd_cmd = 0;
+
+    // DMA doesn't start reliably without at least one dummy phase
+    LCD_CAM.lcd_user.lcd_dummy = 1;
+    LCD_CAM.lcd_user.lcd_dummy_cyclelen = 0;
+
+    // Route LCD data lines to the display pins
+    for(c = 0; c < MAX_COLS; c++)
+    {
+        esp_rom_gpio_connect_out_signal(ledColPins[c], LCD_DATA_OUT0_IDX + c, false, false);
+        gpio_hal_iomux_func_sel(GPIO_PIN_MUX_REG[ledColPins[c]], PIN_FUNC_GPIO);
+    }
+
+    for(c = 0; c < MAX_ROWS; c++)
+    {
+        esp_rom_gpio_connect_out_signal(ledRowPins[c], LCD_DATA_OUT0_IDX + MAX_COLS + c, false, false);
+        gpio_hal_iomux_func_sel(GPIO_PIN_MUX_REG[ledRowPins[c]], PIN_FUNC_GPIO);
+    }
+
+    // Patterns and descriptors have to be in DMA capable internal RAM
+    dispDmaDesc = (dma_descriptor_t *)heap_caps_malloc(2 * sizeof(dma_descriptor_t), MALLOC_CAP_DMA);
+    dispDmaBuff[0] = (unsigned short *)heap_caps_malloc(DISP_DMA_PATTERN_BYTES, MALLOC_CAP_DMA);
+    dispDmaBuff[1] = (unsigned short *)heap_caps_malloc(DISP_DMA_PATTERN_BYTES, MALLOC_CAP_DMA);
+    if(dispDmaDesc == NULL || dispDmaBuff[0] == NULL || dispDmaBuff[1] == NULL)
+    {
+        Serial.println(" - can't allocate display DMA buffers");
+        dispDmaDesc = NULL;
+        return;
+    }
+
+    memcpy(dispDmaShown, dispFrames[dispLatest].col, sizeof(dispDmaShown));
+    for(c = 0; c < 2; c++)
+    {
+        dispDmaRender(dispDmaBuff[c], dispDmaShown);
+        dispDmaDesc[c].dw0.owner = DMA_DESCRIPTOR_BUFFER_OWNER_DMA;
+        dispDmaDesc[c].dw0.suc_eof = 0;
+        dispDmaDesc[c].dw0.size = DISP_DMA_PATTERN_BYTES;
+        dispDmaDesc[c].dw0.length = DISP_DMA_PATTERN_BYTES;
+        dispDmaDesc[c].buffer = dispDmaBuff[c];
+        dispDmaDesc[c].next = &dispDmaDesc[c];
+    }
+
+    memset(&dmaConfig, 0, sizeof(dmaConfig));
+    dmaConfig.direction = GDMA_CHANNEL_DIRECTION_TX;
+    gdma_new_channel(&dmaConfig, &dispDmaChannel);
+    gdma_connect(dispDmaChannel, GDMA_MAKE_TRIGGER(GDMA_TRIG_PERIPH_LCD, 0));
+
+    dmaAbility.sram_trans_align = 4;
+    dmaAbility.psram_trans_align = 64;
+    gdma_set_transfer_ability(dispDmaChannel, &dmaAbility);
+
+    dispDmaActive = 0;
+    dispDmaSwitchMs = millis();
+
+    gdma_reset(dispDmaChannel);
+    LCD_CAM.lcd_user.lcd_dout = 1;
+    LCD_CAM.lcd_user.lcd_update = 1;
+    LCD_CAM.lcd_misc.lcd_afifo_reset = 1;
+    gdma_start(dispDmaChannel, (intptr_t)&dispDmaDesc[0]);
+    esp_rom_delay_us(1);
+    LCD_CAM.lcd_user.lcd_start = 1;
+}
+
+#endif
+
+// Get an empty frame to build the next display in
+dispFrame_t *dispBackFrame()
+{
+    int c;
+    int latest;
+    int showing;
+    int armed;
+
+    latest = dispLatest;
+    showing = dispShowing;
+    armed = dispArmed;
+
+    c = 0;
+    while(c == latest || c == showing || c == armed)
+    {
+        c++;
+    }
+
+    dispBack = c;
+    memset(&dispFrames[dispBack], 0, sizeof(dispFrame_t));
+
+    return &dispFrames[dispBack];
+}
+
+// Make the frame from dispBackFrame() the one to show at the next second edge
+// Replaces anything armed already
+void dispArm()
+{
+    dispBamBuild(&dispFrames[dispBack]);
+
+    __sync_synchronize();
+    dispArmed = dispBack;
+}
+
+// Forget about any armed frame - something else is being shown
+void dispDisarm()
+{
+    dispArmed = -1;
+}
+
+// Called from the second edge interrupt to show the armed frame
+#ifdef __MK1_HW
+void dispFireArmed()
+#else
+void IRAM_ATTR dispFireArmed()
+#endif
+{
+    int armed;
+
+    armed = dispArmed;
+    if(armed >= 0)
+    {
+        dispLatest = armed;
+        dispArmed = -1;
+        dispPublishCount++;
+    }
+}
+
+// Work out the bit angle modulation steps for a frame
+void dispBamBuild(dispFrame_t *frame)
+{
+    int col;
+    int row;
+    int plane;
+    int value;
+    unsigned long int ticks;
+    dispBam_t *bam;
+
+    for(col = 0; col < MAX_COLS; col++)
+    {
+        bam = &frame -> bam[col];
+        bam -> count = 0;
+
+        for(plane = 0; plane < DISP_PLANES; plane++)
+        {
+            value = 0;
+            for(row = 0; row < ledColSize[col]; row++)
+            {
+                if((frame -> col[col] & (1 << row)) != 0 && (dispLevel[col][row] & (1 << plane)) != 0)
+                {
+                    value = value | (1 << row);
+                }
+            }
+
+            ticks = dispUnitTicks << plane;
+
+            if(bam -> count > 0 && bam -> value[bam -> count - 1] == value)
+            {
+                bam -> ticks[bam -> count - 1] = bam -> ticks[bam -> count - 1] + ticks;
+            }
+            else
+            {
+                bam -> value[bam -> count] = value;
+                bam -> ticks[bam -> count] = ticks;
+                bam -> count++;
+            }
+        }
+    }
+}
+
+// Make the frame from dispBackFrame() the one to display
+void dispPublish()
+{
+    dispBamBuild(&dispFrames[dispBack]);
+
+    // Frame contents have to be written before the ISR can see the new index
+    __sync_synchronize();
+    dispLatest = dispBack;
+    dispPublishCount++;
+
+    dispUpdate();
+}
+
+// Take a consistent copy of the current frame
+void dispGetFrame(dispFrame_t *frame)
+{
+    unsigned long int count;
+
+    do
+    {
+        count = dispPublishCount;
+        memcpy(frame, &dispFrames[dispLatest], sizeof(dispFrame_t));
+    }
+    while(count != dispPublishCount);
+}
+
+// Set global brightness (0-15) and work out the level of every LED
+// Republishes the current frame so the change shows straight away
+void dispSetBrightness(int level)
+{
+    int col;
+    int row;
+    dispFrame_t current;
+    dispFrame_t *frame;
+
+    if(level < 0)
+    {
+        level = 0;
+    }
+
+    if(level > DISP_MAX_LEVEL)
+    {
+        level = DISP_MAX_LEVEL;
+    }
+
+    dispGlobalLevel = level;
+
+    for(col = 0; col < MAX_COLS; col++)
+    {
+        for(row = 0; row < MAX_ROWS; row++)
+        {
+            dispLevel[col][row] = (clockConfig.ledBrightness[col][row] * level + (DISP_MAX_LEVEL / 2)) / DISP_MAX_LEVEL;
+        }
+    }
+
+    // The armed frame has the old brightness - the next render arms another
+    dispDisarm();
+
+    dispGetFrame(&current);
+    frame = dispBackFrame();
+    memcpy(frame -> col, current.col, sizeof(frame -> col));
+#ifdef __DISPLAY_DMA
+    dispDmaRedraw = true;
+#endif
+    dispPublish();
+}
+
+int dispGetBrightness()
+{
+    return dispGlobalLevel;
+}
+
+// Night dimming - pick the brightness for this hour of the day
+void dispScheduleBrightness(int hour)
+{
+    boolean night;
+    int level;
+
+    if(clockConfig.nightStart == clockConfig.nightEnd)
+    {
+        night = false;
+    }
+    else if(clockConfig.nightStart < clockConfig.nightEnd)
+    {
+        night = (hour >= clockConfig.nightStart && hour < clockConfig.nightEnd);
+    }
+    else
+    {
+        night = (hour >= clockConfig.nightStart || hour < clockConfig.nightEnd);
+    }
+
+    if(night == true)
+    {
+        level = clockConfig.nightBrightness;
+    }
+    else
+    {
+        level = clockConfig.brightness;
+    }
+
+    if(level != dispGlobalLevel)
+    {
+        dispSetBrightness(level);
+    }
+}
+
+// Load a whole frame from six column values
+void dispShowColumns(int c0, int c1, int c2, int c3, int c4, int c5)
+{
+    dispFrame_t *frame;
+
+    frame = dispBackFrame();
+    frame -> col[0] = c0;
+    frame -> col[1] = c1;
+    frame -> col[2] = c2;
+    frame -> col[3] = c3;
+    frame -> col[4] = c4;
+    frame -> col[5] = c5;
+    dispPublish();
+}
+
+// Bring the display hardware up to date with the latest frame
+// The timer ISR picks up new frames itself so there's nothing to do unless DMA is being used.
+// For DMA, the new pattern can only be built once the previous switch has finished,
+// so this is also called from loop() to catch up on anything that had to wait.
+void dispUpdate()
+{
+#ifdef __DISPLAY_DMA
+    int next;
+    int latest;
+
+    if(dispDmaDesc == NULL)
+    {
+        return;
+    }
+
+    latest = dispLatest;
+    if(dispDmaRedraw == false && memcmp(dispDmaShown, dispFrames[latest].col, sizeof(dispDmaShown)) == 0)
+    {
+        return;
+    }
+
+    // DMA might still be working through the pattern that isn't current
+    if(millis() - dispDmaSwitchMs < DISP_DMA_SETTLE_MS)
+    {
+        return;
+    }
+
+    next = 1 - dispDmaActive;
+    dispDmaRedraw = false;
+
+    memcpy(dispDmaShown, dispFrames[latest].col, sizeof(dispDmaShown));
+    dispDmaRender(dispDmaBuff[next], dispDmaShown);
+    dispDmaDesc[next].next = &dispDmaDesc[next];
+    __sync_synchronize();
+    dispDmaDesc[dispDmaActive].next = &dispDmaDesc[next];
+
+    dispDmaActive = next;
+    dispDmaSwitchMs = millis();
+    dispBufferWrites++;
+#endif
+}
+
+#ifdef __MK1_HW
+
+void initDisplayTimer()
+{
+    int c;
+
+    interruptCount = 0;
+    dispTimerStartMs = millis();
+    MyTimer5.begin(DISP_INTS_PER_SECOND);
+
+    // Whatever prescaler the library picked, the column period is in CC0
+    // Split it into brightness steps and rebuild the frames to use them
+    dispUnitTicks = (TC5 -> COUNT16.CC[0].reg + 1) / DISP_MAX_LEVEL;
+    for(c = 0; c < DISP_FRAMES; c++)
+    {
+        dispBamBuild(&dispFrames[c]);
+    }
+
+    MyTimer5.attachInterrupt(displayInterrupt);
+    MyTimer5.start();
+}
+
+#else
+
+void initDisplayTimer()
+{
+    interruptCount = 0;
+    dispBufferWrites = 0;
+    dispTimerStartMs = millis();
+
+#ifdef __DISPLAY_DMA
+    dispDmaBegin();
+#else
+    timer0 = timerBegin(0, TIMER0_PRESCALE, true);
+    timerAttachInterrupt(timer0, &displayInterrupt, true);
+    timerAlarmWrite(timer0, TIMER0_RELOAD, true);
+    timerAlarmEnable(timer0);
+#endif
+}
+
+#endif
@@ -0,0 +1,19 @@
+void initDisplay();
+void initDisplayTimer();
+void displayInterrupt();
+void dispBuildMasks();
+void dispResetIsrStats();
+unsigned long int dispCpuMHz();
+void dispUpdate();
+dispFrame_t *dispBackFrame();
+void dispPublish();
+void dispArm();
+void dispDisarm();
+void dispFireArmed();
+void dispGetFrame(dispFrame_t *frame);
+void dispShowColumns(int c0, int c1, int c2, int c3, int c4, int c5);
+void dispBamBuild(dispFrame_t *frame);
+void dispSetBrightness(int level);
+int dispGetBrightness();
+void dispScheduleBrightness(int hour);
+unsigned long int dispInterruptRate();
@@ -0,0 +1,464 @@
+#include "config.h"
+
+#ifdef __MK1_HW
+#include <WiFi101.h>
+#else
+#include <WiFi.h>
+#ifdef __WITH_TELNET_CLI
+#include <ESPTelnet.h>
+#endif
+#endif
+#include <WiFiUdp.h>
+
+#include "types.h"
+#include "globals.h"
+#include "dnscache.h"
+
+// DNS cache for the NTP server names...
+//   Looking the names up every poll meant a blocking WiFi.hostByName() each time, which took anything
+//   from a few ms to seconds and only ever gave back one of a pool's addresses.  Now each name is looked
+//   up once and all the A records in the answer are kept for as long as their TTL says.
+//   Once the TTL's run out the old addresses are still handed out and a query goes off in the
+//   background, the answer's picked up by dnsCacheTick() in loop().  Only a name that's never been
+//   seen (or hasn't been refreshed for DNS_MAX_STALE seconds) has to wait for an answer.
+//   Addresses are handed out starting from a different one each refresh, and any that the NTP client
+//   has given up on are left out until the next refresh so the others get tried instead.
+//   On MK2 the queries are built here and sent to the DHCP supplied DNS server, so all the addresses
+//   and the TTL can be read out of the answer.  WiFi101 only has hostByName(), so on MK1 a refresh still
+//   blocks, gives one address that's added to the ones already known and lasts DNS_DEFAULT_TTL.
+
+dnsEntry_t dnsCache[DNS_CACHE_SIZE];
+#ifdef __MK2_HW
+WiFiUDP dnsUDP;
+boolean dnsRunning = false;
+unsigned char dnsPacket[DNS_PACKET_SIZE];
+#endif
+
+void dnsCacheBegin()
+{
+#ifdef __MK2_HW
+    if(dnsRunning == false)
+    {
+        dnsRunning = (dnsUDP.begin(DNS_LOCAL_PORT) == 1);
+        if(dnsRunning == false)
+        {
+            Serial.println("[DNS ] Can't open the DNS socket");
+        }
+    }
+#endif
+}
+
+// The addresses stay cached while WiFi's gone, they'll be used again when it's back
+void dnsCacheEnd()
+{
+#ifdef __MK2_HW
+    int c;
+
+    if(dnsRunning == true)
+    {
+        dnsUDP.stop();
+        dnsRunning = false;
+    }
+
+    for(c = 0; c < DNS_CACHE_SIZE; c++)
+    {
+        dnsCache[c].refreshing = false;
+    }
+#endif
+}
+
+void dnsCacheFlush()
+{
+    memset(dnsCache, 0, sizeof(dnsCache));
+}
+
+#ifdef __MK2_HW
+// Position after the name at pos, -1 if it runs off the end
+int dnsSkipName(unsigned char *packet, int len, int pos)
+{
+    while(pos < len)
+    {
+        if(packet[pos] == 0)
+        {
+            return pos + 1;
+        }
+
+        if((packet[pos] & 0xc0) == 0xc0)
+        {
+            return pos + 2;
+        }
+
+        pos = pos + packet[pos] + 1;
+    }
+
+    return -1;
+}
+
+// Ask for the name's A records, the answer comes back to dnsCacheTick()
+boolean dnsQuery(dnsEntry_t *entry)
+{
+    int pos;
+    int label;
+    char *ptr;
+
+    if(dnsRunning == false)
+    {
+        return false;
+    }
+
+    entry -> queryId = (uint16_t)random(0x10000);
+
+    memset(dnsPacket, 0, 12);
+    dnsPacket[0] = entry -> queryId >> 8;
+    dnsPacket[1] = entry -> queryId & 0xff;
+    dnsPacket[2] = 0x01;                     // Recursion desired
+    dnsPacket[5] = 1;                        // One question
+
+    // Name as labels - "pool.ntp.org" is 4 pool 3 ntp 3 org 0
+    pos = 12;
+    ptr = entry -> name;
+    while(*ptr != '\0')
+    {
+        label = 0;
+        while(ptr[label] != '\0' && ptr[label] != '.')
+        {
+            label++;
+        }
+
+        if(label == 0 || label > 63)
+        {
+            return false;
+        }
+
+        dnsPacket[pos] = label;
+        memcpy(&dnsPacket[pos + 1], ptr, label);
+        pos = pos + label + 1;
+
+        ptr = ptr + label;
+        if(*ptr == '.')
+        {
+            ptr++;
+        }
+    }
+    dnsPacket[pos++] = 0;
+    dnsPacket[pos++] = 0;                    // Type A
+    dnsPacket[pos++] = 1;
+    dnsPacket[pos++] = 0;                    // Class IN
+    dnsPacket[pos++] = 1;
+
+    if(dnsUDP.beginPacket(WiFi.dnsIP(0), DNS_PORT) != 1)
+    {
+        return false;
+    }
+    dnsUDP.write(dnsPacket, pos);
+    if(dnsUDP.endPacket() != 1)
+    {
+        return false;
+    }
+
+    entry -> refreshing = true;
+    entry -> queryMs = millis();
+
+    return true;
+}
+
+// Take the addresses and the shortest TTL out of an answer
+void dnsAnswer(dnsEntry_t *entry, unsigned char *packet, int len)
+{
+    int pos;
+    int c;
+    int questions;
+    int answers;
+    int type;
+    int dataLen;
+    unsigned long int ttl;
+    IPAddress addr[DNS_MAX_ADDRS];
+    int addrCount;
+
+    entry -> refreshing = false;
+    entry -> answerMs = millis() - entry -> queryMs;
+
+    if((packet[3] & 0x0f) != 0)
+    {
+        Serial.printf("[DNS ] %s - error %d\r\n", entry -> name, packet[3] & 0x0f);
+        entry -> failures++;
+        return;
+    }
+
+    questions = (packet[4] << 8) | packet[5];
+    answers = (packet[6] << 8) | packet[7];
+
+    pos = 12;
+    for(c = 0; c < questions && pos >= 0; c++)
+    {
+        pos = dnsSkipName(packet, len, pos);
+        if(pos >= 0)
+        {
+            pos = pos + 4;
+        }
+    }
+
+    // CNAMEs are in here too, only the A records are wanted
+    addrCount = 0;
+    ttl = DNS_MAX_TTL;
+    for(c = 0; c < answers && pos >= 0; c++)
+    {
+        pos = dnsSkipName(packet, len, pos);
+        if(pos < 0 || pos + 10 > len)
+        {
+            break;
+        }
+
+        type = (packet[pos] << 8) | packet[pos + 1];
+        dataLen = (packet[pos + 8] << 8) | packet[pos + 9];
+        if(pos + 10 + dataLen > len)
+        {
+            break;
+        }
+
+        if(type == 1 && packet[pos + 3] == 1 && dataLen == 4 && addrCount < DNS_MAX_ADDRS)
+        {
+            addr[addrCount] = IPAddress(packet[pos + 10], packet[pos + 11], packet[pos + 12], packet[pos + 13]);
+            addrCount++;
+            ttl = min(ttl, ((unsigned long int)packet[pos + 4] << 24) | ((unsigned long int)packet[pos + 5] << 16) |
+                           ((unsigned long int)packet[pos + 6] << 8) | packet[pos + 7]);
+        }
+
+        pos = pos + 10 + dataLen;
+    }
+
+    if(addrCount == 0)
+    {
+        Serial.printf("[DNS ] %s - no addresses\r\n", entry -> name);
+        entry -> failures++;
+        return;
+    }
+
+    memcpy(entry -> addr, addr, sizeof(addr));
+    entry -> addrCount = addrCount;
+    entry -> avoid = 0;
+    entry -> rotate = (entry -> rotate + 1) % addrCount;
+    entry -> ttl = max(ttl, (unsigned long int)DNS_MIN_TTL);
+    entry -> resolvedMs = millis();
+}
+#else
+// Blocks - adds the address to the ones already known
+boolean dnsQuery(dnsEntry_t *entry)
+{
+    IPAddress addr;
+    unsigned long int startMs;
+    int c;
+
+    startMs = millis();
+    if(WiFi.hostByName(entry -> name, addr) != 1)
+    {
+        return false;
+    }
+    entry -> answerMs = millis() - startMs;
+
+    for(c = 0; c < entry -> addrCount; c++)
+    {
+        if(entry -> addr[c] == addr)
+        {
+            break;
+        }
+    }
+
+    if(c == entry -> addrCount)
+    {
+        if(entry -> addrCount < DNS_MAX_ADDRS)
+        {
+            entry -> addrCount++;
+        }
+        else
+        {
+            c = entry -> rotate;
+            entry -> avoid = entry -> avoid & ~(1 << c);
+        }
+        entry -> addr[c] = addr;
+        entry -> rotate = c;
+    }
+
+    entry -> ttl = DNS_DEFAULT_TTL;
+    entry -> resolvedMs = millis();
+
+    return true;
+}
+#endif
+
+// Called every time round loop() to pick up answers and give up on queries that have taken too long
+void dnsCacheTick()
+{
+#ifdef __MK2_HW
+    int c;
+    int len;
+    uint16_t id;
+    dnsEntry_t *entry;
+
+    if(dnsRunning == false)
+    {
+        return;
+    }
+
+    while((len = dnsUDP.parsePacket()) > 0)
+    {
+        len = dnsUDP.read(dnsPacket, DNS_PACKET_SIZE);
+        if(len < 12 || (dnsPacket[2] & 0x80) == 0)
+        {
+            continue;
+        }
+
+        id = (dnsPacket[0] << 8) | dnsPacket[1];
+        for(c = 0; c < DNS_CACHE_SIZE; c++)
+        {
+            if(dnsCache[c].refreshing == true && dnsCache[c].queryId == id)
+            {
+                dnsAnswer(&dnsCache[c], dnsPacket, len);
+            }
+        }
+    }
+
+    for(c = 0; c < DNS_CACHE_SIZE; c++)
+    {
+        entry = &dnsCache[c];
+        if(entry -> refreshing == true && millis() - entry -> queryMs > DNS_TIMEOUT)
+        {
+            Serial.printf("[DNS ] No answer for %s\r\n", entry -> name);
+            entry -> refreshing = false;
+            entry -> failures++;
+        }
+    }
+#endif
+}
+
+// Entry for a name, a new one (in the least recently used slot) if it's not cached
+dnsEntry_t *dnsFind(char *name)
+{
+    int c;
+    dnsEntry_t *entry;
+
+    entry = &dnsCache[0];
+    for(c = 0; c < DNS_CACHE_SIZE; c++)
+    {
+        if(strcmp(dnsCache[c].name, name) == 0)
+        {
+            return &dnsCache[c];
+        }
+
+        if(dnsCache[c].name[0] == '\0' || (entry -> name[0] != '\0' && millis() - dnsCache[c].usedMs > millis() - entry -> usedMs))
+        {
+            entry = &dnsCache[c];
+        }
+    }
+
+    memset(entry, 0, sizeof(dnsEntry_t));
+    strncpy(entry -> name, name, DNS_NAME_LEN - 1);
+
+    return entry;
+}
+
+// Addresses for a name, up to max of them, returns how many
+// Only waits for an answer if there's nothing cached
+int dnsLookup(char *name, IPAddress *addrs, int max)
+{
+    dnsEntry_t *entry;
+    unsigned long int age;
+    int count;
+    int pass;
+    int c;
+    int n;
+
+    // Already an address
+    if(addrs[0].fromString(name) == true)
+    {
+        return 1;
+    }
+
+    entry = dnsFind(name);
+    entry -> lookups++;
+    entry -> usedMs = millis();
+
+    age = (millis() - entry -> resolvedMs) / 1000;
+    if(entry -> resolvedMs != 0 && age >= entry -> ttl + DNS_MAX_STALE)
+    {
+        entry -> addrCount = 0;
+        entry -> resolvedMs = 0;
+    }
+
+    if(entry -> addrCount == 0)
+    {
+        entry -> misses++;
+        if(entry -> refreshing == false && dnsQuery(entry) == false)
+        {
+            entry -> failures++;
+        }
+
+        while(entry -> refreshing == true)
+        {
+            delay(1);
+            dnsCacheTick();
+        }
+    }
+    else if(age >= entry -> ttl)
+    {
+        entry -> stale++;
+        if(entry -> refreshing == false && dnsQuery(entry) == false)
+        {
+            entry -> failures++;
+        }
+    }
+    else
+    {
+        entry -> hits++;
+    }
+
+    // Addresses that have stopped answering only if there's nothing else
+    count = 0;
+    for(pass = 0; pass < 2 && count == 0; pass++)
+    {
+        for(c = 0; c < entry -> addrCount && count < max; c++)
+        {
+            n = (entry -> rotate + c) % entry -> addrCount;
+            if(pass == 0 && (entry -> avoid & (1 << n)) != 0)
+            {
+                continue;
+            }
+
+            addrs[count] = entry -> addr[n];
+            count++;
+        }
+    }
+
+    return count;
+}
+
+// Leave an address out until the name's next refresh
+void dnsAvoid(char *name, IPAddress addr)
+{
+    int c;
+    int n;
+
+    for(c = 0; c < DNS_CACHE_SIZE; c++)
+    {
+        if(strcmp(dnsCache[c].name, name) == 0)
+        {
+            for(n = 0; n < dnsCache[c].addrCount; n++)
+            {
+                if(dnsCache[c].addr[n] == addr)
+                {
+                    dnsCache[c].avoid = dnsCache[c].avoid | (1 << n);
+                }
+            }
+        }
+    }
+}
+
+dnsEntry_t *dnsCacheEntry(int n)
+{
+    if(n < 0 || n >= DNS_CACHE_SIZE || dnsCache[n].name[0] == '\0')
+    {
+        return NULL;
+    }
+
+    return &dnsCache[n];
+}
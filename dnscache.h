@@ -0,0 +1,7 @@
+void dnsCacheBegin();
+void dnsCacheEnd();
+void dnsCacheFlush();
+void dnsCacheTick();
+int dnsLookup(char *name, IPAddress *addrs, int max);
+void dnsAvoid(char *name, IPAddress addr);
+dnsEntry_t *dnsCacheEntry(int n);
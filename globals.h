@@ -20,7 +20,6 @@ int ntpSyncState;
 volatile int ledColSelect;
 int ledColPins[MAX_COLS] = { PIN_COLH1, PIN_COLH2, PIN_COLM1, PIN_COLM2, PIN_COLS1, PIN_COLS2 };  // column select pins h-h-m-m-s-s
 int ledColSize[MAX_COLS] = { 4, 4, 3, 4, 3, 4 };                                                  // number of leds on this column hh:mm:ss
-int ledColData[MAX_COLS] = { 0, 0, 0, 0, 0, 0 };                                                  // display data
 int ledRowPins[MAX_ROWS] = { PIN_DATA1, PIN_DATA2, PIN_DATA3, PIN_DATA4 };                        // data pins          lsb first
 
 char *dayStrings[] =
@@ -55,10 +54,28 @@ timeNow_t timeNow;
 long ticks;
 
 volatile unsigned long int interruptCount;
+volatile boolean dispFastIsr;
+volatile unsigned long int dispIsrAvgCycles;
+volatile unsigned long int dispIsrMaxCycles;
+unsigned long int dispBufferWrites;
 
 boolean loggedIn;
 boolean newTelnetConnection;
 
+unsigned long int loopsPerSecond;
+unsigned long int loopMaxUs;      // Longest loop() since the time-series log last took a record
+unsigned long int renderCount;
+
+long int tbFreqPpb;         // Frequency correction of the local clock, parts per billion
+long int tbPhaseErrorUs;    // How far the last second edge was from the true second
+long int tbOffsetUs;        // Offset measured by the last NTP exchange
+long int tbDelayUs;         // Round trip delay of the last NTP exchange
+
+unsigned long int syncBootMs;   // Boot to first synchronisation, 0 until then
+unsigned long int syncStartMs;  // When the NTP client last started
+unsigned long int syncTimeMs;   // NTP client start to synchronisation, 0 until then
+unsigned long int validBootMs;  // Boot to valid time on the display, 0 until then
+
 #else
 
 extern eepromData clockConfig;
@@ -68,7 +85,6 @@ extern int paramCount;
 extern volatile int ledColSelect;
 extern int ledColPins[];
 extern int ledColSize[];
-extern int ledColData[];
 extern int ledRowPins[];
 extern WiFiServer httpServer;
 extern WiFiClient httpClient;
@@ -81,14 +97,31 @@ extern int reSyncCount;
 extern unsigned int reachability;
 extern timeNow_t timeNow;
 extern volatile unsigned long int interruptCount;
+extern volatile boolean dispFastIsr;
+extern volatile unsigned long int dispIsrAvgCycles;
+extern volatile unsigned long int dispIsrMaxCycles;
+extern unsigned long int dispBufferWrites;
 extern long ticks;
 extern char *dayStrings[];
 extern int ntpSyncState;
 extern boolean loggedIn;
 extern boolean newTelnetConnection;
+extern unsigned long int loopsPerSecond;
+extern unsigned long int loopMaxUs;
+extern unsigned long int renderCount;
+extern long int tbFreqPpb;
+extern long int tbPhaseErrorUs;
+extern long int tbOffsetUs;
+extern long int tbDelayUs;
+extern unsigned long int syncBootMs;
+extern unsigned long int syncStartMs;
+extern unsigned long int syncTimeMs;
+extern unsigned long int validBootMs;
 
 #endif
 
 void defaultClockConfig();
 boolean getClockConfig();
 void saveClockConfig();
+void networkServices();
+void configChanged(eepromData *old, boolean restartAll);
@@ -0,0 +1,141 @@
+#include "config.h"
+
+#ifdef __MK1_HW
+#include <WiFi101.h>
+#else
+#include <WiFi.h>
+#include <esp_heap_caps.h>
+#ifdef __WITH_TELNET_CLI
+#include <ESPTelnet.h>
+#endif
+#endif
+
+#include "types.h"
+#include "globals.h"
+#include "history.h"
+
+// NTP history...
+//   A ring buffer with what happened at each NTP poll, allocated once at start up (in PSRAM on MK2).
+//   Every entry has a sequence number that keeps counting up, so a reader can ask for everything
+//   since the last one it saw.  If it's left it too long the oldest still in the buffer come first.
+//   Exported as CSV or JSON to anything that can be printed to - the CLI or an HTTP client.
+
+ntpHistory_t *histBuffer;
+int histSize;
+unsigned long int histNextSeq;           // Sequence number the next entry gets
+
+void initHistory()
+{
+#ifdef __MK2_HW
+    histBuffer = (ntpHistory_t *)heap_caps_malloc(HIST_SIZE * sizeof(ntpHistory_t), MALLOC_CAP_SPIRAM);
+    if(histBuffer == NULL)
+    {
+        // No PSRAM, make do with a smaller one
+        histBuffer = (ntpHistory_t *)malloc((HIST_SIZE / 8) * sizeof(ntpHistory_t));
+        histSize = HIST_SIZE / 8;
+    }
+    else
+    {
+        histSize = HIST_SIZE;
+    }
+#else
+    histBuffer = (ntpHistory_t *)malloc(HIST_SIZE * sizeof(ntpHistory_t));
+    histSize = HIST_SIZE;
+#endif
+
+    if(histBuffer == NULL)
+    {
+        histSize = 0;
+    }
+
+    histNextSeq = 1;
+}
+
+// Add an entry, its sequence number is filled in
+void histAdd(ntpHistory_t *entry)
+{
+    if(histSize == 0)
+    {
+        return;
+    }
+
+    entry -> seq = histNextSeq;
+    histBuffer[histNextSeq % histSize] = *entry;
+    histNextSeq++;
+}
+
+// Oldest sequence number still in the buffer
+unsigned long int histOldest()
+{
+    if(histNextSeq <= (unsigned long int)histSize)
+    {
+        return 1;
+    }
+
+    return histNextSeq - histSize;
+}
+
+unsigned long int histLatest()
+{
+    return histNextSeq - 1;
+}
+
+int histGetSize()
+{
+    return histSize;
+}
+
+// Entries after sequence number "since" as CSV lines, with a header line first
+// or as a JSON object with "latest" to use as "since" next time and an array of samples
+void histExport(Print &out, unsigned long int since, boolean json)
+{
+    unsigned long int seq;
+    unsigned long int first;
+    ntpHistory_t *entry;
+    char line[160];
+
+    seq = since + 1;
+    if(seq < histOldest())
+    {
+        seq = histOldest();
+    }
+    first = seq;
+
+    if(json == true)
+    {
+        sprintf(line, "{\"latest\":%lu,\"oldest\":%lu,\"samples\":[", histLatest(), histOldest());
+    }
+    else
+    {
+        sprintf(line, "seq,utc,server,result,offset_us,delay_us,stratum,poll_s,stepped,freq_ppb,freq_change_ppb\r\n");
+    }
+    out.print(line);
+
+    for( ; seq < histNextSeq; seq++)
+    {
+        entry = &histBuffer[seq % histSize];
+
+        if(json == true)
+        {
+            sprintf(line, "%s{\"seq\":%lu,\"utc\":%ld,\"server\":\"%s\",\"result\":\"%c\",\"offset_us\":%lld,\"delay_us\":%ld,",
+                    seq == first ? "" : ",", entry -> seq, (long int)entry -> utc,
+                    entry -> server.toString().c_str(), entry -> result, (long long)entry -> offsetUs, entry -> delayUs);
+            out.print(line);
+            sprintf(line, "\"stratum\":%d,\"poll_s\":%d,\"stepped\":%s,\"freq_ppb\":%ld,\"freq_change_ppb\":%ld}",
+                    entry -> stratum, entry -> pollS, entry -> stepped == true ? "true" : "false", entry -> freqPpb,
+                    entry -> freqChangePpb);
+        }
+        else
+        {
+            sprintf(line, "%lu,%ld,%s,%c,%lld,%ld,%d,%d,%d,%ld,%ld\r\n", entry -> seq, (long int)entry -> utc,
+                    entry -> server.toString().c_str(), entry -> result, (long long)entry -> offsetUs, entry -> delayUs,
+                    entry -> stratum, entry -> pollS, entry -> stepped, entry -> freqPpb, entry -> freqChangePpb);
+        }
+        out.print(line);
+    }
+
+    if(json == true)
+    {
+        out.print("]}\r\n");
+    }
+}
@@ -0,0 +1,6 @@
+void initHistory();
+void histAdd(ntpHistory_t *entry);
+unsigned long int histOldest();
+unsigned long int histLatest();
+int histGetSize();
+void histExport(Print &out, unsigned long int since, boolean json);
@@ -1,99 +1,570 @@
+#include "config.h"
 
 #ifdef __MK1_HW
 #include <WiFi101.h>
 #else
 #include <WiFi.h>
+#include "esp_timer.h"
+#include "driver/ledc.h"
 #endif
 
-#include "config.h"
 #include "types.h"
 #include "globals.h"
 #include "morse.h"
+#include "display.h"
+#include "util.h"
 
 // Timing is this:-
-//   MORSE_DELAY is one dot period
-//   Time between dots/dashes of same character is MORSE_DELAY
-//   Time between characters in same number is 5 * MORSE_DELAY
-//   Time between numbers is 15 * MORSE_DELAY (a bit longer than it should be...)
+//   One dot period is 1200 / morseWpm ms
+//   Time between dots/dashes of same character is one dot period
+//   Time between characters in same number is 5 more
+//   Time between numbers is 15 more (a bit longer than it should be...)
+//   Text is sent with the usual 3 between characters and 7 between words
+//   With Farnsworth spacing the characters are still sent at morseWpm, but the extra gaps between them
+//   are in longer periods so the overall speed is morseFarnsworth.
+//
+// Sending...
+//   A message is made up as a list of on/off elements, each a number of dot periods, then put in the
+//   queue whole.  Nothing waits for it to be sent, so the time carries on while it beeps.
+//   On MK2 the elements are played by an esp_timer - each one sets the beeper and starts the timer for
+//   its length, the callback starts the next.  morseTick() in loop() gets it going when something's
+//   been queued and it's stopped.  MK1 has no timer to spare, so morseTick() plays them itself by
+//   micros(), near enough as loop() doesn't wait for anything any more.
+//
+// Tone...
+//   On MK2 the beeper is driven by the LEDC PWM peripheral at morsePitch Hz.  The duty cycle fades up
+//   and down over MORSE_EDGE_MS with the LEDC's own hardware fade, so the tone starts and stops without
+//   a click and the CPU doesn't have to do anything for it.  Pitch 0 switches it back to a DC level for
+//   a buzzer that makes its own tone.  MK1's tone() would need TC5, which drives the display, so it's
+//   always a DC level.
 
-// Morse characters 0-9
-// To send, clock out 5 bits, LSB first - if LSB is '1', send a dot, otherwise, send a dash
-int morse[10] = { 0x00, 0x01, 0x03, 0x07, 0x0f, 0x1f, 0x1e, 0x1c, 0x18, 0x10 };
+// Morse characters...
+//   Each one is packed into 16 bits by morseCode() when it's compiled, from how it's written - "-.-." for C.
+//   The bits are a 1 to mark the start then a bit for each dot (0) or dash (1), first one first, so
+//   the top bit set says how long it is.  0 is a character there isn't a code for.
+//   The table covers ASCII space to underscore, lower case letters are sent as upper case.
+//   Prosigns are written between < and >, "<SK>" or "<SOS>", and sent as one character with no gaps
+//   between the letters.
+constexpr uint16_t morseCode(const char *code, uint16_t packed = 1)
+{
+    return *code == '\0' ? packed : morseCode(code + 1, (packed << 1) | (*code == '-' ? 1 : 0));
+}
 
-void morseBeep(int beepLength)
+const uint16_t morseTable[64] =
 {
-    digitalWrite(PIN_BEEP, HIGH);
-    delay(beepLength);
+    0,                  morseCode("-.-.--"), morseCode(".-..-."), 0,                                  //   ! " #
+    morseCode("...-..-"), 0,                morseCode(".-..."),  morseCode(".----."),                 // $ % & '
+    morseCode("-.--."), morseCode("-.--.-"), 0,                 morseCode(".-.-."),                   // ( ) * +
+    morseCode("--..--"), morseCode("-....-"), morseCode(".-.-.-"), morseCode("-..-."),                // , - . /
+    morseCode("-----"), morseCode(".----"), morseCode("..---"), morseCode("...--"),                   // 0 1 2 3
+    morseCode("....-"), morseCode("....."), morseCode("-...."), morseCode("--..."),                   // 4 5 6 7
+    morseCode("---.."), morseCode("----."), morseCode("---..."), morseCode("-.-.-."),                 // 8 9 : ;
+    0,                  morseCode("-...-"), 0,                  morseCode("..--.."),                  // < = > ?
+    morseCode(".--.-."), morseCode(".-"),   morseCode("-..."),  morseCode("-.-."),                    // @ A B C
+    morseCode("-.."),   morseCode("."),     morseCode("..-."),  morseCode("--."),                     // D E F G
+    morseCode("...."),  morseCode(".."),    morseCode(".---"),  morseCode("-.-"),                     // H I J K
+    morseCode(".-.."),  morseCode("--"),    morseCode("-."),    morseCode("---"),                     // L M N O
+    morseCode(".--."),  morseCode("--.-"),  morseCode(".-."),   morseCode("..."),                     // P Q R S
+    morseCode("-"),     morseCode("..-"),   morseCode("...-"),  morseCode(".--"),                     // T U V W
+    morseCode("-..-"),  morseCode("-.--"),  morseCode("--.."),  0,                                    // X Y Z [
+    0,                  0,                  0,                  morseCode("..--.-")                   // \ ] ^ _
+};
+
+static_assert(morseCode("-----") == 0x3f, "morseCode() packs the wrong way round");
+
+long int morseDotUs;                     // Dot period at the character speed
+long int morseSpaceUs;                   // and for the gaps between characters and words
+int morsePitch;                          // Tone in Hz, 0 for a DC level
+
+unsigned char morseQueue[MORSE_QUEUE];
+volatile int morseHead;                  // Written by loop()
+volatile int morseTail;                  // Written by whatever's playing them
+volatile boolean morsePlaying;           // An element is being played
+#ifdef __MK2_HW
+esp_timer_handle_t morseTimer;
+void morseNextElement(void *arg);
+#else
+unsigned long int morseElementUs;        // When the element being played started
+unsigned long int morseElementLen;       // and how long it lasts
+#endif
+
+void initMorse()
+{
+#ifdef __MK2_HW
+    esp_timer_create_args_t timerArgs;
+
+    memset(&timerArgs, 0, sizeof(timerArgs));
+    timerArgs.callback = morseNextElement;
+    timerArgs.name = "morse";
+    esp_timer_create(&timerArgs, &morseTimer);
+
+    ledc_fade_func_install(0);
+#endif
+
+    morseHead = 0;
+    morseTail = 0;
+    morsePlaying = false;
+    morsePitch = 0;
     digitalWrite(PIN_BEEP, LOW);
+
+    // Until the configuration's been read
+    morseSetSpeed(DEFAULT_MORSE_WPM, DEFAULT_MORSE_FARNSWORTH);
 }
 
-void sendMorseChar(int ch)
+// Use the speed and pitch from the configuration
+void morseSettings()
 {
-    int c;
-    int dashDelay;
-    int morseChar;
+    morseSetSpeed(clockConfig.morseWpm, clockConfig.morseFarnsworth);
+    morseSetPitch(clockConfig.morsePitch);
+}
+
+// Character speed and overall speed in words per minute ("PARIS " is a word, 50 dot periods)
+// The extra time the overall speed needs is spread over the 19 dot periods of gaps between
+// characters and words in "PARIS "
+void morseSetSpeed(int wpm, int farnsworth)
+{
+    morseDotUs = 1200000L / wpm;
+
+    if(farnsworth >= wpm)
+    {
+        morseSpaceUs = morseDotUs;
+    }
+    else
+    {
+        morseSpaceUs = ((60000L * wpm - 37200L * farnsworth) * 1000L) / (19L * wpm * farnsworth);
+    }
+}
+
+long int morseGetDotUs()
+{
+    return morseDotUs;
+}
+
+long int morseGetSpaceUs()
+{
+    return morseSpaceUs;
+}
+
+void morseSetPitch(int hz)
+{
+#ifdef __MK2_HW
+    if(hz == 0)
+    {
+        if(morsePitch != 0)
+        {
+            ledcDetachPin(PIN_BEEP);
+            pinMode(PIN_BEEP, OUTPUT);
+            digitalWrite(PIN_BEEP, LOW);
+        }
+    }
+    else
+    {
+        ledcSetup(MORSE_LEDC_CHANNEL, hz, MORSE_LEDC_BITS);
+        ledcAttachPin(PIN_BEEP, MORSE_LEDC_CHANNEL);
+        ledcWrite(MORSE_LEDC_CHANNEL, 0);
+    }
+
+    morsePitch = hz;
+#endif
+}
+
+int morseGetPitch()
+{
+    return morsePitch;
+}
+
+// Turn the beeper on or off
+void morseKey(boolean on)
+{
+#ifdef __MK2_HW
+    if(morsePitch != 0)
+    {
+        ledc_set_fade_time_and_start(LEDC_LOW_SPEED_MODE, (ledc_channel_t)MORSE_LEDC_CHANNEL, on == true ? MORSE_LEDC_DUTY : 0,
+                                     MORSE_EDGE_MS, LEDC_FADE_NO_WAIT);
+        return;
+    }
+#endif
+
+    if(on == true)
+    {
+        digitalWrite(PIN_BEEP, HIGH);
+    }
+    else
+    {
+        digitalWrite(PIN_BEEP, LOW);
+    }
+}
+
+void morseClear(morseMsg_t *msg)
+{
+    msg -> len = 0;
+}
+
+// Add an element to a message, a gap after the same sort of gap just makes it longer
+// false if the message is full
+boolean morseAddElement(morseMsg_t *msg, unsigned char type, int units)
+{
+    unsigned char *last;
+
+    if((type & MORSE_ON) == 0 && msg -> len > 0)
+    {
+        last = &msg -> element[msg -> len - 1];
+        if((*last & ~MORSE_UNITS) == type && (*last & MORSE_UNITS) + units <= MORSE_UNITS)
+        {
+            *last = *last + units;
+            return true;
+        }
+    }
+
+    if(msg -> len >= MORSE_MSG_LEN)
+    {
+        return false;
+    }
+
+    msg -> element[msg -> len] = type | units;
+    msg -> len++;
+
+    return true;
+}
 
-    if(ch > 9)
+// A dot, dash or the gap between them
+boolean morseAdd(morseMsg_t *msg, boolean on, int units)
+{
+    return morseAddElement(msg, on == true ? MORSE_ON : 0, units);
+}
+
+// A gap between characters or words
+boolean morseAddSpace(morseMsg_t *msg, int units)
+{
+    return morseAddElement(msg, MORSE_SPACE, units);
+}
+
+// Packed code for a character, 0 if there isn't one
+uint16_t morseLookup(char ch)
+{
+    ch = toupper(ch);
+    if(ch < ' ' || ch > '_')
     {
-        Serial.print("Illegal value for sendMorseChar() - ");
+        return 0;
+    }
+
+    return morseTable[ch - ' '];
+}
+
+// The dots and dashes of a packed code, with a dot period of quiet between them
+// No gap after the last one, that's up to whatever comes next
+// false if the message is full
+boolean morseAddCode(morseMsg_t *msg, uint16_t code)
+{
+    uint16_t bit;
+    boolean fits;
+
+    // Start from the bit after the marker
+    bit = 0x8000;
+    while(bit != 0 && (code & bit) == 0)
+    {
+        bit = bit >> 1;
+    }
+    bit = bit >> 1;
+
+    fits = true;
+    while(bit != 0)
+    {
+        if((code & bit) == 0)
+        {
+            fits = fits && morseAdd(msg, true, 1);
+        }
+        else
+        {
+            fits = fits && morseAdd(msg, true, 3);
+        }
+
+        bit = bit >> 1;
+        if(bit != 0)
+        {
+            fits = fits && morseAdd(msg, false, 1);  // inter-symbol delay
+        }
+    }
+
+    return fits;
+}
+
+// One digit
+void morseAddDigit(morseMsg_t *msg, int ch)
+{
+    if(ch < 0 || ch > 9)
+    {
+        Serial.print("Illegal value for morseAddDigit() - ");
         Serial.println(ch);
         return;
     }
 
-    morseChar = morse[ch];
-    
-    dashDelay = 3 * MORSE_DELAY;
+    morseAddCode(msg, morseLookup('0' + ch));
+    morseAdd(msg, false, 1);
+}
 
-    for(c = 0; c < 5; c++)
+// Plain text, with standard spacing - 3 dot periods between characters and 7 between words
+// Those gaps are all Farnsworth spacing, which is what the 19 units in morseSetSpeed() are
+// Characters without a code are left out, false if it didn't all fit
+boolean morseAddText(morseMsg_t *msg, const char *text)
+{
+    uint16_t code;
+    boolean fits;
+    boolean prosign;
+    boolean joined;                      // A prosign letter has been sent, the next one follows it
+
+    fits = true;
+    prosign = false;
+    joined = false;
+    while(*text != '\0')
     {
-        if((morseChar & 0x01) == 0x01)
+        if(*text == '<')
+        {
+            prosign = true;
+            joined = false;
+        }
+        else if(*text == '>')
+        {
+            prosign = false;
+            fits = fits && morseAddSpace(msg, 3);
+        }
+        else if(*text == ' ')
         {
-            morseBeep(MORSE_DELAY);
+            fits = fits && morseAddSpace(msg, 4);
         }
         else
         {
-            morseBeep(dashDelay);
+            code = morseLookup(*text);
+            if(code != 0)
+            {
+                if(joined == true)
+                {
+                    fits = fits && morseAdd(msg, false, 1);
+                }
+                fits = fits && morseAddCode(msg, code);
+                if(prosign == false)
+                {
+                    fits = fits && morseAddSpace(msg, 3);
+                }
+                joined = prosign;
+            }
         }
 
-        delay(MORSE_DELAY);  // inter-symbol delay
+        text++;
+    }
+
+    return fits;
+}
+
+// Queue some text to be sent
+boolean morseSendText(const char *text)
+{
+    morseMsg_t msg;
+
+    morseClear(&msg);
+    if(morseAddText(&msg, text) == false)
+    {
+        Serial.println("[MRSE] Text too long");
+        return false;
+    }
+
+    return morseSend(&msg);
+}
+
+// Tell anyone listening that something's happened, if the chimes are on
+void morseAnnounce(const char *text)
+{
+    if(chimesEnabled() == true)
+    {
+        Serial.printf("[MRSE] Announcing \"%s\"\r\n", text);
+        morseSendText(text);
+    }
+}
 
-        morseChar = morseChar >> 1;
-    }    
+// Queue a message to be sent, false if there isn't room for all of it
+boolean morseSend(morseMsg_t *msg)
+{
+    int space;
+    int head;
+    int c;
+
+    space = (morseTail - morseHead - 1 + MORSE_QUEUE) % MORSE_QUEUE;
+    if(msg -> len > space)
+    {
+        Serial.println("[MRSE] Queue full, message dropped");
+        return false;
+    }
+
+    head = morseHead;
+    for(c = 0; c < msg -> len; c++)
+    {
+        morseQueue[head] = msg -> element[c];
+        head = (head + 1) % MORSE_QUEUE;
+    }
+    morseHead = head;
+
+    return true;
+}
+
+// Something is being sent or waiting to be
+boolean morseBusy()
+{
+    return morsePlaying == true || morseHead != morseTail;
+}
+
+// Set the beeper for the next element in the queue
+// Returns its length in us, 0 if there isn't one
+unsigned long int morseStartElement()
+{
+    unsigned char element;
+
+    if(morseTail == morseHead)
+    {
+        morseKey(false);
+        return 0;
+    }
+
+    element = morseQueue[morseTail];
+    morseTail = (morseTail + 1) % MORSE_QUEUE;
+
+    morseKey((element & MORSE_ON) == MORSE_ON);
+
+    if((element & MORSE_SPACE) == MORSE_SPACE)
+    {
+        return (element & MORSE_UNITS) * morseSpaceUs;
+    }
+
+    return (element & MORSE_UNITS) * morseDotUs;
+}
+
+#ifdef __MK2_HW
+// esp_timer callback at the end of each element, and from morseTick() for the first
+void morseNextElement(void *arg)
+{
+    unsigned long int us;
+
+    us = morseStartElement();
+    if(us == 0)
+    {
+        morsePlaying = false;
+    }
+    else
+    {
+        esp_timer_start_once(morseTimer, us);
+    }
+}
+#endif
+
+// Called every time round loop()
+void morseTick()
+{
+#ifdef __MK2_HW
+    // The timer does the rest
+    if(morsePlaying == false && morseHead != morseTail)
+    {
+        morsePlaying = true;
+        morseNextElement(NULL);
+    }
+#else
+    if(morsePlaying == true)
+    {
+        if(micros() - morseElementUs < morseElementLen)
+        {
+            return;
+        }
+
+        // Straight on from the end of the last one so the timing doesn't drift
+        morseElementUs = morseElementUs + morseElementLen;
+    }
+    else
+    {
+        if(morseHead == morseTail)
+        {
+            return;
+        }
+
+        morseElementUs = micros();
+    }
+
+    morseElementLen = morseStartElement();
+    morsePlaying = (morseElementLen != 0);
+#endif
+}
+
+// Wait until everything queued has been sent - only for when nothing else matters, like before a reboot
+void morseWait()
+{
+    while(morseBusy() == true)
+    {
+        morseTick();
+        delay(1);
+    }
+}
+
+void morseBeep(int units)
+{
+    morseMsg_t msg;
+
+    morseClear(&msg);
+    morseAdd(&msg, true, units);
+    morseSend(&msg);
+}
+
+void sendMorseChar(int ch)
+{
+    morseMsg_t msg;
+
+    morseClear(&msg);
+    morseAddDigit(&msg, ch);
+    morseSend(&msg);
 }
 
 void chimeMorse()
 {
-    sendMorseChar(ledColData[0] & 0x03);
-    delay(3 * MORSE_DELAY);
-    sendMorseChar(ledColData[1]);
+    dispFrame_t frame;
+    morseMsg_t msg;
+
+    dispGetFrame(&frame);
+
+    morseClear(&msg);
+    morseAddDigit(&msg, frame.col[0] & 0x03);
+    morseAddSpace(&msg, 3);
+    morseAddDigit(&msg, frame.col[1]);
+    morseSend(&msg);
 }
 
 void timeInMorse()
 {
     int c;
+    dispFrame_t frame;
+    morseMsg_t msg;
+
+    dispGetFrame(&frame);
 
+    morseClear(&msg);
     for(c = 0; c < 4; c++)
     {
         // Top bit of hours might be set to show PM
         if(c == 0)
         {
-            sendMorseChar(ledColData[c] & 0x03);
+            morseAddDigit(&msg, frame.col[c] & 0x03);
         }
         else
         {
-            sendMorseChar(ledColData[c]);
+            morseAddDigit(&msg, frame.col[c]);
         }
-        delay(5 * MORSE_DELAY);
+        morseAddSpace(&msg, 5);
 
         // Wait "word space" between hours and minutes
         if(c == 1)
         {
-            delay(10 * MORSE_DELAY);
+            morseAddSpace(&msg, 10);
         }
     }
+    morseSend(&msg);
 }
 
-void numberInMorse(int n)
+void numberInMorse(morseMsg_t *msg, int n)
 {
     int divisor;
     int ch;
@@ -107,14 +578,14 @@ void numberInMorse(int n)
         {
             if(ch != 0)
             {
-                sendMorseChar(ch);
-                delay(5* MORSE_DELAY);
+                morseAddDigit(msg, ch);
+                morseAddSpace(msg, 5);
             }
         }
         else
         {
-            sendMorseChar(ch);
-            delay(5 * MORSE_DELAY);
+            morseAddDigit(msg, ch);
+            morseAddSpace(msg, 5);
         }
         
         n = n % divisor;
@@ -126,11 +597,15 @@ void ipAddressInMorse()
 {
     IPAddress ip;
     int c;
+    morseMsg_t msg;
 
     ip = WiFi.localIP();
+
+    morseClear(&msg);
     for(c = 0; c < 4; c++)
     {
-        numberInMorse(ip[c]);
-        delay(10 * MORSE_DELAY);
+        numberInMorse(&msg, ip[c]);
+        morseAddSpace(&msg, 10);
     }
+    morseSend(&msg);
 }
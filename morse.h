@@ -1,5 +1,28 @@
-void morseBeep(int beepLength);
+void initMorse();
+void morseSettings();
+void morseSetSpeed(int wpm, int farnsworth);
+long int morseGetDotUs();
+long int morseGetSpaceUs();
+void morseSetPitch(int hz);
+int morseGetPitch();
+void morseKey(boolean on);
+void morseClear(morseMsg_t *msg);
+boolean morseAddElement(morseMsg_t *msg, unsigned char type, int units);
+boolean morseAdd(morseMsg_t *msg, boolean on, int units);
+boolean morseAddSpace(morseMsg_t *msg, int units);
+uint16_t morseLookup(char ch);
+boolean morseAddCode(morseMsg_t *msg, uint16_t code);
+void morseAddDigit(morseMsg_t *msg, int ch);
+boolean morseAddText(morseMsg_t *msg, const char *text);
+boolean morseSendText(const char *text);
+void morseAnnounce(const char *text);
+boolean morseSend(morseMsg_t *msg);
+boolean morseBusy();
+void morseTick();
+void morseWait();
+void morseBeep(int units);
 void sendMorseChar(int ch);
 void chimeMorse();
 void timeInMorse();
+void numberInMorse(morseMsg_t *msg, int n);
 void ipAddressInMorse();
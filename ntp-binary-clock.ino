@@ -14,7 +14,6 @@
 
 #include "config.h"
 
-#include <NTPClient.h>
 #ifdef __MK1_HW
 #include <WiFi101.h>
 #include <FlashStorage.h>
@@ -29,8 +28,6 @@
 #endif
 #endif
 #include <WiFiUdp.h>
-#include <TimeLib.h>
-#include <Timezone.h>
 
 #ifdef __WITH_OTA
 #include <ArduinoOTA.h>
@@ -45,16 +42,22 @@
 #include "globals.h"
 #include "morse.h"
 #include "util.h"
+#include "display.h"
+#include "timebase.h"
+#include "ntp.h"
+#include "tz.h"
+#include "history.h"
+#include "tslog.h"
+#include "ntpserver.h"
+#include "dnscache.h"
+#include "tasks.h"
 
 #ifdef __MK1_HW
 
-#include "Timer5.h"
 FlashStorage(savedConfig, eepromData);
 
 #else
 
-hw_timer_t *timer0 = NULL;
-
 #ifdef __WITH_FTP
 FtpServer ftpSrv;
 #endif
@@ -68,17 +71,10 @@ WiFiServer telnetServer(TELNET_PORT);
 // State machine
 clockStateType clockState;
 
-// NTP things
-WiFiUDP ntpUDP;
-NTPClient timeClient(ntpUDP);
-
-// Timezone things
-TimeChangeRule ukBST = { "BST", Last, Sun, Mar, 2, 60 };
-TimeChangeRule ukGMT = { "GMT", Last, Sun, Oct, 2, 0 };
-Timezone ukTime(ukGMT, ukBST);
-
 int ntpUpdates;
-int ntpTimeouts;
+int ntpTimeouts;                    // Polls in a row with no reply
+int ntpBurst;                        // Requests left in the start up burst
+int holdoverTicks;                   // Seconds since holdover started or WiFi was last retried
 
 int tickTime;
 
@@ -88,6 +84,20 @@ unsigned long int lastMillis;
 
 int ledState;
 
+// Display rendering - only done when something shown on the display might have changed
+volatile boolean inputEdge;          // Set by pin change interrupt on buttons and switches
+int renderEvents;                    // RENDER_xxx bits for things that have happened since last render
+boolean morseWasBusy;                // morseBusy() at the last render, to see the queue drain
+
+// Announcing things in morse
+boolean syncLost;                    // Synchronisation went after the clock had it
+uint32_t announcedIp;                // Address last connected with, 0 before the first connection
+
+// Main loop speed
+unsigned long int loopCount;
+unsigned long int loopCountMs;
+unsigned long int loopLastUs;
+
 void defaultClockConfig()
 {
     strcpy(clockConfig.ssid, DEFAULT_SSID);
@@ -99,6 +109,86 @@ void defaultClockConfig()
     clockConfig.initUpdate = INIT_UPDATE;
     clockConfig.syncUpdate = SYNC_UPDATE;
     clockConfig.syncValid = SYNC_VALID;  
+    clockConfig.brightness = DEFAULT_BRIGHTNESS;
+    clockConfig.nightBrightness = DEFAULT_NIGHT_BRIGHTNESS;
+    clockConfig.nightStart = DEFAULT_NIGHT_START;
+    clockConfig.nightEnd = DEFAULT_NIGHT_END;
+    memset(clockConfig.ledBrightness, DISP_MAX_LEVEL, sizeof(clockConfig.ledBrightness));
+    memset(clockConfig.ntpExtraServer, 0, sizeof(clockConfig.ntpExtraServer));
+    strcpy(clockConfig.timeZone, DEFAULT_TZ);
+    strcpy(clockConfig.ntpBroadcast, DEFAULT_NTP_BCAST);
+    clockConfig.morseWpm = DEFAULT_MORSE_WPM;
+    clockConfig.morseFarnsworth = DEFAULT_MORSE_FARNSWORTH;
+    clockConfig.morsePitch = DEFAULT_MORSE_PITCH;
+}
+
+// Make sure settings added since the configuration was saved are sensible
+void checkClockConfig()
+{
+    int col;
+    int row;
+    IPAddress group;
+
+    if(clockConfig.brightness < 0 || clockConfig.brightness > DISP_MAX_LEVEL)
+    {
+        clockConfig.brightness = DEFAULT_BRIGHTNESS;
+    }
+
+    if(clockConfig.nightBrightness < 0 || clockConfig.nightBrightness > DISP_MAX_LEVEL)
+    {
+        clockConfig.nightBrightness = DEFAULT_NIGHT_BRIGHTNESS;
+    }
+
+    if(clockConfig.nightStart < 0 || clockConfig.nightStart > 23 || clockConfig.nightEnd < 0 || clockConfig.nightEnd > 23)
+    {
+        clockConfig.nightStart = DEFAULT_NIGHT_START;
+        clockConfig.nightEnd = DEFAULT_NIGHT_END;
+    }
+
+    for(col = 0; col < MAX_COLS; col++)
+    {
+        for(row = 0; row < MAX_ROWS; row++)
+        {
+            if(clockConfig.ledBrightness[col][row] > DISP_MAX_LEVEL)
+            {
+                clockConfig.ledBrightness[col][row] = DISP_MAX_LEVEL;
+            }
+        }
+    }
+
+    for(col = 0; col < NTP_EXTRA_SERVERS; col++)
+    {
+        if(isprint(clockConfig.ntpExtraServer[col][0]) == 0 || memchr(clockConfig.ntpExtraServer[col], '\0', 32) == NULL)
+        {
+            clockConfig.ntpExtraServer[col][0] = '\0';
+        }
+    }
+
+    if(memchr(clockConfig.timeZone, '\0', TZ_LEN) == NULL || tzSet(clockConfig.timeZone) == false)
+    {
+        strcpy(clockConfig.timeZone, DEFAULT_TZ);
+    }
+
+    if(memchr(clockConfig.ntpBroadcast, '\0', NTP_BCAST_LEN) == NULL ||
+       (clockConfig.ntpBroadcast[0] != '\0' && ntpBroadcastAddress(clockConfig.ntpBroadcast, &group) == false))
+    {
+        strcpy(clockConfig.ntpBroadcast, DEFAULT_NTP_BCAST);
+    }
+
+    if(clockConfig.morseWpm < MORSE_MIN_WPM || clockConfig.morseWpm > MORSE_MAX_WPM)
+    {
+        clockConfig.morseWpm = DEFAULT_MORSE_WPM;
+    }
+
+    if(clockConfig.morseFarnsworth < MORSE_MIN_WPM || clockConfig.morseFarnsworth > clockConfig.morseWpm)
+    {
+        clockConfig.morseFarnsworth = clockConfig.morseWpm;
+    }
+
+    if(clockConfig.morsePitch < 0 || clockConfig.morsePitch > MORSE_MAX_PITCH)
+    {
+        clockConfig.morsePitch = DEFAULT_MORSE_PITCH;
+    }
 }
 
 boolean initClockConfig()
@@ -121,43 +211,19 @@ boolean initClockConfig()
 #endif
 }
 
-// Interrupt handler for display timer
-#ifdef __MK1_HW
-void displayInterrupt()
-#else
-void IRAM_ATTR displayInterrupt()
-#endif
+// Say when synchronisation is lost, and when it comes back after that
+void syncAnnounce(int state)
 {
-    int c;
-    int tmpDisplay;
-
-    interruptCount++;
-
-    digitalWrite(ledColPins[ledColSelect], LOW);
-
-    ledColSelect++;
-    if(ledColSelect == MAX_COLS)
-    { 
-        ledColSelect = 0;
+    if(state == LOW && ntpSyncState == HIGH)
+    {
+        syncLost = true;
+        morseAnnounce("SYNC LOST");
     }
-
-    tmpDisplay = ledColData[ledColSelect];
-
-    for(c = 0; c < ledColSize[ledColSelect]; c++)
+    else if(state == HIGH && ntpSyncState == LOW && syncLost == true)
     {
-        if((tmpDisplay & 0x01) != 0)
-        {
-            digitalWrite(ledRowPins[c], HIGH);
-        }
-        else
-        {
-            digitalWrite(ledRowPins[c], LOW);
-        }
-
-        tmpDisplay = tmpDisplay >> 1;
+        syncLost = false;
+        morseAnnounce("SYNC OK");
     }
-
-    digitalWrite(ledColPins[ledColSelect], HIGH);
 }
 
 #ifdef __MK1_HW
@@ -165,22 +231,20 @@ void IRAM_ATTR displayInterrupt()
 void syncLed(int state)
 {
     digitalWrite(PIN_SYNCLED, state);
+    if(state != ntpSyncState)
+    {
+        renderEvents = renderEvents | RENDER_SYNC;
+        syncAnnounce(state);
+    }
     ntpSyncState = state;
 }
 
-void initDisplayTimer()
-{
-    interruptCount = 0;
-    MyTimer5.begin(DISP_INTS_PER_SECOND);
-    MyTimer5.attachInterrupt(displayInterrupt);
-    MyTimer5.start();
-}
-
 boolean getClockConfig()
 {
     clockConfig = savedConfig.read();
     if(clockConfig.eepromValid == EEPROM_VALID)
     {
+        checkClockConfig();
         return true;
     }
     else
@@ -199,23 +263,20 @@ void saveClockConfig()
 
 void syncLed(int state)
 {
+    if(state != ntpSyncState)
+    {
+        renderEvents = renderEvents | RENDER_SYNC;
+        syncAnnounce(state);
+    }
     ntpSyncState = state;
 }
 
-void initDisplayTimer()
-{
-    interruptCount = 0;
-    
-    timer0 = timerBegin(0, TIMER0_PRESCALE, true);
-    timerAttachInterrupt(timer0, &displayInterrupt, true);
-    timerAlarmWrite(timer0, TIMER0_RELOAD, true);
-    timerAlarmEnable(timer0);
-}
-
 boolean getClockConfig()
 {
     File fp;
-    
+
+    // Anything missing from an older, shorter, config file keeps its default
+    defaultClockConfig();
     clockConfig.eepromValid = ~EEPROM_VALID;
 
     // Read the config file
@@ -232,6 +293,7 @@ boolean getClockConfig()
   
     if(clockConfig.eepromValid == EEPROM_VALID && clockConfig.ssid[0] != '\0')
     {
+        checkClockConfig();
         return true;
     }
     else
@@ -317,12 +379,14 @@ void initArduinoOTA()
             type = "filesystem";
         }
 
-        FFat.end();
+        // loop() might be writing the time-series log
+        taskCall(TASK_REQ_OTA_START);
         Serial.println("Start updating " + type);
     })
     
     .onEnd([]()
     {
+        taskCall(TASK_REQ_OTA_END);
         Serial.println("");
         Serial.println("Update finished");
     })
@@ -462,6 +526,8 @@ void checkReboot()
         FFat.remove(FW_REBOOT);
 
         Serial.println("[REBT] Found reboot file");
+        tbSave(true);
+        tslogFlush();
         delay(5);
         Serial.println("[REBT] Rebooting...");
         ESP.restart();
@@ -496,6 +562,7 @@ void checkFwUpdate()
     }
 
     sendMorseChar(0);
+    morseWait();
     Serial.printf(" - starting firmware update using %s\r\n", (char *)fwName);
 
     updateError = true;
@@ -528,6 +595,7 @@ void checkFwUpdate()
         if(Update.end(true))
         {
             sendMorseChar(5);
+            morseWait();
             Serial.println(" - firmware update completed");
             delay(5);
             Serial.println(" - rebooting....");
@@ -566,46 +634,9 @@ void serialShowTime(timeNow_t *timeStruct)
     Serial.println(timeString);    
 }
 
-// Initialise display
-void initDisplay()
-{
-    int c;
-
-    for(c = 0; c < MAX_ROWS; c++)
-    {
-        pinMode(ledRowPins[c], OUTPUT);
-        digitalWrite(ledRowPins[c], LOW);
-    }
-
-    for(c = 0; c < MAX_COLS; c++)
-    {
-        ledColData[c] = 0;
-        pinMode(ledColPins[c], OUTPUT);
-        digitalWrite(ledColPins[c], LOW);
-    }
-
-    ledColSelect = 0;
-}
-
-int splitTime(time_t epoch, timeNow_t *timeStruct)
-{
-    int rtn;
-
-    rtn = timeStruct -> tm_mday;
-    timeStruct -> tm_mday = day(epoch);
-    timeStruct -> tm_mon = month(epoch);
-    timeStruct -> tm_year = year(epoch);
-    timeStruct -> tm_wday = weekday(epoch) - 1;
-    timeStruct -> tm_hour = hour(epoch);
-    timeStruct -> tm_min = minute(epoch);
-    timeStruct -> tm_sec = second(epoch);
-
-    return rtn;
-}
-
-void ledShowTime(timeNow_t *timeStruct)
+// Fill in a frame with the time
+void ledBuildTime(dispFrame_t *frame, timeNow_t *timeStruct)
 {
-    int tmpDisp[2];
     int hourNow;
 
 #ifdef __MK2_HW
@@ -615,7 +646,7 @@ void ledShowTime(timeNow_t *timeStruct)
     {
         for(c = 0; c < MAX_COLS; c++)
         {
-            ledColData[c] = 0x0f;
+            frame -> col[c] = 0x0f;
         }
     }
     else
@@ -625,44 +656,62 @@ void ledShowTime(timeNow_t *timeStruct)
 
         hourNow = timeStruct -> tm_hour;
         
-        // use tmpDisp to stop flickering NTP-sync and am/pm lights
         if(mode12() == true && hourNow >= 12)
         {
             hourNow = hourNow - 12;
 
-            splitDigit(hourNow, &tmpDisp[0]);
+            splitDigit(hourNow, &frame -> col[0]);
         
             // most significant hour bit is used to drive AM/PM indicator
-            tmpDisp[0] = tmpDisp[0] | BIT_AMPM;
+            frame -> col[0] = frame -> col[0] | BIT_AMPM;
         }
         else
         {
-            splitDigit(hourNow, &tmpDisp[0]);
+            splitDigit(hourNow, &frame -> col[0]);
         }
 
 #ifdef __MK2_HW
         if(ntpSyncState == HIGH)
         { 
-            tmpDisp[0] = tmpDisp[0] | BIT_SYNCLED; 
+            frame -> col[0] = frame -> col[0] | BIT_SYNCLED; 
         }
 #endif
 
-        ledColData[0] = tmpDisp[0];
-        ledColData[1] = tmpDisp[1];
-        splitDigit(timeStruct -> tm_min, &ledColData[2]);
-        splitDigit(timeStruct -> tm_sec, &ledColData[4]);     
+        splitDigit(timeStruct -> tm_min, &frame -> col[2]);
+        splitDigit(timeStruct -> tm_sec, &frame -> col[4]);     
 
 #ifdef __MK2_HW
     }
 #endif
 }
 
+void ledShowTime(timeNow_t *timeStruct)
+{
+    ledBuildTime(dispBackFrame(), timeStruct);
+    dispPublish();
+}
+
+// Get the display for the next second ready for the second edge interrupt to show
+void ledArmNextSecond()
+{
+    timeNow_t timeNext;
+
+    tzLocalTime(tbSeconds() + 1, &timeNext);
+
+    ledBuildTime(dispBackFrame(), &timeNext);
+    dispArm();
+}
+
 void ledShowDate(timeNow_t *timeStruct)
 {
-    splitDigit(timeStruct -> tm_mday, &ledColData[0]);
-    ledColData[2] = 0;
-    ledColData[3] = 0;
-    splitDigit(timeStruct -> tm_mon, &ledColData[4]);
+    dispFrame_t *frame;
+
+    frame = dispBackFrame();
+    splitDigit(timeStruct -> tm_mday, &frame -> col[0]);
+    frame -> col[2] = 0;
+    frame -> col[3] = 0;
+    splitDigit(timeStruct -> tm_mon, &frame -> col[4]);
+    dispPublish();
 }
 
 #ifdef __TEST_DISPLAY
@@ -707,14 +756,16 @@ void testDisplay()
 
 void initDisplayPattern()
 {
+    dispFrame_t *frame;
     int c;
 
     c = 0;
     while(c < MAX_COLS)
     {
-        ledColData[c] = 0x0f;
+        frame = dispBackFrame();
+        frame -> col[c] = 0x0f;
+        dispPublish();
         delay(100);
-        ledColData[c] = 0;
 
         c++;
     }
@@ -722,13 +773,16 @@ void initDisplayPattern()
     c = c - 2;
     while(c >= 0)
     {
-        ledColData[c] = 0x0f;
+        frame = dispBackFrame();
+        frame -> col[c] = 0x0f;
+        dispPublish();
         delay(100);
-        ledColData[c] = 0;
 
         c--;      
     }
 
+    dispShowColumns(0, 0, 0, 0, 0, 0);
+
 #ifdef __MK1_HW
     for(c = 0; c < 3; c++)
     {
@@ -757,71 +811,222 @@ void resetTickTime()
     lastMillis = millis();
 }
 
+// Start an NTP update
+// The reply, or lack of it, is dealt with by checkNtp() on a later pass of loop()
 clockStateType updateClock()
 {
-    clockStateType rtn;
-
-    rtn = STATE_STOPPED;
-    
-    if(WiFi.status() == WL_CONNECTED)
+    if(WiFi.status() != WL_CONNECTED)
     { 
-        reachability = reachability << 1;
-        Serial.print("[UPDT] Sending NTP update time request - ");
-        Serial.println(ntpUpdates);
+        Serial.println("[UPDT] WiFi has disconnected");
+        return startHoldover();
+    }
+
+    if(ntpBroadcastLocked() == true)
+    {
+        // Broadcasts are keeping the time, nothing to send
+        ticks = updateTime - 1;
+        return STATE_TIMING;
+    }
+
+    reachability = reachability << 1;
+    Serial.print("[UPDT] Sending NTP update time request - ");
+    Serial.println(ntpUpdates);
+
+    if(ntpRequest() == false)
+    {
+        return ntpTimedOut(HIST_FAILED);
+    }
+
+    return STATE_TIMING;
+}
+
+// No usable reply to an NTP request
+// result is HIST_TIMEOUT or HIST_FAILED for the history
+// Polls back off while there's no reply, a lost WiFi connection is found by updateClock()
+clockStateType ntpTimedOut(char result)
+{
+    Serial.println("[UPDT] Timedout waiting for NTP response");
+
+    ntpTimeouts++;
+    ntpUpdates = 0;
+    ntpBurst = 0;
+    ntpPollBackoff(ntpTimeouts);
+    updateTime = ntpPollInterval();
+    ticks = ntpPollJitter(updateTime) - 1;
+    syncLed(LOW);
+    recordHistory(result, NULL, false, 0);
+
+    return STATE_TIMING;
+}
+
+// NTP has gone, keep time with the local clock while WiFi reconnects in the background
+// Without a good time there's nothing to hold, so restart everything as before
+clockStateType startHoldover()
+{
+    if(tbTimeValid() == false)
+    {
+        return STATE_STOPPED;
+    }
+
+    Serial.println("[HOLD] Holdover - running on the local clock");
+
+    ntpEnd();
+    syncLed(LOW);
+    tbHoldover(true);
+    holdoverTicks = 0;
+
+    // Start again with the WiFi connection, without waiting for it
+#ifdef __MK1_HW
+    WiFi.end();
+    WiFi.begin(clockConfig.ssid, clockConfig.password);
+#else
+    WiFi.reconnect();
+#endif
+
+    return STATE_HOLDOVER;
+}
+
+// Every second in holdover - retry WiFi now and again
+// Returns STATE_TIMING once WiFi is back and NTP has been restarted
+clockStateType checkHoldover()
+{
+    holdoverTicks++;
+
+    if(WiFi.status() == WL_CONNECTED && holdoverTicks >= HOLDOVER_SETTLE)
+    {
+        Serial.printf("[HOLD] WiFi back after %ld seconds in holdover, estimated error %ld us\r\n", tbHoldoverSeconds(), tbErrorUs());
+        tbHoldover(false);
+        wifiConnected();
+
+        // Services listening on any address carry on, mDNS needs telling about the connection again
+#ifdef __MK2_HW
+        MDNS.end();
+        initMDNS();
+#endif
+
+        startNtpClient();
+        return STATE_TIMING;
+    }
+
+    if((holdoverTicks % HOLDOVER_RETRY) == 0)
+    {
+        Serial.printf("[HOLD] %ld seconds in holdover, estimated error %ld us - retrying WiFi\r\n", tbHoldoverSeconds(), tbErrorUs());
+#ifdef __MK1_HW
+        WiFi.end();
+        WiFi.begin(clockConfig.ssid, clockConfig.password);
+#else
+        WiFi.reconnect();
+#endif
+    }
 
-        // forceUpdate() times out after 1second if there's no response
-        if(timeClient.forceUpdate() == true)
+    return STATE_HOLDOVER;
+}
+
+// Keep what happened at this poll in the history
+void recordHistory(char result, ntpSample_t *sample, boolean stepped, long int freqChangePpb)
+{
+    ntpHistory_t entry;
+    ntpSource_t *peer;
+
+    entry.utc = tbSeconds();
+    entry.result = result;
+    entry.server = IPAddress(0, 0, 0, 0);
+    entry.offsetUs = 0;
+    entry.delayUs = 0;
+    entry.stratum = 0;
+    if(sample != NULL)
+    {
+        peer = ntpGetSysPeer();
+        if(peer != NULL)
         {
-            Serial.println("[UPDT] NTP response received");
+            entry.server = peer -> addr;
+        }
+        entry.offsetUs = sample -> offsetUs;
+        entry.delayUs = sample -> delayUs;
+        entry.stratum = sample -> stratum;
+    }
+    entry.pollS = updateTime;
+    entry.stepped = stepped;
+    entry.freqPpb = tbFreqPpb;
+    entry.freqChangePpb = freqChangePpb;
+
+    histAdd(&entry);
+}
+
+// See if an NTP exchange has finished, called every time round loop()
+clockStateType checkNtp()
+{
+    ntpSample_t sample;
+    boolean stepped;
+    long int freqPpb;
+
+    switch(ntpPoll(&sample))
+    {
+        case NTP_REPLY:
+            Serial.printf("[UPDT] NTP response received - offset %ld us, delay %ld us, jitter %ld us\r\n",
+                          (long int)sample.offsetUs, sample.delayUs, sample.jitterUs);
             reachability = reachability | 0x01;
+            freqPpb = tbFreqPpb;
+            stepped = tbNtpSample(&sample);
+            if(stepped == true)
+            {
+                // The stored samples are no use after a step
+                ntpClearFilters();
+            }
 
             ntpUpdates++;
             ntpTimeouts = 0;
-            if(ntpUpdates == clockConfig.syncValid)
+            if(ntpSyncState == LOW && ((stepped == false && ntpConverged(&sample) == true) || ntpUpdates >= clockConfig.syncValid))
             {
                 syncLed(HIGH);
-                updateTime = clockConfig.syncUpdate;
+                syncTimeMs = millis() - syncStartMs;
+                if(syncBootMs == 0)
+                {
+                    syncBootMs = millis();
+                }
+                Serial.printf("[UPDT] Synchronised %ld ms after NTP client start\r\n", syncTimeMs);
             }
+            ntpPollSample(&sample, stepped, tbFreqPpb - freqPpb, ntpSyncState == HIGH);
+            updateTime = ntpPollInterval();
 
-            rtn = STATE_TIMING;
-        }
-        else
-        {
-            Serial.println("[UPDT] Timedout waiting for NTP response");
-
-            ntpTimeouts++;
-            ntpUpdates = 0;
-            updateTime = clockConfig.initUpdate;
-            syncLed(LOW);
-
-            if(ntpTimeouts < MAX_NTP_TIMEOUTS)
+            // Requests close together until synchronised, or the burst is used up
+            if(ntpBurst > 0 && ntpSyncState == LOW)
             {
-                rtn = STATE_TIMING;
+                ntpBurst--;
+                ticks = NTP_BURST_INTERVAL - 1;
+            }
+            else
+            {
+                ntpBurst = 0;
+                ticks = ntpPollJitter(updateTime) - 1;
             }
-        }
-    }
-    else
-    {
-        Serial.println("[UPDT] WiFi has disconnected");
-    }
 
-    return rtn;
+            recordHistory(HIST_REPLY, &sample, stepped, tbFreqPpb - freqPpb);
+
+            // Time might have been stepped
+            correctTime();
+            renderEvents = renderEvents | RENDER_TICK;
+            return STATE_TIMING;
+
+        case NTP_TIMEDOUT:
+            return ntpTimedOut(HIST_TIMEOUT);
+
+        case NTP_FAILED:
+            return ntpTimedOut(HIST_FAILED);
+
+        default:
+            return STATE_TIMING;
+    }
 }
 
 void correctTime()
 {
-    time_t epoch;
-    TimeChangeRule *tcr;
     int dayOfMonth;
 
-    // get time from NTP library
-    // seconds since start of time
-    epoch = timeClient.getEpochTime();
- 
-    // convert to uk time with bst or gmt
-    epoch = ukTime.toLocal(epoch, &tcr);
-    dayOfMonth = splitTime(epoch, &timeNow);
-    timeNow.timeName = tcr -> abbrev;
+    // get time from the timebase, seconds since start of time,
+    // and convert to local time for the configured time zone
+    dayOfMonth = timeNow.tm_mday;
+    tzLocalTime(tbSeconds(), &timeNow);
             
     // Reset reSyncCount when day changes
     if(dayOfMonth != timeNow.tm_mday)
@@ -830,24 +1035,29 @@ void correctTime()
     }
 }
 
+// Returns true if the display is showing something other than the time
 boolean handleButtons()
 {
     boolean rtn;
 
-    rtn = true;
+    rtn = false;
     // If button pressed, send the time in morse code
+    // The morse is queued and the time carries on being shown while it's sent
     if(digitalRead(PIN_MORSETIME) == LOW)
     {
-        Serial.print("[MRSE] ");
-        if(digitalRead(PIN_DATETIME) == LOW)
+        if(morseBusy() == false)
         {
-            Serial.println("Sending IP address");
-            ipAddressInMorse();
-        }
-        else
-        {
-            Serial.println("Sending time in morse");
-            timeInMorse();
+            Serial.print("[MRSE] ");
+            if(digitalRead(PIN_DATETIME) == LOW)
+            {
+                Serial.println("Sending IP address");
+                ipAddressInMorse();
+            }
+            else
+            {
+                Serial.println("Sending time in morse");
+                timeInMorse();
+            }
         }
     }
     else
@@ -856,14 +1066,145 @@ boolean handleButtons()
         {
             Serial.println("[DATE] Show date");
             ledShowDate(&timeNow);                
+            rtn = true;
         }
-        else
+    }
+
+    return rtn;
+}
+
+// Pin change interrupt for mode switch and buttons
+#ifdef __MK1_HW
+void inputChanged()
+#else
+void IRAM_ATTR inputChanged()
+#endif
+{
+    inputEdge = true;
+}
+
+void initInputInterrupts()
+{
+    attachInterrupt(digitalPinToInterrupt(PIN_MODESEL), inputChanged, CHANGE);
+    attachInterrupt(digitalPinToInterrupt(PIN_DATETIME), inputChanged, CHANGE);
+    attachInterrupt(digitalPinToInterrupt(PIN_MORSETIME), inputChanged, CHANGE);
+#ifdef __MK2_HW
+    attachInterrupt(digitalPinToInterrupt(PIN_BOOT), inputChanged, CHANGE);
+#endif
+
+    // Draw the display the first time round
+    inputEdge = false;
+    morseWasBusy = false;
+    renderEvents = RENDER_INPUT;
+}
+
+// Work out what the display should show, if anything has changed since last time
+void renderDisplay()
+{
+    // Clear the flag before the buttons are read so an edge during the read isn't missed
+    if(inputEdge == true)
+    {
+        inputEdge = false;
+        renderEvents = renderEvents | RENDER_INPUT;
+    }
+
+    // Holding the morse button keeps on sending, look at the buttons again when the last one's finished
+    if(morseBusy() == true)
+    {
+        morseWasBusy = true;
+    }
+    else if(morseWasBusy == true)
+    {
+        morseWasBusy = false;
+        renderEvents = renderEvents | RENDER_INPUT;
+    }
+
+    if(renderEvents == 0)
+    {
+        return;
+    }
+
+    renderEvents = 0;
+    renderCount++;
+
+    if(handleButtons() == false)
+    {
+        ledShowTime(&timeNow);
+        ledArmNextSecond();
+
+        if(validBootMs == 0 && tbTimeValid() == true)
         {
-            rtn = false;
+            validBootMs = millis();
+            Serial.printf("[TIME] Valid time displayed %ld ms after boot (%s start)\r\n", validBootMs, tbIsWarm() == true ? "warm" : "cold");
         }
     }
+    else
+    {
+        dispDisarm();
+    }
+}
 
-    return rtn;
+// Everything that happens at the start of a second while the time is running
+void secondTick()
+{
+    // Apply daylight saving and load LED data
+    correctTime();
+    dispScheduleBrightness(timeNow.tm_hour);
+
+    // The new second is already on the display, this gets the next one ready
+    renderEvents = renderEvents | RENDER_TICK;
+    renderDisplay();
+
+    // send everything to serial port
+    serialShowTime(&timeNow);
+
+    // Time only changes here so there's only a chime to check here
+    hourlyChime();
+
+    // For the web server
+    ntpPublishSources();
+
+#ifdef __MK2_HW
+    // Record for the time-series log
+    tslogTick();
+#endif
+}
+
+// Count main loop iterations, loopsPerSecond is updated once a second
+// and keep the longest for the time-series log
+void countLoops()
+{
+    unsigned long int ms;
+    unsigned long int us;
+
+    // First time round loop(), start counting from now
+    if(loopCountMs == 0)
+    {
+        loopCount = 0;
+        loopCountMs = millis();
+        loopLastUs = micros();
+        loopMaxUs = 0;
+        loopsPerSecond = 0;
+        renderCount = 0;
+        return;
+    }
+
+    loopCount++;
+
+    us = micros() - loopLastUs;
+    loopLastUs = loopLastUs + us;
+    if(us > loopMaxUs)
+    {
+        loopMaxUs = us;
+    }
+
+    ms = millis() - loopCountMs;
+    if(ms >= 1000)
+    {
+        loopsPerSecond = (loopCount * 1000) / ms;
+        loopCount = 0;
+        loopCountMs = millis();
+    }
 }
 
 void hourlyChime()
@@ -886,14 +1227,25 @@ void hourlyChime()
 
 void startNtpClient()
 {
+    int c;
+
     Serial.print(" - NTP client started (server ");
     Serial.print(clockConfig.ntpServer);
+    for(c = 1; ntpServerName(c) != NULL; c++)
+    {
+        Serial.print(", ");
+        Serial.print(ntpServerName(c));
+    }
     Serial.println(")");
-    timeClient.setPoolServerName(clockConfig.ntpServer);
-    timeClient.begin(NTP_PORT);
-    updateTime = clockConfig.initUpdate;
+    ntpBegin();
+    ntpPollReset("NTP client started");
+    updateTime = ntpPollInterval();
     ntpUpdates = 0;
     ntpTimeouts = 0;
+    ntpBurst = NTP_BURST_COUNT - 1;
+    ticks = ntpPollPhase();
+    syncStartMs = millis();
+    syncTimeMs = 0;
 }
 
 #ifdef __WITH_TELNET_CLI
@@ -923,9 +1275,119 @@ void startWebserver()
 }
 #endif
 
+// Answer anyone connected to the servers, from the network task or loop() without it
+void networkServices()
+{
+#ifdef __WITH_TELNET
+    // If someone's connected with telnet, deal with it
+    telnetClient = telnetServer.available();
+    if(telnetClient.connected())
+    {
+        telnetShowStatus(telnetClient);
+        telnetClient.flush();
+        telnetClient.stop();
+    }
+#endif
+
+#ifdef __WITH_HTTP
+    // If someone's connected to webserver, deal with it
+    httpClient = httpServer.available();
+    if(httpClient.connected())
+    {
+        httpRequestHandler();
+        httpClient.flush();
+        httpClient.stop();
+    }
+#endif
+
+#ifdef __WITH_FTP
+    ftpSrv.handleFTP();
+#endif
+
+#ifdef __WITH_OTA
+    ArduinoOTA.handle();
+#endif
+}
+
+// After a CLI session - restart the things whose configuration has changed and leave everything else running
+// A change to WiFi, or restartAll, means restarting everything like after a reboot
+void configChanged(eepromData *old, boolean restartAll)
+{
+    if(restartAll == true || strcmp(old -> ssid, clockConfig.ssid) != 0 || strcmp(old -> password, clockConfig.password) != 0)
+    {
+        Serial.println("[CONF] WiFi changed, restarting");
+        clockState = STATE_STOPPED;
+        return;
+    }
+
+    if(strcmp(old -> timeZone, clockConfig.timeZone) != 0)
+    {
+        Serial.println("[CONF] Time zone changed");
+        tzSet(clockConfig.timeZone);
+    }
+
+    if(old -> brightness != clockConfig.brightness || old -> nightBrightness != clockConfig.nightBrightness ||
+       old -> nightStart != clockConfig.nightStart || old -> nightEnd != clockConfig.nightEnd ||
+       memcmp(old -> ledBrightness, clockConfig.ledBrightness, sizeof(clockConfig.ledBrightness)) != 0)
+    {
+        Serial.println("[CONF] Display brightness changed");
+        dispSetBrightness(dispGetBrightness());
+        dispScheduleBrightness(timeNow.tm_hour);
+    }
+
+    if(old -> morseWpm != clockConfig.morseWpm || old -> morseFarnsworth != clockConfig.morseFarnsworth ||
+       old -> morsePitch != clockConfig.morsePitch)
+    {
+        Serial.println("[CONF] Morse settings changed");
+        morseSettings();
+    }
+
+    // The NTP client only runs while timing, otherwise it picks up the changes when it's next started
+    if(clockState == STATE_TIMING)
+    {
+        if(strcmp(old -> ntpServer, clockConfig.ntpServer) != 0 ||
+           memcmp(old -> ntpExtraServer, clockConfig.ntpExtraServer, sizeof(clockConfig.ntpExtraServer)) != 0 ||
+           strcmp(old -> ntpBroadcast, clockConfig.ntpBroadcast) != 0)
+        {
+            Serial.println("[CONF] NTP servers changed, restarting NTP client");
+            ntpEnd();
+            ntpClearSources();
+            startNtpClient();
+        }
+        else if(old -> initUpdate != clockConfig.initUpdate || old -> syncUpdate != clockConfig.syncUpdate)
+        {
+            Serial.println("[CONF] Poll intervals changed");
+            ntpPollReset("poll intervals changed");
+            updateTime = ntpPollInterval();
+        }
+    }
+
+#ifdef __MK2_HW
+    if(taskNetRunning() == true && (strcmp(old -> hostName, clockConfig.hostName) != 0 ||
+       strcmp(old -> ftpUser, clockConfig.ftpUser) != 0 || strcmp(old -> ftpPassword, clockConfig.ftpPassword) != 0))
+    {
+        Serial.println("[CONF] Host name or FTP login changed, restarting servers");
+        taskNetStop();
+        MDNS.end();
+        initMDNS();
+#ifdef __WITH_OTA
+        ArduinoOTA.end();
+        initArduinoOTA();
+#endif
+#ifdef __WITH_FTP
+        ftpSrv.end();
+        initFtpServer();
+#endif
+        taskNetStart();
+    }
+#endif
+}
+
 void wifiConnected()
 {
     char rssiStr[16];
+    char ipStr[24];
+    IPAddress ip;
 
     sprintf(rssiStr, "%d dBm", WiFi.RSSI());
     
@@ -937,6 +1399,18 @@ void wifiConnected()
     Serial.print(WiFi.localIP());
     Serial.println(")");
 
+    // Anyone who had the old address needs to know the new one
+    ip = WiFi.localIP();
+    if((uint32_t)ip != announcedIp)
+    {
+        if(announcedIp != 0)
+        {
+            sprintf(ipStr, "NEW IP %d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
+            morseAnnounce(ipStr);
+        }
+        announcedIp = (uint32_t)ip;
+    }
+
 #ifdef __MK1_HW
     digitalWrite(LED_BUILTIN, HIGH);
 #else
@@ -1005,9 +1479,10 @@ void setup()
     pinMode(PIN_MODESEL, INPUT_PULLUP);
     pinMode(PIN_DATETIME, INPUT_PULLUP);
     pinMode(PIN_MORSETIME, INPUT_PULLUP);
+    initInputInterrupts();
 
     syncLed(LOW);
-    digitalWrite(PIN_BEEP, LOW);
+    initMorse();
 #ifdef __MK1_HW
     digitalWrite(LED_BUILTIN, LOW);
 #endif
@@ -1025,11 +1500,7 @@ void setup()
         // If there's no configuration, display a "X" and start command line
         // Keep on until there's some configuration to use...
 
-        ledColData[0] = 0;
-        ledColData[1] = 0;
-        ledColData[2] = 5;
-        ledColData[3] = 2;
-        ledColData[4] = 5;
+        dispShowColumns(0, 0, 5, 2, 5, 0);
               
         Serial.println("No configuration found in FLASH!!");
 
@@ -1040,13 +1511,13 @@ void setup()
 #endif
         
 
-        ledColData[0] = 0;
-        ledColData[1] = 0;
-        ledColData[2] = 0;
-        ledColData[3] = 0;
-        ledColData[4] = 0;      
+        dispShowColumns(0, 0, 0, 0, 0, 0);
     }
 
+    dispSetBrightness(clockConfig.brightness);
+    tzSet(clockConfig.timeZone);
+    morseSettings();
+
     // State machine
     clockState = STATE_INIT;
 
@@ -1060,13 +1531,41 @@ void setup()
     Serial.println(" - initDisplayTimer()");
     // Display interrupt and handler
     initDisplayTimer();
+
+    Serial.println(" - initHistory()");
+    // NTP history ring buffer
+    initHistory();
+
+#ifdef __MK2_HW
+    Serial.println(" - initTslog()");
+    // Time-series log on FFat
+    initTslog();
+#endif
+
+    Serial.println(" - initTimebase()");
+    // Second edge timer
+    initTimebase();
     
-    Serial.println(" - initDisplayPattern()");
-    // Display a pattern
-    initDisplayPattern();
+    if(tbIsWarm() == true)
+    {
+        // Time carried over from before a soft reset, show it straight away
+        Serial.println(" - warm start");
+        correctTime();
+        renderEvents = renderEvents | RENDER_TICK;
+        renderDisplay();
+    }
+    else
+    {
+        Serial.println(" - cold start");
+
+        Serial.println(" - initDisplayPattern()");
+        // Display a pattern
+        initDisplayPattern();
+    }
 
     Serial.println(" - morseBeep()");
-    morseBeep(MORSE_DELAY);
+    // Goes once loop() starts
+    morseBeep(1);
 #ifdef __TEST_DISPLAY
 
     while(1)
@@ -1078,6 +1577,10 @@ void setup()
 
     checkFwUpdate();
 
+    Serial.println(" - initTasks()");
+    // Network services task on the other core
+    initTasks();
+
     Serial.println("*******************");
     Serial.println("***  R E A D Y  ***");
     Serial.println("*******************");
@@ -1087,6 +1590,10 @@ void setup()
 
 void loop()
 {
+    unsigned long int startUs;
+
+    startUs = micros();
+
     switch(clockState)
     {
         case STATE_INIT:
@@ -1162,16 +1669,31 @@ void loop()
                 startTelnetServer();
 #endif
 
-                ticks = 0;
+#ifdef __WITH_NTP_SERVER
+                // Before the NTP client, broadcasts for it come through the server
+                initNtpServer();
+#endif
+
                 startNtpClient();
                 
 
 #ifdef __WITH_HTTP
                 startWebserver();
 #endif
+
+                // Servers are ready to use
+                taskNetStart();
             }
             else
             {
+                // Keep the time going if it's known, from NTP or from before a soft reset
+                if(tbTimeValid() == true && tbSecondEdge() == true)
+                {
+                    correctTime();
+                    renderEvents = renderEvents | RENDER_TICK;
+                    renderDisplay();
+                }
+
                 if(tickTimeExpired() == true)
                 {
 #ifdef __MK1_HW
@@ -1205,74 +1727,66 @@ void loop()
             break;
 
         case STATE_TIMING:
-            // Periodically force an NTP update
-            // use forceUpdate() to keep track of whether NTP is still working
-            // allows sync LED to be lit and "reachability" to be updated
-            if(tickTimeExpired() == true)
+            // At the start of each second...
+            if(tbSecondEdge() == true)
             {
+                secondTick();
+
+                // Periodically do an NTP update
+                // keeps track of whether NTP is still working
+                // allows sync LED to be lit and "reachability" to be updated
+                // ticks stays at 0 until the exchange has finished
                 if(ticks == 0)
                 {
-                    // Send NTP time request
-                    clockState = updateClock();
-                    if(clockState == STATE_TIMING)
+                    if(ntpBusy() == false)
                     {
-                        ticks = updateTime - 1;
+                        // Send NTP time request
+                        clockState = updateClock();
                     }
                 }
                 else
                 {
                     ticks--;
                 }
-
-                // Apply daylight saving and load LED data
-                correctTime();
-
-                // send everything to serial port
-                serialShowTime(&timeNow);
-
-                resetTickTime();
-            }
-                
-            if(handleButtons() == false)
-            {
-                ledShowTime(&timeNow);              
             }
 
-            hourlyChime();
-            
-#ifdef __WITH_TELNET
-            // If someone's connected with telnet, deal with it
-            telnetClient = telnetServer.available();
-            if(telnetClient.connected())
+            // Deal with any NTP reply or timeout
+            if(clockState == STATE_TIMING)
             {
-                telnetShowStatus(telnetClient);
-                telnetClient.flush();
-                telnetClient.stop();
+                clockState = checkNtp();
             }
-#endif
 
-#ifdef __WITH_HTTP
+            // Redraw the display if the time, sync state, mode switch or buttons have changed
+            renderDisplay();
+            break;
 
-            // If someone's connected to webserver, deal with it
-            httpClient = httpServer.available();
-            if(httpClient.connected())
+        case STATE_HOLDOVER:
+            // Same as timing, but with no NTP
+            if(tbSecondEdge() == true)
             {
-                httpRequestHandler();
-                httpClient.flush();
-                httpClient.stop();
+                secondTick();
+                clockState = checkHoldover();
             }
-#endif
+
+            renderDisplay();
             break;
  
         case STATE_STOPPED:
             Serial.println("***********************");
             Serial.println("***  S T O P P E D  ***");
             Serial.println("***********************");
-            timeClient.end();
+            taskNetStop();
+            ntpEnd();
+            tbHoldover(false);
 #ifdef __WITH_TELNET
             telnetServer.end();
 #endif
 #ifdef __WITH_TELNET_CLI
+            // A telnet session goes with the network
+            if(cliRunning() == true)
+            {
+                cliEnd();
+            }
             telnet.stop();
 #endif
 #ifdef __WITH_HTTP
@@ -1291,34 +1805,36 @@ void loop()
             clockState = STATE_STOPPED;
     }
 
-#ifdef __WITH_TELNET_CLI
-    telnet.loop();
-    if(newTelnetConnection == true)
-    {
-        newTelnetConnection = false;
-        commandInterpretter();
-        clockState = STATE_STOPPED;
-    }
-#else
-    // If someone's plugged the serial cable in and pressed a key
-    // Enter CLI
-    // Restart state machine when exiting CLI
-    if(Serial.available() > 0)
-    {
-        commandInterpretter();
-        clockState = STATE_STOPPED;
-    }
-#endif
+    // Anything typed at the CLI
+    cliPoll();
 
-    checkReboot();
+    // Catch up with any display change that had to wait
+    dispUpdate();
 
-#ifdef __WITH_FTP
-    ftpSrv.handleFTP();
+    countLoops();
+
+#ifdef __WITH_NTP_SERVER
+    ntpServerTick();
 #endif
 
-#ifdef __WITH_OTA
+    dnsCacheTick();
 
-    ArduinoOTA.handle();
+    morseTick();
 
+    // Anything the network task wants doing
+    taskRequests();
+
+#ifdef __MK2_HW
+    checkReboot();
 #endif
+
+#ifndef __WITH_NET_TASK
+    if(taskNetRunning() == true)
+    {
+        networkServices();
+    }
+#endif
+
+    taskPassDone(TASK_CLOCK, startUs);
+    taskIdle();
 }
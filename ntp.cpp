@@ -0,0 +1,1640 @@
+#include "config.h"
+
+#ifdef __MK1_HW
+#include <WiFi101.h>
+#else
+#include <WiFi.h>
+#include "lwip/udp.h"
+#include "lwip/pbuf.h"
+#include "lwip/priv/tcpip_priv.h"
+#ifdef __WITH_TELNET_CLI
+#include <ESPTelnet.h>
+#endif
+#endif
+#include <WiFiUdp.h>
+
+#include "types.h"
+#include "globals.h"
+#include "timebase.h"
+#include "ntp.h"
+#include "ntpserver.h"
+#include "dnscache.h"
+
+// NTP client...
+//   Sends a mode 3 (client) request with the transmit timestamp set to the local time (T1) and
+//   notes the local time the reply arrives (T4).  The reply has the server's receive (T2) and
+//   transmit (T3) times, to a fraction of a second, so
+//     offset = ((T2 - T1) + (T3 - T4)) / 2
+//     delay  = (T4 - T1) - (T3 - T2)
+//   ntpRequest() sends the requests and returns straight away, ntpPoll() is called every time round
+//   loop() to look for replies or notice that they've taken too long.
+//
+// Timestamps...
+//   On MK2 the client has its own lwIP socket.  T1 is taken in the network task just before the request
+//   goes to the WiFi driver and T4 in the receive callback as the reply arrives, and the replies wait in
+//   a queue for loop().  So however long loop() takes to get round to them, or the stack takes to build
+//   the packet, none of it ends up in the offset.  MK1 has no way in to the WiFi101 stack, so T4 is
+//   when loop() sees the reply.
+//   Two histograms show how well that works - how far each sample's offset is from its source's filtered
+//   offset (jitter), and how long replies waited for loop() (what would have been in the offset).
+//   "Late" timestamps (T4 when loop() reads the reply, the old way) can be turned on to compare.
+//
+// Sources...
+//   Every address the configured server names resolve to is a source, up to NTP_MAX_PER_NAME from one
+//   name.  The names come from the DNS cache, so a poll doesn't wait for DNS unless a name's never
+//   been looked up.  How long each poll takes to resolve the names and send the requests is kept.
+//   Each source keeps its last NTP_FILTER_SIZE samples and uses the one with the lowest delay.
+//   Its root distance (half the round trip to the reference clock plus all the dispersion) gives
+//   an interval the true time should be in.
+//
+// Selection...
+//   Marzullo's algorithm finds the smallest interval that a majority of sources agree on.  Sources
+//   with their offset outside that are falsetickers.  The survivors are clustered by throwing out
+//   the one furthest from the rest until what's left agree as well as the sources themselves are
+//   stable.  Their offsets are combined, weighted by root distance.
+//   Tally codes as ntpq - 'x' falseticker, '-' dropped by clustering, '+' survivor, '*' system peer
+//
+// Poll interval...
+//   Starts at initUpdate seconds and doubles, up to syncUpdate, each time NTP_POLL_LIMIT replies in a row
+//   have had an offset within NTP_POLL_GATE times the jitter.  A bigger offset or a change in the
+//   frequency correction (the oscillator has drifted, usually with temperature) halves it again.
+//   A step or the NTP client restarting after WiFi has been lost go straight back to the start.
+//   No reply goes back to the start too, then doubles for each poll in a row with no reply.
+//
+// Scheduling...
+//   Clocks that all came back from the same power cut would otherwise poll in step with each other
+//   for ever.  So the first poll is up to NTP_START_SPREAD seconds late and each interval is moved by up
+//   to 1/NTP_POLL_JITTER either way, which spreads them out more and more.  The random numbers come from
+//   a generator seeded from the MAC address, so every clock has its own sequence and there's no need
+//   for the RF noise esp_random() uses (and MK1 doesn't have).
+//   A kiss-o'-death with stratum 0 and RATE in the reference ID leaves that source alone for
+//   NTP_KOD_HOLDOFF seconds, doubling each time, and makes the poll interval longer.  DENY or RSTR
+//   drops the source and keeps its address out of the DNS cache's answers.
+//
+// Broadcast client...
+//   With "broadcast" or a multicast group configured the clock listens for mode 5 packets on NTP_PORT
+//   as well.  The first one heard from a server while nothing else is outstanding starts one client
+//   exchange with it to measure the round trip delay.  After that each broadcast gives
+//     offset = T3 - T4 + delay / 2
+//   and no requests are sent at all.  If nothing's heard for NTP_BCAST_TIMEOUT seconds it's back to
+//   polling the configured servers until broadcasts start again, then it calibrates again.
+//   With the NTP server built in that owns NTP_PORT, so it passes broadcasts on with their arrival time.
+//
+// Other tasks...
+//   Everything here belongs to loop().  The web server runs in another task, so it gets its list of
+//   sources from a copy loop() makes once a second into whichever of two it isn't reading, like the
+//   NTP server's reply header.  Its copy is taken again if loop() swapped them part way through.
+
+#ifdef __MK2_HW
+struct udp_pcb *ntpPcb = NULL;
+ntpRxPacket_t ntpRxQueue[NTP_RX_QUEUE];
+volatile int ntpRxHead;                  // Written by the network task
+volatile int ntpRxTail;                  // Written by loop()
+volatile unsigned long int ntpRxDropped; // Queue was full
+#else
+WiFiUDP ntpUDP;
+#endif
+boolean ntpLateStamps;                   // T4 when loop() reads the reply, for comparison
+unsigned long int ntpJitterHist[NTP_HIST_BINS];
+unsigned long int ntpWaitHist[NTP_HIST_BINS];
+
+ntpResultType ntpState;                  // NTP_WAITING while there are requests outstanding
+unsigned long int ntpSentMs;             // For the timeout
+unsigned long int ntpRequestUs;          // Time the last poll took to resolve the names and send
+unsigned long int ntpRequestAvgUs;
+unsigned long int ntpRequestWorstUs;
+
+ntpSource_t ntpSources[NTP_MAX_SOURCES];
+int ntpSourceCount;
+int ntpSysPeer;                          // Source chosen as system peer, -1 for none
+
+ntpSourceView_t ntpViews[2][NTP_MAX_SOURCES + 1]; // Copies of the sources and broadcast server for other tasks
+int ntpViewCount[2];
+volatile int ntpViewNow;                 // The one they read
+volatile unsigned long int ntpViewSeq;   // Counts copies
+
+int ntpPollLevel;                        // Poll interval is initUpdate doubled this many times
+int ntpPollCounter;                      // Stable replies since the interval last changed
+char *ntpPollWhy = "not started";       // Reason for the last change
+unsigned long int ntpPollChangedMs;      // When it changed
+
+uint32_t ntpRandState;                   // Scheduling random numbers, 0 until seeded
+
+ntpBcastType ntpBcastState;
+ntpSource_t ntpBcast;                    // The broadcast server being listened to
+IPAddress ntpBcastGroup;                 // 255.255.255.255 for broadcasts
+boolean ntpBcastRound;                   // The request outstanding is the calibration exchange
+unsigned long int ntpBcastHeardMs;       // When the last broadcast was used
+volatile boolean ntpBcastFull;           // A broadcast is waiting to be dealt with
+unsigned char ntpBcastPacket[NTP_PACKET_SIZE];
+uint32_t ntpBcastFrom;
+int64_t ntpBcastRxUs;                    // UTC it arrived
+#ifndef __WITH_NTP_SERVER
+WiFiUDP ntpBcastUDP;
+#endif
+
+#ifdef __MK2_HW
+// Called by lwIP in the network task for every packet to NTP_CLIENT_PORT
+void ntpRecv(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
+{
+    int64_t t4;
+    int next;
+
+    t4 = tbNowUs();
+
+    next = (ntpRxHead + 1) % NTP_RX_QUEUE;
+    if(next == ntpRxTail || !IP_IS_V4(addr) ||
+       pbuf_copy_partial(p, ntpRxQueue[ntpRxHead].packet, NTP_PACKET_SIZE, 0) != NTP_PACKET_SIZE)
+    {
+        ntpRxDropped++;
+        pbuf_free(p);
+        return;
+    }
+    pbuf_free(p);
+
+    ntpRxQueue[ntpRxHead].from = ip4_addr_get_u32(ip_2_ip4(addr));
+    ntpRxQueue[ntpRxHead].t4 = t4;
+    __sync_synchronize();
+    ntpRxHead = next;
+}
+
+err_t ntpOpen(struct tcpip_api_call_data *call)
+{
+    ntpPcb = udp_new();
+    if(ntpPcb == NULL)
+    {
+        return ERR_MEM;
+    }
+
+    if(udp_bind(ntpPcb, IP_ANY_TYPE, NTP_CLIENT_PORT) != ERR_OK)
+    {
+        udp_remove(ntpPcb);
+        ntpPcb = NULL;
+        return ERR_USE;
+    }
+
+    udp_recv(ntpPcb, ntpRecv, NULL);
+
+    return ERR_OK;
+}
+
+err_t ntpClose(struct tcpip_api_call_data *call)
+{
+    if(ntpPcb != NULL)
+    {
+        udp_remove(ntpPcb);
+        ntpPcb = NULL;
+    }
+
+    return ERR_OK;
+}
+
+typedef struct
+{
+    struct tcpip_api_call_data call;
+    ip_addr_t to;
+    unsigned char *packet;
+    int64_t t1;
+} ntpSendCall_t;
+
+// Runs in the network task, T1 goes in the packet as late as it can
+err_t ntpSendNow(struct tcpip_api_call_data *call)
+{
+    ntpSendCall_t *sendCall;
+    struct pbuf *p;
+    err_t err;
+
+    sendCall = (ntpSendCall_t *)call;
+    if(ntpPcb == NULL)
+    {
+        return ERR_CONN;
+    }
+
+    p = pbuf_alloc(PBUF_TRANSPORT, NTP_PACKET_SIZE, PBUF_RAM);
+    if(p == NULL)
+    {
+        return ERR_MEM;
+    }
+
+    sendCall -> t1 = tbNowUs();
+    usToNtp(sendCall -> t1, &sendCall -> packet[40]);
+    memcpy(p -> payload, sendCall -> packet, NTP_PACKET_SIZE);
+    err = udp_sendto(ntpPcb, p, &sendCall -> to, NTP_PORT);
+    pbuf_free(p);
+
+    return err;
+}
+#endif
+
+void ntpBegin()
+{
+#ifdef __MK2_HW
+    struct tcpip_api_call_data call;
+#endif
+
+    ntpState = NTP_IDLE;
+    if(ntpRandState == 0)
+    {
+        ntpSeedRandom();
+    }
+#ifdef __MK2_HW
+    ntpRxHead = 0;
+    ntpRxTail = 0;
+    if(ntpPcb == NULL && tcpip_api_call(ntpOpen, &call) != ERR_OK)
+    {
+        Serial.println("[NTP ] Can't open the NTP client socket");
+    }
+#else
+    ntpUDP.begin(NTP_CLIENT_PORT);
+#endif
+    ntpBroadcastBegin();
+    dnsCacheBegin();
+}
+
+void ntpEnd()
+{
+#ifdef __MK2_HW
+    struct tcpip_api_call_data call;
+#endif
+
+    ntpBroadcastEnd();
+    dnsCacheEnd();
+    ntpState = NTP_IDLE;
+#ifdef __MK2_HW
+    tcpip_api_call(ntpClose, &call);
+#else
+    ntpUDP.stop();
+#endif
+}
+
+// Send a request, the transmit timestamp (T1) is put in the packet and returned in t1
+boolean ntpSendPacket(IPAddress to, unsigned char *packet, int64_t *t1)
+{
+#ifdef __MK2_HW
+    ntpSendCall_t sendCall;
+
+    ip_addr_set_ip4_u32(&sendCall.to, (uint32_t)to);
+    sendCall.packet = packet;
+    sendCall.t1 = 0;
+    if(tcpip_api_call(ntpSendNow, &sendCall.call) != ERR_OK)
+    {
+        return false;
+    }
+    *t1 = sendCall.t1;
+
+    return true;
+#else
+    *t1 = tbNowUs();
+    usToNtp(*t1, &packet[40]);
+
+    ntpUDP.beginPacket(to, NTP_PORT);
+    ntpUDP.write(packet, NTP_PACKET_SIZE);
+    return ntpUDP.endPacket() == 1;
+#endif
+}
+
+// Next reply, with its arrival time (T4) in t4 and how long it waited to be read in waitUs
+// Returns false if there isn't one
+boolean ntpReceivePacket(unsigned char *packet, IPAddress *from, int64_t *t4, int64_t *waitUs)
+{
+    int64_t readUs;
+
+#ifdef __MK2_HW
+    if(ntpRxTail == ntpRxHead)
+    {
+        return false;
+    }
+
+    readUs = tbNowUs();
+    __sync_synchronize();
+    memcpy(packet, ntpRxQueue[ntpRxTail].packet, NTP_PACKET_SIZE);
+    *from = IPAddress(ntpRxQueue[ntpRxTail].from);
+    *t4 = ntpRxQueue[ntpRxTail].t4;
+    __sync_synchronize();
+    ntpRxTail = (ntpRxTail + 1) % NTP_RX_QUEUE;
+#else
+    if(ntpUDP.parsePacket() < NTP_PACKET_SIZE)
+    {
+        return false;
+    }
+
+    readUs = tbNowUs();
+    *from = ntpUDP.remoteIP();
+    ntpUDP.read(packet, NTP_PACKET_SIZE);
+    *t4 = readUs;
+#endif
+
+    *waitUs = readUs - *t4;
+    if(ntpLateStamps == true)
+    {
+        *t4 = readUs;
+    }
+
+    return true;
+}
+
+// Count a time in microseconds in a histogram
+void ntpHistAdd(unsigned long int *hist, int64_t us)
+{
+    int bin;
+
+    us = us < 0 ? -us : us;
+    bin = 0;
+    while(bin < NTP_HIST_BINS - 1 && (us >> (bin + NTP_HIST_SHIFT)) != 0)
+    {
+        bin++;
+    }
+
+    hist[bin]++;
+}
+
+void ntpClearHist()
+{
+    int c;
+
+    for(c = 0; c < NTP_HIST_BINS; c++)
+    {
+        ntpJitterHist[c] = 0;
+        ntpWaitHist[c] = 0;
+    }
+}
+
+// Histograms as lines of "upper limit us|jitter count|wait count", the last bin has no upper limit
+void ntpHistExport(Print &out)
+{
+    int c;
+    char line[48];
+
+    for(c = 0; c < NTP_HIST_BINS; c++)
+    {
+        if(c < NTP_HIST_BINS - 1)
+        {
+            sprintf(line, "%lu|%lu|%lu\r\n", 1UL << (c + NTP_HIST_SHIFT), ntpJitterHist[c], ntpWaitHist[c]);
+        }
+        else
+        {
+            sprintf(line, "-|%lu|%lu\r\n", ntpJitterHist[c], ntpWaitHist[c]);
+        }
+        out.print(line);
+    }
+}
+
+void ntpSetLateStamps(boolean late)
+{
+    ntpLateStamps = late;
+    ntpClearHist();
+}
+
+boolean ntpGetLateStamps()
+{
+    return ntpLateStamps;
+}
+
+unsigned long int ntpGetRxDropped()
+{
+#ifdef __MK2_HW
+    return ntpRxDropped;
+#else
+    return 0;
+#endif
+}
+
+// 64 bit NTP timestamp (seconds since 1900 and 32 bit fraction) to microseconds since 1970
+int64_t ntpToUs(unsigned char *ts)
+{
+    unsigned long int seconds;
+    unsigned long int fraction;
+
+    seconds = ((unsigned long int)ts[0] << 24) | ((unsigned long int)ts[1] << 16) | ((unsigned long int)ts[2] << 8) | ts[3];
+    fraction = ((unsigned long int)ts[4] << 24) | ((unsigned long int)ts[5] << 16) | ((unsigned long int)ts[6] << 8) | ts[7];
+
+    return ((int64_t)seconds - NTP_UNIX_OFFSET) * 1000000 + ((((uint64_t)fraction * 1000000) + 0x80000000) >> 32);
+}
+
+// Microseconds since 1970 to NTP timestamp
+void usToNtp(int64_t us, unsigned char *ts)
+{
+    unsigned long int seconds;
+    unsigned long int fraction;
+
+    seconds = (unsigned long int)((us / 1000000) + NTP_UNIX_OFFSET);
+    fraction = (unsigned long int)(((((uint64_t)(us % 1000000)) << 32) + 500000) / 1000000);
+
+    ts[0] = seconds >> 24;
+    ts[1] = seconds >> 16;
+    ts[2] = seconds >> 8;
+    ts[3] = seconds;
+    ts[4] = fraction >> 24;
+    ts[5] = fraction >> 16;
+    ts[6] = fraction >> 8;
+    ts[7] = fraction;
+}
+
+// 32 bit NTP short format (16 bit seconds, 16 bit fraction) to microseconds
+long int ntpShortToUs(unsigned char *ts)
+{
+    unsigned long int value;
+
+    value = ((unsigned long int)ts[0] << 24) | ((unsigned long int)ts[1] << 16) | ((unsigned long int)ts[2] << 8) | ts[3];
+
+    return (long int)(((uint64_t)value * 1000000) >> 16);
+}
+
+// Microseconds to 32 bit NTP short format
+void usToNtpShort(long int us, unsigned char *ts)
+{
+    unsigned long int value;
+
+    value = (unsigned long int)((((uint64_t)us) << 16) / 1000000);
+
+    ts[0] = value >> 24;
+    ts[1] = value >> 16;
+    ts[2] = value >> 8;
+    ts[3] = value;
+}
+
+// Configured server name n, NULL if there isn't one
+char *ntpServerName(int n)
+{
+    char *name;
+
+    if(n == 0)
+    {
+        name = clockConfig.ntpServer;
+    }
+    else if(n <= NTP_EXTRA_SERVERS)
+    {
+        name = clockConfig.ntpExtraServer[n - 1];
+    }
+    else
+    {
+        return NULL;
+    }
+
+    if(name[0] == '\0')
+    {
+        return NULL;
+    }
+
+    return name;
+}
+
+// Forget about all the sources - when the servers have been changed
+void ntpClearSources()
+{
+    ntpSourceCount = 0;
+    ntpSysPeer = -1;
+}
+
+// Forget all the samples - when the time's been stepped
+void ntpClearFilters()
+{
+    int c;
+
+    for(c = 0; c < ntpSourceCount; c++)
+    {
+        ntpSources[c].filterCount = 0;
+        ntpSources[c].filterNext = 0;
+    }
+
+    ntpBcast.filterCount = 0;
+    ntpBcast.filterNext = 0;
+}
+
+// Look up the server names and add any new addresses as sources
+// Sources that haven't replied to any of the last 8 requests, or have refused to, are dropped to make room
+void ntpResolveSources()
+{
+    int c;
+    int a;
+    int n;
+    int fromName;
+    int addrCount;
+    char *name;
+    IPAddress addr[DNS_MAX_ADDRS];
+    boolean known;
+
+    c = 0;
+    while(c < ntpSourceCount)
+    {
+        if((ntpSources[c].reach == 0 && ntpSources[c].polls >= 8) || ntpSources[c].denied == true)
+        {
+            Serial.printf("[NTP ] Dropping %s (%s)\r\n", ntpSources[c].addr.toString().c_str(), ntpSources[c].name);
+            dnsAvoid(ntpSources[c].name, ntpSources[c].addr);
+            ntpSourceCount--;
+            ntpSources[c] = ntpSources[ntpSourceCount];
+        }
+        else
+        {
+            c++;
+        }
+    }
+
+    for(n = 0; (name = ntpServerName(n)) != NULL; n++)
+    {
+        addrCount = dnsLookup(name, addr, DNS_MAX_ADDRS);
+        if(addrCount == 0)
+        {
+            Serial.printf("[NTP ] Can't find address of %s\r\n", name);
+            continue;
+        }
+
+        for(a = 0; a < addrCount; a++)
+        {
+            known = false;
+            fromName = 0;
+            for(c = 0; c < ntpSourceCount; c++)
+            {
+                if(ntpSources[c].addr == addr[a])
+                {
+                    known = true;
+                }
+
+                if(ntpSources[c].name == name)
+                {
+                    fromName++;
+                }
+            }
+
+            if(known == false && fromName < NTP_MAX_PER_NAME && ntpSourceCount < NTP_MAX_SOURCES)
+            {
+                Serial.printf("[NTP ] New source %s (%s)\r\n", addr[a].toString().c_str(), name);
+                memset(&ntpSources[ntpSourceCount], 0, sizeof(ntpSource_t));
+                ntpSources[ntpSourceCount].name = name;
+                ntpSources[ntpSourceCount].addr = addr[a];
+                ntpSources[ntpSourceCount].tally = ' ';
+                ntpSourceCount++;
+            }
+        }
+    }
+}
+
+// Send a request to one source
+void ntpSendRequest(ntpSource_t *source)
+{
+    unsigned char packet[NTP_PACKET_SIZE];
+
+    memset(packet, 0, NTP_PACKET_SIZE);
+    packet[0] = NTP_LI_VN_MODE;
+    packet[1] = 0;                           // Stratum
+    packet[2] = 6;                           // Poll interval
+    packet[3] = 0xec;                        // Precision
+
+    if(ntpSendPacket(source -> addr, packet, &source -> t1) == false)
+    {
+        Serial.printf("[NTP ] Can't send request to %s\r\n", source -> addr.toString().c_str());
+    }
+    memcpy(source -> sent, &packet[40], 8);
+
+    source -> waiting = true;
+    source -> reach = source -> reach << 1;
+    source -> polls++;
+}
+
+// Send requests to all sources, replies are picked up by ntpPoll()
+boolean ntpRequest()
+{
+    int c;
+    unsigned char packet[NTP_PACKET_SIZE];
+    IPAddress from;
+    int64_t t4;
+    int64_t waitUs;
+    unsigned long int startUs;
+    int sent;
+
+    startUs = micros();
+
+    ntpResolveSources();
+    if(ntpSourceCount == 0)
+    {
+        ntpState = NTP_IDLE;
+        return false;
+    }
+
+    // Throw away anything left over from last time, they don't count towards the waiting times either
+    while(ntpReceivePacket(packet, &from, &t4, &waitUs) == true)
+    {
+    }
+
+    // Not the ones that have asked to be left alone for now
+    sent = 0;
+    for(c = 0; c < ntpSourceCount; c++)
+    {
+        if(millis() - ntpSources[c].holdStartMs >= ntpSources[c].holdMs)
+        {
+            ntpSendRequest(&ntpSources[c]);
+            sent++;
+        }
+    }
+
+    if(sent == 0)
+    {
+        ntpState = NTP_IDLE;
+        return false;
+    }
+
+    ntpSentMs = millis();
+    ntpState = NTP_WAITING;
+
+    ntpRequestUs = micros() - startUs;
+    if(ntpRequestUs > ntpRequestWorstUs)
+    {
+        ntpRequestWorstUs = ntpRequestUs;
+    }
+    if(ntpRequestAvgUs == 0)
+    {
+        ntpRequestAvgUs = ntpRequestUs;
+    }
+    else
+    {
+        ntpRequestAvgUs = ntpRequestAvgUs + ((long int)ntpRequestUs - (long int)ntpRequestAvgUs) / 8;
+    }
+
+    return true;
+}
+
+// How long the last poll took to resolve the names and send the requests, and the average of the last 8 or so
+unsigned long int ntpGetRequestUs()
+{
+    return ntpRequestUs;
+}
+
+unsigned long int ntpGetRequestAvgUs()
+{
+    return ntpRequestAvgUs;
+}
+
+unsigned long int ntpGetRequestWorstUs()
+{
+    return ntpRequestWorstUs;
+}
+
+boolean ntpBusy()
+{
+    return (ntpState == NTP_WAITING);
+}
+
+// Add a sample to a source's filter and work out its offset, delay, jitter and root distance
+void ntpFilter(ntpSource_t *source, ntpSample_t *sample)
+{
+    int c;
+    int best;
+    long int age;
+    long int disp;
+    float diff;
+    float sum;
+
+    source -> filter[source -> filterNext] = *sample;
+    source -> filterNext = (source -> filterNext + 1) % NTP_FILTER_SIZE;
+    if(source -> filterCount < NTP_FILTER_SIZE)
+    {
+        source -> filterCount++;
+    }
+
+    // Lowest delay sample is the one least upset by network queues
+    best = 0;
+    for(c = 1; c < source -> filterCount; c++)
+    {
+        if(source -> filter[c].delayUs < source -> filter[best].delayUs)
+        {
+            best = c;
+        }
+    }
+
+    sum = 0;
+    for(c = 0; c < source -> filterCount; c++)
+    {
+        diff = source -> filter[c].offsetUs - source -> filter[best].offsetUs;
+        sum = sum + (diff * diff);
+    }
+
+    source -> offsetUs = source -> filter[best].offsetUs;
+    source -> delayUs = source -> filter[best].delayUs;
+    source -> jitterUs = sqrtf(sum / source -> filterCount);
+    source -> stratum = source -> filter[best].stratum;
+    source -> rootDelayUs = source -> filter[best].rootDelayUs;
+
+    // Dispersion grows at NTP_PHI_PPM with the sample's age
+    age = (millis() - source -> filter[best].ms) / 1000;
+    disp = NTP_PRECISION_US + (age * NTP_PHI_PPM);
+
+    source -> distanceUs = (source -> delayUs + source -> filter[best].rootDelayUs) / 2 +
+                           source -> filter[best].rootDispUs + disp + source -> jitterUs;
+}
+
+// Deal with a reply from a source
+void ntpReply(ntpSource_t *source, unsigned char *packet, int64_t t4)
+{
+    int64_t t2;
+    int64_t t3;
+    ntpSample_t sample;
+
+    source -> waiting = false;
+
+    if(packet[1] == 0)
+    {
+        ntpKissOfDeath(source, packet);
+        return;
+    }
+
+    // Leap indicator 3 is an unsynchronised server
+    if(packet[1] > 15 || (packet[0] & 0xc0) == 0xc0)
+    {
+        Serial.printf("[NTP ] %s not usable (stratum %d)\r\n", source -> addr.toString().c_str(), packet[1]);
+        return;
+    }
+
+    t2 = ntpToUs(&packet[32]);
+    t3 = ntpToUs(&packet[40]);
+
+    sample.offsetUs = ((t2 - source -> t1) + (t3 - t4)) / 2;
+    sample.delayUs = (t4 - source -> t1) - (t3 - t2);
+    sample.stratum = packet[1];
+    sample.rootDelayUs = ntpShortToUs(&packet[4]);
+    sample.rootDispUs = ntpShortToUs(&packet[8]);
+    sample.jitterUs = 0;
+    sample.ms = millis();
+
+    if(sample.delayUs < 0)
+    {
+        sample.delayUs = 0;
+    }
+
+    if(source -> filterCount > 0)
+    {
+        ntpHistAdd(ntpJitterHist, sample.offsetUs - source -> offsetUs);
+    }
+
+    source -> reach = source -> reach | 0x01;
+    source -> replies++;
+    source -> kissCount = 0;
+    ntpFilter(source, &sample);
+}
+
+// Stratum 0 reply, the reference ID is a kiss code saying why
+void ntpKissOfDeath(ntpSource_t *source, unsigned char *packet)
+{
+    unsigned long int holdS;
+    int c;
+
+    for(c = 0; c < 4; c++)
+    {
+        source -> kiss[c] = isprint(packet[12 + c]) ? packet[12 + c] : '?';
+    }
+    source -> kiss[4] = '\0';
+
+    Serial.printf("[NTP ] Kiss-o'-death %s from %s\r\n", source -> kiss, source -> addr.toString().c_str());
+
+    if(strcmp(source -> kiss, "RATE") == 0)
+    {
+        holdS = (unsigned long int)NTP_KOD_HOLDOFF << min(source -> kissCount, NTP_KOD_MAX_SHIFT);
+        source -> kissCount++;
+        source -> holdStartMs = millis();
+        source -> holdMs = holdS * 1000;
+        ntpPollSet(ntpPollLevel + 1, "rate limited");
+    }
+    else if(strcmp(source -> kiss, "DENY") == 0 || strcmp(source -> kiss, "RSTR") == 0)
+    {
+        source -> denied = true;
+    }
+}
+
+// Marzullo intersection then clustering
+// Returns the number of survivors, with the combined result in sample
+int ntpSelect(ntpSample_t *sample)
+{
+    int c;
+    int d;
+    int n;
+    int allow;
+    int count;
+    int survivors;
+    int worst;
+    int64_t low;
+    int64_t high;
+    int64_t endpoint[NTP_MAX_SOURCES * 2];
+    int type[NTP_MAX_SOURCES * 2];
+    int candidate[NTP_MAX_SOURCES];
+    float selJitter;
+    float worstJitter;
+    float minJitter;
+    float diff;
+    float weight;
+    float sumWeight;
+    float sumOffset;
+    float sumJitter;
+
+    ntpSysPeer = -1;
+
+    // Candidates are sources with samples and a sensible root distance
+    n = 0;
+    for(c = 0; c < ntpSourceCount; c++)
+    {
+        ntpSources[c].tally = ' ';
+        if(ntpSources[c].filterCount > 0 && ntpSources[c].reach != 0 && ntpSources[c].distanceUs < NTP_MAX_DIST_US)
+        {
+            candidate[n] = c;
+            n++;
+        }
+    }
+
+    if(n == 0)
+    {
+        return 0;
+    }
+
+    // Interval ends, lower ends count +1, upper ends -1
+    // Sorted by value with lower ends first when they're the same
+    for(c = 0; c < n; c++)
+    {
+        endpoint[c * 2] = ntpSources[candidate[c]].offsetUs - ntpSources[candidate[c]].distanceUs;
+        type[c * 2] = 1;
+        endpoint[(c * 2) + 1] = ntpSources[candidate[c]].offsetUs + ntpSources[candidate[c]].distanceUs;
+        type[(c * 2) + 1] = -1;
+    }
+
+    for(c = 1; c < n * 2; c++)
+    {
+        for(d = c; d > 0 && (endpoint[d - 1] > endpoint[d] || (endpoint[d - 1] == endpoint[d] && type[d - 1] < type[d])); d--)
+        {
+            low = endpoint[d];
+            endpoint[d] = endpoint[d - 1];
+            endpoint[d - 1] = low;
+            count = type[d];
+            type[d] = type[d - 1];
+            type[d - 1] = count;
+        }
+    }
+
+    // Allow more and more falsetickers until the rest agree on something
+    for(allow = 0; (allow * 2) < n; allow++)
+    {
+        // Start with an empty intersection in case not enough intervals overlap
+        low = INT64_MAX;
+        high = INT64_MIN;
+
+        count = 0;
+        for(c = 0; c < n * 2; c++)
+        {
+            count = count + type[c];
+            if(count >= n - allow)
+            {
+                low = endpoint[c];
+                break;
+            }
+        }
+
+        count = 0;
+        for(c = (n * 2) - 1; c >= 0; c--)
+        {
+            count = count - type[c];
+            if(count >= n - allow)
+            {
+                high = endpoint[c];
+                break;
+            }
+        }
+
+        if(low <= high)
+        {
+            break;
+        }
+    }
+
+    if((allow * 2) >= n)
+    {
+        // No majority
+        for(c = 0; c < n; c++)
+        {
+            ntpSources[candidate[c]].tally = 'x';
+        }
+        return 0;
+    }
+
+    // Truechimers have their offset in the intersection
+    survivors = 0;
+    for(c = 0; c < n; c++)
+    {
+        if(ntpSources[candidate[c]].offsetUs >= low && ntpSources[candidate[c]].offsetUs <= high)
+        {
+            candidate[survivors] = candidate[c];
+            survivors++;
+        }
+        else
+        {
+            ntpSources[candidate[c]].tally = 'x';
+        }
+    }
+
+    if(survivors == 0)
+    {
+        return 0;
+    }
+
+    // Clustering - throw out the survivor with the most selection jitter until that's no
+    // worse than the jitter of the best source, or there are only NTP_MIN_CLUSTER left
+    while(survivors > NTP_MIN_CLUSTER)
+    {
+        worst = 0;
+        worstJitter = -1;
+        minJitter = ntpSources[candidate[0]].jitterUs;
+
+        for(c = 0; c < survivors; c++)
+        {
+            selJitter = 0;
+            for(d = 0; d < survivors; d++)
+            {
+                diff = ntpSources[candidate[c]].offsetUs - ntpSources[candidate[d]].offsetUs;
+                selJitter = selJitter + (diff * diff);
+            }
+            selJitter = sqrtf(selJitter / (survivors - 1));
+
+            if(selJitter > worstJitter)
+            {
+                worstJitter = selJitter;
+                worst = c;
+            }
+
+            if(ntpSources[candidate[c]].jitterUs < minJitter)
+            {
+                minJitter = ntpSources[candidate[c]].jitterUs;
+            }
+        }
+
+        if(worstJitter <= minJitter)
+        {
+            break;
+        }
+
+        ntpSources[candidate[worst]].tally = '-';
+        survivors--;
+        candidate[worst] = candidate[survivors];
+    }
+
+    // The survivor with the lowest root distance is the system peer
+    for(c = 0; c < survivors; c++)
+    {
+        ntpSources[candidate[c]].tally = '+';
+        if(ntpSysPeer < 0 || ntpSources[candidate[c]].distanceUs < ntpSources[ntpSysPeer].distanceUs)
+        {
+            ntpSysPeer = candidate[c];
+        }
+    }
+
+    ntpSources[ntpSysPeer].tally = '*';
+
+    // Combine the survivors weighted by root distance
+    // Offsets are decades at cold start, more than a float can hold to the microsecond, so only the
+    // differences from the system peer go through the float sums
+    sumWeight = 0;
+    sumOffset = 0;
+    for(c = 0; c < survivors; c++)
+    {
+        weight = 1.0 / (ntpSources[candidate[c]].distanceUs + 1);
+        sumWeight = sumWeight + weight;
+        sumOffset = sumOffset + (weight * (ntpSources[candidate[c]].offsetUs - ntpSources[ntpSysPeer].offsetUs));
+    }
+
+    sample -> offsetUs = ntpSources[ntpSysPeer].offsetUs + (int64_t)(sumOffset / sumWeight);
+
+    sumJitter = 0;
+    for(c = 0; c < survivors; c++)
+    {
+        diff = ntpSources[candidate[c]].offsetUs - sample -> offsetUs;
+        sumJitter = sumJitter + (diff * diff);
+    }
+
+    sample -> delayUs = ntpSources[ntpSysPeer].delayUs;
+    sample -> stratum = ntpSources[ntpSysPeer].stratum;
+    sample -> rootDelayUs = ntpSources[ntpSysPeer].rootDelayUs + ntpSources[ntpSysPeer].delayUs;
+    sample -> rootDispUs = ntpSources[ntpSysPeer].distanceUs;
+    sample -> jitterUs = sqrtf(sumJitter / survivors);
+    sample -> ms = millis();
+
+    return survivors;
+}
+
+// Called every time round loop() - never waits
+// NTP_REPLY with the combined sample filled in, NTP_TIMEDOUT or NTP_FAILED when the round of requests
+// has finished, otherwise NTP_WAITING or NTP_IDLE
+ntpResultType ntpPoll(ntpSample_t *sample)
+{
+    unsigned char packet[NTP_PACKET_SIZE];
+    int64_t t4;
+    int64_t waitUs;
+    int c;
+    int waiting;
+    int replies;
+    IPAddress from;
+
+    // Before any new samples go in, bring the old ones up to date with the clock
+    ntpClockAdjusted(tbTakeSlewedUs());
+
+    if(ntpBroadcastCheck(sample) == true)
+    {
+        return NTP_REPLY;
+    }
+
+    if(ntpState != NTP_WAITING)
+    {
+        return NTP_IDLE;
+    }
+
+    if(ntpReceivePacket(packet, &from, &t4, &waitUs) == true)
+    {
+        // Must be a server reply to one of the requests, anything else is ignored
+        // Only those go in the waiting time histogram
+        if((packet[0] & 0x07) == NTP_MODE_SERVER)
+        {
+            for(c = 0; c < ntpSourceCount; c++)
+            {
+                if(ntpSources[c].waiting == true && ntpSources[c].addr == from && memcmp(&packet[24], ntpSources[c].sent, 8) == 0)
+                {
+                    ntpHistAdd(ntpWaitHist, waitUs);
+                    ntpReply(&ntpSources[c], packet, t4);
+                }
+            }
+
+            if(ntpBcast.waiting == true && ntpBcast.addr == from && memcmp(&packet[24], ntpBcast.sent, 8) == 0)
+            {
+                ntpHistAdd(ntpWaitHist, waitUs);
+                ntpBroadcastCalibrate(packet, t4);
+            }
+        }
+    }
+
+    waiting = 0;
+    replies = 0;
+    for(c = 0; c < ntpSourceCount; c++)
+    {
+        if(ntpSources[c].waiting == true)
+        {
+            waiting++;
+        }
+        else if((ntpSources[c].reach & 0x01) != 0)
+        {
+            replies++;
+        }
+    }
+    if(ntpBcast.waiting == true)
+    {
+        waiting++;
+    }
+
+    if(waiting > 0 && (millis() - ntpSentMs) < NTP_TIMEOUT)
+    {
+        return NTP_WAITING;
+    }
+
+    // Round's finished, anything that hasn't replied has timed out
+    for(c = 0; c < ntpSourceCount; c++)
+    {
+        if(ntpSources[c].waiting == true)
+        {
+            ntpSources[c].waiting = false;
+            ntpSources[c].timeouts++;
+        }
+    }
+    ntpState = NTP_IDLE;
+
+    // Only the calibration exchange, nothing for the clock
+    if(ntpBcastRound == true)
+    {
+        ntpBcastRound = false;
+        if(ntpBcast.waiting == true)
+        {
+            Serial.printf("[NTP ] No reply from broadcast server %s\r\n", ntpBcast.addr.toString().c_str());
+            ntpBcast.waiting = false;
+            ntpBcast.timeouts++;
+            ntpBcastState = NTP_BCAST_LISTENING;
+        }
+        return NTP_IDLE;
+    }
+
+    if(replies == 0)
+    {
+        ntpSelect(sample);
+        return NTP_TIMEDOUT;
+    }
+
+    if(ntpSelect(sample) == 0)
+    {
+        Serial.println("[NTP ] No majority of sources agree");
+        return NTP_FAILED;
+    }
+
+    return NTP_REPLY;
+}
+
+// The timebase has slewed the clock by offsetUs, so samples already in the filters are out by that much
+// Only what's actually been slewed in - a new sample replaces any correction still to come
+void ntpClockAdjusted(long int offsetUs)
+{
+    int c;
+    int d;
+
+    if(offsetUs == 0)
+    {
+        return;
+    }
+
+    for(c = 0; c < ntpSourceCount; c++)
+    {
+        for(d = 0; d < ntpSources[c].filterCount; d++)
+        {
+            ntpSources[c].filter[d].offsetUs = ntpSources[c].filter[d].offsetUs - offsetUs;
+        }
+        ntpSources[c].offsetUs = ntpSources[c].offsetUs - offsetUs;
+    }
+
+    for(d = 0; d < ntpBcast.filterCount; d++)
+    {
+        ntpBcast.filter[d].offsetUs = ntpBcast.filter[d].offsetUs - offsetUs;
+    }
+    ntpBcast.offsetUs = ntpBcast.offsetUs - offsetUs;
+}
+
+int ntpGetSourceCount()
+{
+    return ntpSourceCount;
+}
+
+ntpSource_t *ntpGetSource(int n)
+{
+    return &ntpSources[n];
+}
+
+void ntpViewSource(ntpSourceView_t *view, ntpSource_t *source)
+{
+    view -> name = source -> name;
+    view -> addr = source -> addr;
+    view -> reach = source -> reach;
+    view -> stratum = source -> stratum;
+    view -> offsetUs = source -> offsetUs;
+    view -> delayUs = source -> delayUs;
+    view -> jitterUs = source -> jitterUs;
+    view -> tally = source -> tally;
+}
+
+// Copy the sources for other tasks to read, called once a second by loop()
+void ntpPublishSources()
+{
+    int next;
+    int c;
+
+    next = 1 - ntpViewNow;
+    for(c = 0; c < ntpSourceCount; c++)
+    {
+        ntpViewSource(&ntpViews[next][c], &ntpSources[c]);
+    }
+
+    if(ntpBcastState != NTP_BCAST_OFF)
+    {
+        ntpViewSource(&ntpViews[next][c], &ntpBcast);
+        c++;
+    }
+    ntpViewCount[next] = c;
+
+    ntpViewNow = next;
+    ntpViewSeq++;
+}
+
+// Latest copy of the sources, with the broadcast server last if there is one
+// views needs room for NTP_MAX_SOURCES + 1, returns how many there are
+int ntpGetSourceViews(ntpSourceView_t *views)
+{
+    unsigned long int seq;
+    int now;
+    int count;
+
+    do
+    {
+        seq = ntpViewSeq;
+        now = ntpViewNow;
+        count = ntpViewCount[now];
+        memcpy(views, ntpViews[now], count * sizeof(ntpSourceView_t));
+    }
+    while(seq != ntpViewSeq);
+
+    return count;
+}
+
+// NULL if there isn't one
+ntpSource_t *ntpGetSysPeer()
+{
+    if(ntpBcastState == NTP_BCAST_LOCKED)
+    {
+        return &ntpBcast;
+    }
+
+    if(ntpSysPeer < 0)
+    {
+        return NULL;
+    }
+
+    return &ntpSources[ntpSysPeer];
+}
+
+// The system peer has had enough samples since the clock was last stepped and they agree with the clock
+boolean ntpConverged(ntpSample_t *sample)
+{
+    ntpSource_t *peer;
+
+    peer = ntpGetSysPeer();
+    if(peer == NULL || peer -> filterCount < NTP_BURST_MIN)
+    {
+        return false;
+    }
+
+    return abs(sample -> offsetUs) <= max(sample -> jitterUs, (long int)NTP_PRECISION_US) * NTP_POLL_GATE;
+}
+
+// Poll interval in seconds
+int ntpPollInterval()
+{
+    long int interval;
+
+    interval = (long int)clockConfig.initUpdate << ntpPollLevel;
+    if(interval > clockConfig.syncUpdate)
+    {
+        interval = clockConfig.syncUpdate;
+    }
+
+    return interval;
+}
+
+void ntpPollSet(int level, char *why)
+{
+    int oldInterval;
+
+    oldInterval = ntpPollInterval();
+    ntpPollCounter = 0;
+
+    // No further once the shortest or longest interval has been reached
+    if(level < 0 || (level > ntpPollLevel && oldInterval >= clockConfig.syncUpdate))
+    {
+        return;
+    }
+
+    ntpPollLevel = level;
+
+    if(ntpPollInterval() != oldInterval)
+    {
+        Serial.printf("[NTP ] Poll interval %d -> %d seconds - %s\r\n", oldInterval, ntpPollInterval(), why);
+        ntpPollWhy = why;
+        ntpPollChangedMs = millis();
+    }
+}
+
+// Back to the shortest interval
+void ntpPollReset(char *why)
+{
+    ntpPollSet(0, why);
+    ntpPollWhy = why;
+    ntpPollChangedMs = millis();
+}
+
+// Lengthen or shorten the poll interval after a good reply
+// freqChangePpb is how much the reply changed the frequency correction
+// Nothing changes until the clock has had syncValid replies
+void ntpPollSample(ntpSample_t *sample, boolean stepped, long int freqChangePpb, boolean settled)
+{
+    long int gate;
+
+    if(stepped == true)
+    {
+        ntpPollReset("time stepped");
+        return;
+    }
+
+    if(settled == false)
+    {
+        return;
+    }
+
+    if(abs(freqChangePpb) > NTP_POLL_FREQ_PPB)
+    {
+        ntpPollSet(ntpPollLevel - 1, "frequency changed");
+        return;
+    }
+
+    gate = max(sample -> jitterUs, (long int)NTP_PRECISION_US) * NTP_POLL_GATE;
+    if(abs(sample -> offsetUs) > gate)
+    {
+        ntpPollSet(ntpPollLevel - 1, "offset more than jitter");
+        return;
+    }
+
+    ntpPollCounter++;
+    if(ntpPollCounter >= NTP_POLL_LIMIT)
+    {
+        ntpPollSet(ntpPollLevel + 1, "offset and jitter small");
+    }
+}
+
+// Exponential backoff while nothing replies - back to initUpdate, then doubled for every timeout in a row
+void ntpPollBackoff(int timeouts)
+{
+    ntpPollSet(min(timeouts - 1, NTP_BACKOFF_LEVELS), "no reply");
+    ntpPollWhy = "no reply";
+    ntpPollChangedMs = millis();
+}
+
+// xorshift32 - good enough to spread polls out
+unsigned long int ntpRandom()
+{
+    ntpRandState = ntpRandState ^ (ntpRandState << 13);
+    ntpRandState = ntpRandState ^ (ntpRandState >> 17);
+    ntpRandState = ntpRandState ^ (ntpRandState << 5);
+
+    return ntpRandState;
+}
+
+// FNV-1a hash of the MAC address, never 0 or xorshift would stay there
+void ntpSeedRandom()
+{
+    unsigned char mac[6];
+    int c;
+
+    WiFi.macAddress(mac);
+
+    ntpRandState = 2166136261UL;
+    for(c = 0; c < 6; c++)
+    {
+        ntpRandState = (ntpRandState ^ mac[c]) * 16777619UL;
+    }
+
+    if(ntpRandState == 0)
+    {
+        ntpRandState = 1;
+    }
+}
+
+// Seconds to the first poll after the NTP client starts, 0 to NTP_START_SPREAD - 1
+int ntpPollPhase()
+{
+    return ntpRandom() % NTP_START_SPREAD;
+}
+
+// interval moved by up to interval / NTP_POLL_JITTER either way
+int ntpPollJitter(int interval)
+{
+    int spread;
+
+    spread = interval / NTP_POLL_JITTER;
+    if(spread == 0)
+    {
+        return interval;
+    }
+
+    return interval - spread + (int)(ntpRandom() % (2 * spread + 1));
+}
+
+char *ntpPollReason()
+{
+    return ntpPollWhy;
+}
+
+// Seconds since the poll interval last changed
+unsigned long int ntpPollAge()
+{
+    return (millis() - ntpPollChangedMs) / 1000;
+}
+
+// Address to listen on from the broadcast setting, false if it isn't "broadcast" or a multicast group
+boolean ntpBroadcastAddress(char *setting, IPAddress *group)
+{
+    if(strcmp(setting, "broadcast") == 0)
+    {
+        *group = IPAddress(255, 255, 255, 255);
+        return true;
+    }
+
+    return group -> fromString(setting) == true && (*group)[0] >= 224 && (*group)[0] <= 239;
+}
+
+// Start listening for broadcasts if they're configured
+void ntpBroadcastBegin()
+{
+    ntpBcastState = NTP_BCAST_OFF;
+    ntpBcastRound = false;
+    ntpBcastFull = false;
+
+    ntpBcast.name = "broadcast";
+    ntpBcast.addr = IPAddress(0, 0, 0, 0);
+    ntpBcast.reach = 0;
+    ntpBcast.polls = 0;
+    ntpBcast.replies = 0;
+    ntpBcast.timeouts = 0;
+    ntpBcast.waiting = false;
+    ntpBcast.filterCount = 0;
+    ntpBcast.filterNext = 0;
+    ntpBcast.stratum = 0;
+    ntpBcast.tally = ' ';
+
+    if(clockConfig.ntpBroadcast[0] == '\0' || ntpBroadcastAddress(clockConfig.ntpBroadcast, &ntpBcastGroup) == false)
+    {
+        return;
+    }
+
+#ifdef __WITH_NTP_SERVER
+    ntpServerJoin(ntpBcastGroup);
+#else
+    if(ntpBcastGroup == IPAddress(255, 255, 255, 255))
+    {
+        ntpBcastUDP.begin(NTP_PORT);
+    }
+    else
+    {
+        ntpBcastUDP.beginMulticast(ntpBcastGroup, NTP_PORT);
+    }
+#endif
+
+    ntpBcastState = NTP_BCAST_LISTENING;
+    Serial.printf("[NTP ] Listening for broadcasts to %s\r\n", ntpBcastGroup.toString().c_str());
+}
+
+void ntpBroadcastEnd()
+{
+    if(ntpBcastState == NTP_BCAST_OFF)
+    {
+        return;
+    }
+
+#ifdef __WITH_NTP_SERVER
+    ntpServerLeave(ntpBcastGroup);
+#else
+    ntpBcastUDP.stop();
+#endif
+
+    ntpBcastState = NTP_BCAST_OFF;
+    ntpBcast.waiting = false;
+}
+
+// A broadcast has arrived, rxUs is UTC when it did
+// Called from the network task by the NTP server, so it's just kept for ntpBroadcastCheck()
+void ntpBroadcastReceived(unsigned char *packet, uint32_t from, int64_t rxUs)
+{
+    if(ntpBcastState == NTP_BCAST_OFF || ntpBcastFull == true)
+    {
+        return;
+    }
+
+    memcpy(ntpBcastPacket, packet, NTP_PACKET_SIZE);
+    ntpBcastFrom = from;
+    ntpBcastRxUs = rxUs;
+    __sync_synchronize();
+    ntpBcastFull = true;
+}
+
+// Reply to the calibration exchange, only the delay is wanted from it
+void ntpBroadcastCalibrate(unsigned char *packet, int64_t t4)
+{
+    ntpReply(&ntpBcast, packet, t4);
+    if((ntpBcast.reach & 0x01) == 0)
+    {
+        ntpBcastState = NTP_BCAST_LISTENING;
+        return;
+    }
+
+    Serial.printf("[NTP ] Broadcasts from %s calibrated - delay %ld us, offset %ld us\r\n", ntpBcast.addr.toString().c_str(),
+                  ntpBcast.delayUs, (long int)ntpBcast.offsetUs);
+
+    // Broadcast samples all have this delay, the filter starts again with them
+    ntpBcast.filterCount = 0;
+    ntpBcast.filterNext = 0;
+    ntpBcast.tally = '*';
+    ntpBcastHeardMs = millis();
+    ntpBcastState = NTP_BCAST_LOCKED;
+}
+
+// Look for a broadcast, called from ntpPoll()
+// Returns true with sample filled in when there's one to use
+boolean ntpBroadcastCheck(ntpSample_t *sample)
+{
+    unsigned char packet[NTP_PACKET_SIZE];
+    IPAddress from;
+    int64_t rxUs;
+    int c;
+    float diff;
+    float sum;
+
+    if(ntpBcastState == NTP_BCAST_OFF)
+    {
+        return false;
+    }
+
+#ifndef __WITH_NTP_SERVER
+    if(ntpBcastFull == false && ntpBcastUDP.parsePacket() >= NTP_PACKET_SIZE)
+    {
+        rxUs = tbNowUs();
+        ntpBcastUDP.read(packet, NTP_PACKET_SIZE);
+        if((packet[0] & 0x07) == NTP_MODE_BROADCAST)
+        {
+            ntpBroadcastReceived(packet, ntpBcastUDP.remoteIP(), rxUs);
+        }
+    }
+#endif
+
+    if(ntpBcastState == NTP_BCAST_LOCKED && millis() - ntpBcastHeardMs > NTP_BCAST_TIMEOUT * 1000UL)
+    {
+        Serial.printf("[NTP ] No broadcasts from %s for %d seconds, polling again\r\n", ntpBcast.addr.toString().c_str(),
+                      NTP_BCAST_TIMEOUT);
+        ntpBcast.tally = ' ';
+        ntpBcast.reach = ntpBcast.reach << 1;
+        ntpBcastState = NTP_BCAST_LISTENING;
+    }
+
+    if(ntpBcastFull == false)
+    {
+        return false;
+    }
+
+    memcpy(packet, ntpBcastPacket, NTP_PACKET_SIZE);
+    from = IPAddress(ntpBcastFrom);
+    rxUs = ntpBcastRxUs;
+    __sync_synchronize();
+    ntpBcastFull = false;
+
+    // Same as a reply - kiss-o'-death or unsynchronised servers are no good
+    if(packet[1] == 0 || packet[1] > 15 || (packet[0] & 0xc0) == 0xc0)
+    {
+        return false;
+    }
+
+    if(ntpBcastState == NTP_BCAST_LISTENING)
+    {
+        // One client exchange for the delay, as long as nothing else is going on
+        if(ntpState == NTP_IDLE)
+        {
+            Serial.printf("[NTP ] Broadcast from %s, calibrating\r\n", from.toString().c_str());
+            ntpBcast.addr = from;
+            ntpBcastRound = true;
+            ntpBcastState = NTP_BCAST_CALIBRATING;
+            ntpSendRequest(&ntpBcast);
+            ntpSentMs = millis();
+            ntpState = NTP_WAITING;
+        }
+        return false;
+    }
+
+    if(ntpBcastState != NTP_BCAST_LOCKED || from != ntpBcast.addr)
+    {
+        return false;
+    }
+
+    sample -> offsetUs = (ntpToUs(&packet[40]) - rxUs) + (ntpBcast.delayUs / 2);
+    sample -> delayUs = ntpBcast.delayUs;
+    sample -> stratum = packet[1];
+    sample -> rootDelayUs = ntpShortToUs(&packet[4]);
+    sample -> rootDispUs = ntpShortToUs(&packet[8]);
+    sample -> ms = millis();
+
+    // Every sample has the same delay so the latest is the best, jitter is how far the others are from it
+    ntpBcast.filter[ntpBcast.filterNext] = *sample;
+    ntpBcast.filterNext = (ntpBcast.filterNext + 1) % NTP_FILTER_SIZE;
+    if(ntpBcast.filterCount < NTP_FILTER_SIZE)
+    {
+        ntpBcast.filterCount++;
+    }
+
+    sum = 0;
+    for(c = 0; c < ntpBcast.filterCount; c++)
+    {
+        diff = ntpBcast.filter[c].offsetUs - sample -> offsetUs;
+        sum = sum + (diff * diff);
+    }
+
+    ntpBcast.offsetUs = sample -> offsetUs;
+    ntpBcast.stratum = sample -> stratum;
+    ntpBcast.rootDelayUs = sample -> rootDelayUs;
+    ntpBcast.jitterUs = sqrtf(sum / ntpBcast.filterCount);
+    ntpBcast.distanceUs = (ntpBcast.delayUs + sample -> rootDelayUs) / 2 + sample -> rootDispUs + NTP_PRECISION_US + ntpBcast.jitterUs;
+    ntpBcast.reach = (ntpBcast.reach << 1) | 0x01;
+    ntpBcast.replies++;
+    ntpBcastHeardMs = millis();
+
+    // As the system peer, the same as ntpSelect() would give
+    sample -> rootDelayUs = ntpBcast.rootDelayUs + ntpBcast.delayUs;
+    sample -> rootDispUs = ntpBcast.distanceUs;
+    sample -> jitterUs = ntpBcast.jitterUs;
+
+    return true;
+}
+
+// Time is coming from broadcasts, no need to poll
+boolean ntpBroadcastLocked()
+{
+    return ntpBcastState == NTP_BCAST_LOCKED;
+}
+
+ntpBcastType ntpBroadcastState()
+{
+    return ntpBcastState;
+}
+
+// The broadcast server, address 0.0.0.0 until one's been heard
+ntpSource_t *ntpBroadcastSource()
+{
+    return &ntpBcast;
+}
@@ -0,0 +1,57 @@
+void ntpBegin();
+boolean ntpSendPacket(IPAddress to, unsigned char *packet, int64_t *t1);
+boolean ntpReceivePacket(unsigned char *packet, IPAddress *from, int64_t *t4, int64_t *waitUs);
+void ntpHistAdd(unsigned long int *hist, int64_t us);
+void ntpClearHist();
+void ntpHistExport(Print &out);
+void ntpSetLateStamps(boolean late);
+boolean ntpGetLateStamps();
+unsigned long int ntpGetRxDropped();
+void ntpEnd();
+int64_t ntpToUs(unsigned char *ts);
+void usToNtp(int64_t us, unsigned char *ts);
+long int ntpShortToUs(unsigned char *ts);
+void usToNtpShort(long int us, unsigned char *ts);
+char *ntpServerName(int n);
+void ntpClearSources();
+void ntpClearFilters();
+void ntpResolveSources();
+void ntpSendRequest(ntpSource_t *source);
+boolean ntpRequest();
+unsigned long int ntpGetRequestUs();
+unsigned long int ntpGetRequestAvgUs();
+unsigned long int ntpGetRequestWorstUs();
+boolean ntpBusy();
+void ntpFilter(ntpSource_t *source, ntpSample_t *sample);
+void ntpReply(ntpSource_t *source, unsigned char *packet, int64_t t4);
+void ntpKissOfDeath(ntpSource_t *source, unsigned char *packet);
+int ntpSelect(ntpSample_t *sample);
+ntpResultType ntpPoll(ntpSample_t *sample);
+void ntpClockAdjusted(long int offsetUs);
+int ntpGetSourceCount();
+ntpSource_t *ntpGetSource(int n);
+void ntpViewSource(ntpSourceView_t *view, ntpSource_t *source);
+void ntpPublishSources();
+int ntpGetSourceViews(ntpSourceView_t *views);
+ntpSource_t *ntpGetSysPeer();
+boolean ntpConverged(ntpSample_t *sample);
+int ntpPollInterval();
+void ntpPollSet(int level, char *why);
+void ntpPollReset(char *why);
+void ntpPollSample(ntpSample_t *sample, boolean stepped, long int freqChangePpb, boolean settled);
+void ntpPollBackoff(int timeouts);
+unsigned long int ntpRandom();
+void ntpSeedRandom();
+int ntpPollPhase();
+int ntpPollJitter(int interval);
+char *ntpPollReason();
+unsigned long int ntpPollAge();
+boolean ntpBroadcastAddress(char *setting, IPAddress *group);
+void ntpBroadcastBegin();
+void ntpBroadcastEnd();
+void ntpBroadcastReceived(unsigned char *packet, uint32_t from, int64_t rxUs);
+void ntpBroadcastCalibrate(unsigned char *packet, int64_t t4);
+boolean ntpBroadcastCheck(ntpSample_t *sample);
+boolean ntpBroadcastLocked();
+ntpBcastType ntpBroadcastState();
+ntpSource_t *ntpBroadcastSource();
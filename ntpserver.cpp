@@ -0,0 +1,315 @@
+#include "config.h"
+
+#ifdef __WITH_NTP_SERVER
+
+#ifdef __MK1_HW
+#error "__WITH_NTP_SERVER needs the ESP32 lwIP stack"
+#endif
+
+#include <WiFi.h>
+#include "lwip/udp.h"
+#include "lwip/pbuf.h"
+#include "lwip/igmp.h"
+#include "lwip/priv/tcpip_priv.h"
+#ifdef __WITH_TELNET_CLI
+#include <ESPTelnet.h>
+#endif
+
+#include "types.h"
+#include "globals.h"
+#include "timebase.h"
+#include "ntp.h"
+#include "ntpserver.h"
+
+// NTP server (MK2 only)...
+//   Requests are answered straight from the lwIP receive callback in the network task, so the receive
+//   timestamp (T2) is taken as soon as the stack hands the packet over and the transmit timestamp (T3)
+//   just before the reply goes back.  How busy loop() is makes no difference.  Nothing is queued and
+//   the only allocation is the reply's pbuf, so a burst of requests just takes the network task's time
+//   and the display is still driven by its own interrupt.
+//   The rest of the reply (stratum, reference ID, root delay and dispersion) changes slowly.  loop()
+//   makes it up once a second in whichever of two copies the network task isn't using, then swaps them.
+//   Stratum is the system peer's plus one while the clock is synchronised.  Otherwise replies have
+//   stratum 16 and the leap indicator alarm set so clients don't use them.
+//   Counters are only written by the network task, loop() works out rates from the differences.
+//   Broadcasts for the NTP client's broadcast mode arrive here too, they're passed on with their
+//   arrival time.
+
+struct udp_pcb *ntpSrvPcb = NULL;
+unsigned char ntpSrvHeader[2][24];               // First 24 bytes of a reply
+volatile int ntpSrvHeaderNow;                    // The one the network task uses
+
+volatile unsigned long int ntpSrvServed;         // Replies sent
+volatile unsigned long int ntpSrvIgnored;        // Not a client request, or no memory for the reply
+volatile unsigned long int ntpSrvLatencyUs;      // Total receive to sent time, wraps
+volatile unsigned long int ntpSrvWorstUs;        // Longest receive to sent time
+
+unsigned long int ntpSrvTickMs;
+unsigned long int ntpSrvLastServed;              // ntpSrvServed at the last tick
+unsigned long int ntpSrvLastLatencyUs;           // ntpSrvLatencyUs at the last tick
+unsigned long int ntpSrvRate;                    // Requests served in the last second
+unsigned long int ntpSrvPeakRate;
+unsigned long int ntpSrvAvgUs;                   // Average latency over the last second with requests
+
+// Called by lwIP in the network task for every packet to NTP_PORT
+void ntpSrvRecv(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
+{
+    int64_t rxLocal;
+    unsigned char request[NTP_PACKET_SIZE];
+    unsigned char *packet;
+    struct pbuf *reply;
+    unsigned long int us;
+
+    rxLocal = tbLocalUs();
+
+    if(p -> tot_len < NTP_PACKET_SIZE || pbuf_copy_partial(p, request, NTP_PACKET_SIZE, 0) != NTP_PACKET_SIZE)
+    {
+        pbuf_free(p);
+        ntpSrvIgnored++;
+        return;
+    }
+    pbuf_free(p);
+
+    if((request[0] & 0x07) == NTP_MODE_BROADCAST && IP_IS_V4(addr))
+    {
+        ntpBroadcastReceived(request, ip4_addr_get_u32(ip_2_ip4(addr)), tbUtcAt(rxLocal));
+        return;
+    }
+
+    if((request[0] & 0x07) != NTP_MODE_CLIENT)
+    {
+        ntpSrvIgnored++;
+        return;
+    }
+
+    reply = pbuf_alloc(PBUF_TRANSPORT, NTP_PACKET_SIZE, PBUF_RAM);
+    if(reply == NULL)
+    {
+        ntpSrvIgnored++;
+        return;
+    }
+    packet = (unsigned char *)reply -> payload;
+
+    memcpy(packet, ntpSrvHeader[ntpSrvHeaderNow], 24);
+    packet[0] = (packet[0] & 0xc7) | (request[0] & 0x38);      // Same version as the request
+    packet[2] = request[2];                                    // and poll interval
+    memcpy(&packet[24], &request[40], 8);                      // Their transmit time is the origin
+    usToNtp(tbUtcAt(rxLocal), &packet[32]);
+    usToNtp(tbNowUs(), &packet[40]);
+
+    udp_sendto(pcb, reply, addr, port);
+    pbuf_free(reply);
+
+    us = tbLocalUs() - rxLocal;
+    ntpSrvLatencyUs = ntpSrvLatencyUs + us;
+    if(us > ntpSrvWorstUs)
+    {
+        ntpSrvWorstUs = us;
+    }
+    ntpSrvServed++;
+}
+
+// Runs in the network task, lwIP calls can't be made from anywhere else
+err_t ntpSrvOpen(struct tcpip_api_call_data *call)
+{
+    ntpSrvPcb = udp_new();
+    if(ntpSrvPcb == NULL)
+    {
+        return ERR_MEM;
+    }
+
+    if(udp_bind(ntpSrvPcb, IP_ANY_TYPE, NTP_PORT) != ERR_OK)
+    {
+        udp_remove(ntpSrvPcb);
+        ntpSrvPcb = NULL;
+        return ERR_USE;
+    }
+
+    // Broadcasts for the NTP client
+    ip_set_option(ntpSrvPcb, SOF_BROADCAST);
+    udp_recv(ntpSrvPcb, ntpSrvRecv, NULL);
+
+    return ERR_OK;
+}
+
+typedef struct
+{
+    struct tcpip_api_call_data call;
+    ip4_addr_t group;
+    boolean join;
+} ntpSrvGroupCall_t;
+
+err_t ntpSrvGroup(struct tcpip_api_call_data *call)
+{
+    ntpSrvGroupCall_t *groupCall;
+
+    groupCall = (ntpSrvGroupCall_t *)call;
+    if(groupCall -> join == true)
+    {
+        return igmp_joingroup(IP4_ADDR_ANY4, &groupCall -> group);
+    }
+
+    return igmp_leavegroup(IP4_ADDR_ANY4, &groupCall -> group);
+}
+
+// Multicast group for the NTP client's broadcasts, broadcasts themselves need nothing doing
+void ntpServerGroup(IPAddress group, boolean join)
+{
+    ntpSrvGroupCall_t groupCall;
+
+    if(group[0] < 224 || group[0] > 239)
+    {
+        return;
+    }
+
+    ip4_addr_set_u32(&groupCall.group, (uint32_t)group);
+    groupCall.join = join;
+    if(tcpip_api_call(ntpSrvGroup, &groupCall.call) != ERR_OK)
+    {
+        Serial.printf("[NTP ] Can't %s multicast group %s\r\n", join == true ? "join" : "leave", group.toString().c_str());
+    }
+}
+
+void ntpServerJoin(IPAddress group)
+{
+    ntpServerGroup(group, true);
+}
+
+void ntpServerLeave(IPAddress group)
+{
+    ntpServerGroup(group, false);
+}
+
+// Start answering requests, once WiFi is connected
+void initNtpServer()
+{
+    struct tcpip_api_call_data call;
+
+    if(ntpSrvPcb != NULL)
+    {
+        return;
+    }
+
+    ntpSrvServed = 0;
+    ntpSrvIgnored = 0;
+    ntpSrvLatencyUs = 0;
+    ntpSrvWorstUs = 0;
+    ntpSrvLastServed = 0;
+    ntpSrvLastLatencyUs = 0;
+    ntpSrvRate = 0;
+    ntpSrvPeakRate = 0;
+    ntpSrvAvgUs = 0;
+    ntpSrvTickMs = millis();
+
+    // Not synchronised until the first tick says otherwise
+    memset(ntpSrvHeader, 0, sizeof(ntpSrvHeader));
+    ntpSrvHeader[0][0] = NTP_SERVER_ALARM | NTP_SERVER_VN_MODE;
+    ntpSrvHeader[0][1] = NTP_STRATUM_UNSYNC;
+    ntpSrvHeaderNow = 0;
+
+    if(tcpip_api_call(ntpSrvOpen, &call) == ERR_OK)
+    {
+        Serial.print(" - NTP server started (port ");
+        Serial.print(NTP_PORT);
+        Serial.println(")");
+    }
+    else
+    {
+        Serial.println(" - NTP server failed to start");
+    }
+}
+
+// Called every time round loop(), does something once a second
+void ntpServerTick()
+{
+    unsigned char *header;
+    ntpSource_t *peer;
+    unsigned long int served;
+    unsigned long int latency;
+    int next;
+
+    if(ntpSrvPcb == NULL || millis() - ntpSrvTickMs < 1000)
+    {
+        return;
+    }
+    ntpSrvTickMs = millis();
+
+    // Reply header for the next second
+    next = 1 - ntpSrvHeaderNow;
+    header = ntpSrvHeader[next];
+    memset(header, 0, 24);
+
+    peer = ntpGetSysPeer();
+    if(ntpSyncState == HIGH && peer != NULL && peer -> stratum + 1 < NTP_STRATUM_UNSYNC)
+    {
+        header[0] = NTP_SERVER_VN_MODE;
+        header[1] = peer -> stratum + 1;
+        usToNtpShort(peer -> rootDelayUs + peer -> delayUs, &header[4]);
+        usToNtpShort(tbErrorUs(), &header[8]);
+        header[12] = peer -> addr[0];
+        header[13] = peer -> addr[1];
+        header[14] = peer -> addr[2];
+        header[15] = peer -> addr[3];
+        usToNtp(tbLastNtpUtc(), &header[16]);
+    }
+    else
+    {
+        header[0] = NTP_SERVER_ALARM | NTP_SERVER_VN_MODE;
+        header[1] = NTP_STRATUM_UNSYNC;
+    }
+    header[3] = (unsigned char)NTP_SERVER_PRECISION;
+
+    ntpSrvHeaderNow = next;
+
+    // Requests per second and average latency
+    served = ntpSrvServed;
+    latency = ntpSrvLatencyUs;
+    ntpSrvRate = served - ntpSrvLastServed;
+    if(ntpSrvRate > 0)
+    {
+        ntpSrvAvgUs = (latency - ntpSrvLastLatencyUs) / ntpSrvRate;
+    }
+    if(ntpSrvRate > ntpSrvPeakRate)
+    {
+        ntpSrvPeakRate = ntpSrvRate;
+    }
+    ntpSrvLastServed = served;
+    ntpSrvLastLatencyUs = latency;
+}
+
+boolean ntpServerRunning()
+{
+    return ntpSrvPcb != NULL;
+}
+
+unsigned long int ntpServerRate()
+{
+    return ntpSrvRate;
+}
+
+unsigned long int ntpServerPeakRate()
+{
+    return ntpSrvPeakRate;
+}
+
+unsigned long int ntpServerAvgUs()
+{
+    return ntpSrvAvgUs;
+}
+
+unsigned long int ntpServerWorstUs()
+{
+    return ntpSrvWorstUs;
+}
+
+unsigned long int ntpServerServed()
+{
+    return ntpSrvServed;
+}
+
+unsigned long int ntpServerIgnored()
+{
+    return ntpSrvIgnored;
+}
+
+#endif
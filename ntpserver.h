@@ -0,0 +1,11 @@
+void initNtpServer();
+void ntpServerTick();
+void ntpServerJoin(IPAddress group);
+void ntpServerLeave(IPAddress group);
+boolean ntpServerRunning();
+unsigned long int ntpServerRate();
+unsigned long int ntpServerPeakRate();
+unsigned long int ntpServerAvgUs();
+unsigned long int ntpServerWorstUs();
+unsigned long int ntpServerServed();
+unsigned long int ntpServerIgnored();
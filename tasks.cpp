@@ -0,0 +1,334 @@
+#include "config.h"
+
+#ifdef __MK1_HW
+#ifdef __WITH_NET_TASK
+#error "__WITH_NET_TASK needs the ESP32's second core"
+#endif
+#include <WiFi101.h>
+#else
+#include <WiFi.h>
+#include <FFat.h>
+#ifdef __WITH_TELNET_CLI
+#include <ESPTelnet.h>
+#endif
+#endif
+
+#include "types.h"
+#include "globals.h"
+#include "display.h"
+#include "timebase.h"
+#include "morse.h"
+#ifdef __MK2_HW
+#include "tslog.h"
+#endif
+#include "tasks.h"
+
+// Tasks...
+//   loop() runs on core 1 and does everything to do with the time - the state machine, NTP client,
+//   rendering, chimes and the time-series log.  The display and second edge interrupts are set up from
+//   setup(), so they're on core 1 as well.
+//   With __WITH_NET_TASK the HTTP, FTP, OTA and telnet status servers run in their own task on core 0,
+//   along with WiFi and lwIP, so a slow web client or an OTA update only holds up the other servers.
+//   The CLI stays in loop() because its commands change everything.
+//   The network task only reads the clock's state.  Things that change together, like the NTP sources,
+//   come from copies loop() makes once a second.  Anything that changes the clock (brightness from the
+//   web page, FFat going for an OTA update, text to send in morse) is a request put in a ring with one
+//   writer at each end, the same as the NTP reply queue.  The request carries any new settings, only
+//   loop() writes to clockConfig.  loop() does them each time round and the network task waits for it.
+//   loop() tells the network task when the servers have been started, and waits for it to let go of
+//   them before they're stopped again.
+//   Each task adds up how long it's busy every time round, then sleeps for a tick.  Once a second that's
+//   turned into how much of its core it's using.  Without the network task loop()
+//   never sleeps, so it always looks busy.
+
+taskStats_t taskStats[TASK_COUNT] =
+{
+    { "clock" },
+    { "network" }
+};
+
+volatile boolean taskNetRun;             // Set by loop() once the servers are up
+
+#ifdef __WITH_NET_TASK
+volatile boolean taskNetBusy;            // The network task is using them
+taskRequest_t taskQueue[TASK_QUEUE];
+volatile int taskQueueHead;              // Written by the network task
+volatile int taskQueueTail;              // Written by loop()
+volatile unsigned long int taskQueued;   // Requests put in the queue
+volatile unsigned long int taskDone;     // and done by loop()
+
+// HTTP, FTP, OTA and telnet status, pinned to NET_TASK_CORE
+void netTask(void *param)
+{
+    unsigned long int startUs;
+
+    for(;;)
+    {
+        startUs = micros();
+
+        // Busy before looking, so taskNetStop() can't miss it
+        taskNetBusy = true;
+        if(taskNetRun == true)
+        {
+            networkServices();
+        }
+        taskNetBusy = false;
+
+        taskPassDone(TASK_NET, startUs);
+        vTaskDelay(1);
+    }
+}
+#endif
+
+// Called from setup(), which runs in the same task as loop()
+void initTasks()
+{
+    int c;
+
+    for(c = 0; c < TASK_COUNT; c++)
+    {
+        taskStats[c].secondMs = millis();
+    }
+
+#ifdef __MK2_HW
+    taskStats[TASK_CLOCK].handle = xTaskGetCurrentTaskHandle();
+    taskStats[TASK_CLOCK].core = xPortGetCoreID();
+#endif
+
+    taskNetRun = false;
+
+#ifdef __WITH_NET_TASK
+    taskNetBusy = false;
+    taskQueueHead = 0;
+    taskQueueTail = 0;
+
+    taskStats[TASK_NET].core = NET_TASK_CORE;
+    if(xTaskCreatePinnedToCore(netTask, "network", NET_TASK_STACK, NULL, NET_TASK_PRIORITY,
+                               (TaskHandle_t *)&taskStats[TASK_NET].handle, NET_TASK_CORE) != pdPASS)
+    {
+        Serial.println(" - can't start the network task");
+        taskStats[TASK_NET].handle = NULL;
+    }
+#endif
+}
+
+// One time round a task's loop, that started at startUs, has finished
+void taskPassDone(int task, unsigned long int startUs)
+{
+    taskStats_t *stats;
+    unsigned long int us;
+    unsigned long int ms;
+
+    stats = &taskStats[task];
+
+    us = micros() - startUs;
+    stats -> busyUs = stats -> busyUs + us;
+    stats -> passes++;
+    if(us > stats -> worstUs)
+    {
+        stats -> worstUs = us;
+    }
+
+    ms = millis() - stats -> secondMs;
+    if(ms >= 1000)
+    {
+        stats -> cpuPermille = stats -> busyUs / ms;
+        stats -> passesPerSecond = (stats -> passes * 1000) / ms;
+        stats -> worstPassUs = stats -> worstUs;
+        stats -> busyUs = 0;
+        stats -> passes = 0;
+        stats -> worstUs = 0;
+        stats -> secondMs = millis();
+    }
+}
+
+taskStats_t *taskGetStats(int task)
+{
+    return &taskStats[task];
+}
+
+// Least free stack the task has had, in bytes, -1 if it isn't running
+long int taskStackFree(int task)
+{
+#ifdef __MK2_HW
+    if(taskStats[task].handle != NULL)
+    {
+        return uxTaskGetStackHighWaterMark((TaskHandle_t)taskStats[task].handle);
+    }
+#endif
+
+    return -1;
+}
+
+// The servers have been started, let the network task use them
+void taskNetStart()
+{
+    taskNetRun = true;
+}
+
+// Wait for the network task to finish with the servers so they can be stopped
+// Anything it asks for while it finishes is done, it might be waiting for that
+void taskNetStop()
+{
+    taskNetRun = false;
+
+#ifdef __WITH_NET_TASK
+    while(taskNetBusy == true)
+    {
+        taskRequests();
+        vTaskDelay(1);
+    }
+#endif
+}
+
+// The servers have been started and not stopped since
+boolean taskNetRunning()
+{
+    return taskNetRun;
+}
+
+// Have loop() do something, from the network task
+// Waits up to TASK_CALL_MS for it to be done, false if it hasn't been (it will be later)
+// Without the network task the servers are run from loop() anyway, so it's done straight away
+boolean taskCall(taskRequestType request)
+{
+    return taskCallText(request, NULL);
+}
+
+// The same, with some text for it - cut down to MORSE_TEXT_LEN
+boolean taskCallText(taskRequestType request, const char *text)
+{
+    taskRequest_t req;
+
+    taskInitRequest(&req, request);
+    if(text != NULL)
+    {
+        strncpy(req.text, text, MORSE_TEXT_LEN);
+        req.text[MORSE_TEXT_LEN] = '\0';
+    }
+
+    return taskCallRequest(&req);
+}
+
+// An empty request, with nothing to change
+void taskInitRequest(taskRequest_t *req, taskRequestType request)
+{
+    req -> type = request;
+    req -> text[0] = '\0';
+    req -> brightness = -1;
+    req -> nightBrightness = -1;
+    req -> nightStart = -1;
+    req -> nightEnd = -1;
+}
+
+// The same, with a request that's been filled in
+boolean taskCallRequest(taskRequest_t *req)
+{
+#ifdef __WITH_NET_TASK
+    unsigned long int ticket;
+    unsigned long int ms;
+    int next;
+
+    if(taskStats[TASK_NET].handle == NULL || xTaskGetCurrentTaskHandle() != (TaskHandle_t)taskStats[TASK_NET].handle)
+    {
+        taskDoRequest(req);
+        return true;
+    }
+
+    next = (taskQueueHead + 1) % TASK_QUEUE;
+    if(next == taskQueueTail)
+    {
+        Serial.println("[TASK] Request queue full");
+        return false;
+    }
+
+    taskQueue[taskQueueHead] = *req;
+    taskQueueHead = next;
+    taskQueued++;
+    ticket = taskQueued;
+
+    ms = millis();
+    while((long int)(taskDone - ticket) < 0)
+    {
+        if(millis() - ms >= TASK_CALL_MS)
+        {
+            Serial.printf("[TASK] loop() hasn't done request %d after %d ms\r\n", req -> type, TASK_CALL_MS);
+            return false;
+        }
+        vTaskDelay(1);
+    }
+#else
+    taskDoRequest(req);
+#endif
+
+    return true;
+}
+
+// Do anything the network task has asked for, called every time round loop()
+void taskRequests()
+{
+#ifdef __WITH_NET_TASK
+    while(taskQueueTail != taskQueueHead)
+    {
+        taskDoRequest(&taskQueue[taskQueueTail]);
+        taskQueueTail = (taskQueueTail + 1) % TASK_QUEUE;
+        taskDone++;
+    }
+#endif
+}
+
+void taskDoRequest(taskRequest_t *request)
+{
+    switch(request -> type)
+    {
+        case TASK_REQ_BRIGHTNESS:
+            // Only the settings that were given, the rest are -1
+            if(request -> brightness >= 0)
+            {
+                clockConfig.brightness = min(request -> brightness, DISP_MAX_LEVEL);
+            }
+            if(request -> nightBrightness >= 0)
+            {
+                clockConfig.nightBrightness = min(request -> nightBrightness, DISP_MAX_LEVEL);
+            }
+            if(request -> nightStart >= 0)
+            {
+                clockConfig.nightStart = min(request -> nightStart, 23);
+            }
+            if(request -> nightEnd >= 0)
+            {
+                clockConfig.nightEnd = min(request -> nightEnd, 23);
+            }
+            dispScheduleBrightness(timeNow.tm_hour);
+            saveClockConfig();
+            break;
+
+#ifdef __MK2_HW
+        case TASK_REQ_OTA_START:
+            tslogFlush();
+            FFat.end();
+            break;
+
+        case TASK_REQ_OTA_END:
+            // FFat has gone, but RTC memory keeps the time for after the reboot
+            tbSave(false);
+            break;
+#endif
+
+        case TASK_REQ_MORSE:
+            morseSendText(request -> text);
+            break;
+
+        default:
+            break;
+    }
+}
+
+// End of a time round loop(), sleep for a tick if the network task is doing the servers
+// The second edge and display are interrupt driven so they don't notice
+void taskIdle()
+{
+#ifdef __WITH_NET_TASK
+    vTaskDelay(1);
+#endif
+}
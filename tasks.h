@@ -0,0 +1,14 @@
+void initTasks();
+void taskPassDone(int task, unsigned long int startUs);
+taskStats_t *taskGetStats(int task);
+long int taskStackFree(int task);
+void taskNetStart();
+void taskNetStop();
+boolean taskNetRunning();
+boolean taskCall(taskRequestType request);
+boolean taskCallText(taskRequestType request, const char *text);
+void taskInitRequest(taskRequest_t *req, taskRequestType request);
+boolean taskCallRequest(taskRequest_t *req);
+void taskRequests();
+void taskDoRequest(taskRequest_t *request);
+void taskIdle();
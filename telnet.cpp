@@ -14,12 +14,17 @@
 #include "telnet.h"
 #include "cli.h"
 #include "util.h"
+#include "display.h"
+#include "ntp.h"
+#include "timebase.h"
+#include "ntpserver.h"
 
 #ifdef __WITH_TELNET_CLI
 
 #define TELNET_RX_BUFFER_SIZE 128
 
-boolean gotLine;
+boolean gotLine;                         // A line is waiting in serialBuff for the CLI
+boolean hungUp;                          // The client has gone
 char telnetRxBuffer[TELNET_RX_BUFFER_SIZE];
 
 void telnetLoadSerialBuffer()
@@ -52,8 +57,11 @@ void telnetLoadSerialBuffer()
                 break;
                 
             default:
-                *sBuffPtr = *tBuffPtr;
-                sBuffPtr++;
+                if(sBuffPtr < &serialBuff[SERBUFF_LEN - 1])
+                {
+                    *sBuffPtr = *tBuffPtr;
+                    sBuffPtr++;
+                }
         }
 
         tBuffPtr++;
@@ -70,58 +78,48 @@ void telnetOnConnect(String ip)
     telnet.printf("\r\nConnected to %s\r\n", clockConfig.hostName);
 
     newTelnetConnection = true;
+    hungUp = false;
 }
 
 void telnetOnDisconnect(String ip)
 {
     Serial.println("[TNET] Disconnected");
     gotLine = false;
+    hungUp = true;
 }
 
+// Called from telnet.loop() with each line typed, the CLI splits it up
 void telnetOnInputReceived(String str)
 {
-    int c;
-    char *cPtr;
+    strncpy(telnetRxBuffer, str.c_str(), TELNET_RX_BUFFER_SIZE - 1);
+    telnetRxBuffer[TELNET_RX_BUFFER_SIZE - 1] = '\0';
+    telnetLoadSerialBuffer();
 
     gotLine = true;
+}
 
-    paramCount = 0;
-    for(c = 0; c < MAX_PARAMS; c++)
-    {
-        paramPtr[c] = NULL;
-    }
-  
-    // Copy str into serialBuffer[] and parameters into paramPtr[]
-    strcpy(telnetRxBuffer, str.c_str());
-    telnetLoadSerialBuffer();
-    
-    cPtr = strtok(serialBuff, " ");
-    if(cPtr != NULL)
+// true once for each line that's come in
+boolean telnetLineReady()
+{
+    if(gotLine == true)
     {
-        c = 0;
-        do
-        {
-            cPtr = strtok(NULL, " ");
-            if(cPtr != NULL)
-            {
-                paramPtr[c] = cPtr;
-                paramCount++;
-            }
-            c++;
-        }
-        while(c < MAX_PARAMS && cPtr != NULL);
+        gotLine = false;
+        return true;
     }
+
+    return false;
 }
 
-void telnetReadline()
+// true once when the client disconnects
+boolean telnetHungUp()
 {
-	while(gotLine == false)
-	{
-        telnet.loop();
-	}
-	
-	gotLine = false;
+    if(hungUp == true)
+    {
+        hungUp = false;
+        return true;
+    }
 
+    return false;
 }
 
 void initTelnetServer()
@@ -132,6 +130,7 @@ void initTelnetServer()
 
     newTelnetConnection = false;
     gotLine = false;
+    hungUp = false;
 
     Serial.print(" - Telnet server ");
     if(telnet.begin(TELNET_PORT))
@@ -152,6 +151,7 @@ void telnetShowStatus(WiFiClient client)
 {
     int c;
     char buff[80];
+    dispFrame_t frame;
 
     client.println(HELLO_STR);
 
@@ -172,11 +172,12 @@ void telnetShowStatus(WiFiClient client)
     client.println(buff);
 
     client.println("Display data:");
+    dispGetFrame(&frame);
     for(c = 0; c < 6; c++)
     {
-        sprintf(buff, "  Digit %d - 0x%02x - ", c, ledColData[c]);
+        sprintf(buff, "  Digit %d - 0x%02x - ", c, frame.col[c]);
         client.print(buff);
-        binToStr(ledColData[c], buff, 8);
+        binToStr(frame.col[c], buff, 8);
         client.println(buff);
     }
 
@@ -214,6 +215,39 @@ void telnetShowStatus(WiFiClient client)
     sprintf(buff, "Interrupt count: %ld", interruptCount);
     client.println(buff);
 
+    sprintf(buff, "Main loop: %ld per second", loopsPerSecond);
+    client.println(buff);
+
+    ppbToStr(tbFreqPpb, buff);
+    client.print("Frequency correction: ");
+    client.print(buff);
+    client.println(" ppm");
+
+    sprintf(buff, "Phase error: %ld us, last NTP offset: %ld us", tbPhaseErrorUs, tbOffsetUs);
+    client.println(buff);
+
+    sprintf(buff, "Poll interval: %d seconds (%s)", ntpPollInterval(), ntpPollReason());
+    client.println(buff);
+
+    sprintf(buff, "Time to sync: %ld.%03ld s from boot, %ld.%03ld s from NTP start", syncBootMs / 1000, syncBootMs % 1000,
+            syncTimeMs / 1000, syncTimeMs % 1000);
+    client.println(buff);
+
+    sprintf(buff, "Holdover: %ld seconds, estimated error %ld us", tbHoldoverSeconds(), tbErrorUs());
+    client.println(buff);
+
+    sprintf(buff, "Valid time displayed: %ld.%03ld s from boot (%s start)", validBootMs / 1000, validBootMs % 1000,
+            tbIsWarm() == true ? "warm" : "cold");
+    client.println(buff);
+
+#ifdef __WITH_NTP_SERVER
+    snprintf(buff, sizeof(buff), "Serving time: %lu requests per second (peak %lu)", ntpServerRate(), ntpServerPeakRate());
+    client.println(buff);
+
+    snprintf(buff, sizeof(buff), "Serving latency: %lu us average, %lu us worst", ntpServerAvgUs(), ntpServerWorstUs());
+    client.println(buff);
+#endif
+
     sprintf(buff, "Resync's today: %d", reSyncCount);
     client.println(buff);
 }
@@ -1,3 +1,4 @@
 void telnetShowStatus(WiFiClient client);
 void initTelnetServer();
-void telnetReadline(char *buff);
+boolean telnetLineReady();
+boolean telnetHungUp();
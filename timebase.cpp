@@ -0,0 +1,526 @@
+#include "config.h"
+
+#ifdef __MK1_HW
+#include <WiFi101.h>
+#else
+#include <WiFi.h>
+#include <FS.h>
+#include <FFat.h>
+#include <sys/time.h>
+#include "esp_timer.h"
+#ifdef __WITH_TELNET_CLI
+#include <ESPTelnet.h>
+#endif
+#endif
+
+#include "types.h"
+#include "globals.h"
+#include "display.h"
+#include "timebase.h"
+#include "util.h"
+
+// The timebase...
+//   UTC is worked out from a free running local microsecond clock as
+//     utc = tbRefUtcUs + elapsed + elapsed * tbFreqPpb / 1000000000
+//   where elapsed is the local time since tbRefLocalUs.  The reference is moved on at every second edge.
+//   A hardware timer is armed for the local time the next UTC second should start, its interrupt shows
+//   the frame armed for that second then lets loop() know.  loop() measures how far the edge was from
+//   the true second, slews in a little of any phase correction and arms the timer for the next one.
+//   NTP offsets step the time if they're big, otherwise they become a phase correction and adjust
+//   the frequency (a frequency locked loop) so the clock keeps time between polls.
+//   In holdover, with no NTP, the clock runs on with the last frequency correction.  The error is
+//   estimated from the last NTP delay plus the frequency wander seen between polls over the time since.
+//
+// Warm start (MK2 only)...
+//   Once synchronised, the frequency correction and UTC are kept in RTC memory and the ESP32 system
+//   time is set at every NTP sample.  Both survive a soft reset (the system time runs from the RTC
+//   timer) so after ESP.restart() the clock has the right time straight away.  The frequency correction
+//   and last good UTC are written to FFat every TB_SAVE_S seconds and before a reboot, so even after a
+//   power cycle the clock starts with the frequency it had.
+//
+// Other tasks...
+//   The NTP server reads UTC from the network task, possibly on the other core, while loop() moves the
+//   reference on.  tbRefSeq is odd while the reference is changing and readers try again if it was odd
+//   or changed while they read it.  Nothing waits with interrupts off.
+
+#ifdef __MK2_HW
+hw_timer_t *tbTimer = NULL;
+RTC_NOINIT_ATTR tbSaved_t tbRtcSaved;    // Survives a soft reset
+int64_t tbSavedLocalUs;                  // Local clock when the state was last written to FFat
+#else
+unsigned long int tbMicrosLast;
+unsigned long int tbMicrosHigh;
+#endif
+
+volatile unsigned long int tbRefSeq;     // Odd while the reference is being changed
+int64_t tbRefLocalUs;                    // Local clock at the reference
+int64_t tbRefUtcUs;                      // UTC at the reference, microseconds since 1970
+long int tbPhaseUs;                      // Phase correction still to slew in
+long int tbSlewedUs;                     // Phase slewed in since tbTakeSlewedUs() was last called
+int64_t tbLastSampleUs;                  // Local clock at the last NTP sample used for frequency
+int64_t tbLastNtpUs;                     // Local clock at the last NTP sample
+long int tbWanderPpb;                    // Average size of frequency corrections needed
+int64_t tbHoldoverUs;                    // Local clock when holdover started, 0 if not in holdover
+boolean tbSynced;                        // Time has been set from NTP
+boolean tbWarm;                          // Time carried over from before a soft reset
+
+volatile int64_t tbEdgeLocalUs;          // Local clock at the last second edge interrupt
+volatile unsigned long int tbEdges;      // Second edge interrupts
+unsigned long int tbEdgesSeen;           // Second edges dealt with by loop()
+
+// Local free running microsecond clock
+#ifdef __MK1_HW
+int64_t tbLocalUs()
+{
+    unsigned long int now;
+    int64_t rtn;
+    uint32_t primask;
+
+    // micros() wraps after 71 minutes, count the wraps
+    // Called from the interrupt handler too, so don't turn interrupts back on if they were off
+    primask = __get_PRIMASK();
+    __disable_irq();
+
+    now = micros();
+    if(now < tbMicrosLast)
+    {
+        tbMicrosHigh++;
+    }
+    tbMicrosLast = now;
+    rtn = ((int64_t)tbMicrosHigh << 32) | now;
+
+    __set_PRIMASK(primask);
+
+    return rtn;
+}
+#else
+int64_t IRAM_ATTR tbLocalUs()
+{
+    return esp_timer_get_time();
+}
+#endif
+
+// Only loop() changes the reference, between these two
+void tbRefBegin()
+{
+    tbRefSeq++;
+    __sync_synchronize();
+}
+
+void tbRefEnd()
+{
+    __sync_synchronize();
+    tbRefSeq++;
+}
+
+// UTC at a given local time
+int64_t tbUtcAt(int64_t localUs)
+{
+    unsigned long int seq;
+    int64_t refLocal;
+    int64_t refUtc;
+    long int freqPpb;
+    int64_t elapsed;
+
+    do
+    {
+        seq = tbRefSeq;
+        __sync_synchronize();
+        refLocal = tbRefLocalUs;
+        refUtc = tbRefUtcUs;
+        freqPpb = tbFreqPpb;
+        __sync_synchronize();
+    }
+    while((seq & 1) != 0 || seq != tbRefSeq);
+
+    elapsed = localUs - refLocal;
+    return refUtc + elapsed + (elapsed * freqPpb) / 1000000000;
+}
+
+// Local time at a given UTC
+int64_t tbLocalAt(int64_t utcUs)
+{
+    int64_t elapsed;
+
+    elapsed = utcUs - tbRefUtcUs;
+    return tbRefLocalUs + elapsed - (elapsed * tbFreqPpb) / 1000000000;
+}
+
+// UTC now, microseconds since 1970
+int64_t tbNowUs()
+{
+    return tbUtcAt(tbLocalUs());
+}
+
+// UTC now, seconds since 1970
+time_t tbSeconds()
+{
+    return (time_t)(tbNowUs() / 1000000);
+}
+
+boolean tbIsSynced()
+{
+    return tbSynced;
+}
+
+boolean tbIsWarm()
+{
+    return tbWarm;
+}
+
+// Good enough to show - set by NTP, or carried over from before a soft reset
+boolean tbTimeValid()
+{
+    return tbSynced == true || tbWarm == true;
+}
+
+// Second edge timer interrupt
+#ifdef __MK1_HW
+void TC3_Handler()
+{
+    TC3 -> COUNT16.INTFLAG.reg = TC_INTFLAG_MC0;
+#else
+void IRAM_ATTR tbEdgeInterrupt()
+{
+#endif
+    tbEdgeLocalUs = tbLocalUs();
+    dispFireArmed();
+    tbEdges++;
+}
+
+// Arm the timer for the start of the UTC second after utcUs
+// The timer restarts from zero at every edge so the period is measured from the last one
+void tbArm(int64_t utcUs)
+{
+    int64_t nextUtc;
+    int64_t period;
+    int64_t minPeriod;
+
+    nextUtc = ((utcUs / 1000000) + 1) * 1000000;
+    period = tbLocalAt(nextUtc) - tbEdgeLocalUs;
+
+    // Don't arm for a time that's already gone or the timer would never fire
+    minPeriod = (tbLocalUs() - tbEdgeLocalUs) + TB_MIN_ARM_US;
+    if(period < minPeriod)
+    {
+        period = minPeriod;
+    }
+
+#ifdef __MK1_HW
+    period = TB_US_TO_TICKS(period);
+    if(period > TB_MAX_TICKS)
+    {
+        period = TB_MAX_TICKS;
+    }
+
+    // Match frequency mode, the counter runs from 0 to CC0
+    TC3 -> COUNT16.CC[0].reg = period - 1;
+    while(TC3 -> COUNT16.STATUS.bit.SYNCBUSY);
+#else
+    timerAlarmWrite(tbTimer, period, true);
+#endif
+}
+
+// Something for loop() to do when a second edge has gone by
+// Returns true once for each edge (or group of edges if loop() has been busy)
+boolean tbSecondEdge()
+{
+    int64_t edgeLocal;
+    int64_t edgeUtc;
+    int64_t second;
+    long int slew;
+
+    if(tbEdges == tbEdgesSeen)
+    {
+        return false;
+    }
+    tbEdgesSeen = tbEdges;
+
+    edgeLocal = tbEdgeLocalUs;
+    edgeUtc = tbUtcAt(edgeLocal);
+
+    // How far from the true start of a second the edge was
+    second = (edgeUtc + 500000) / 1000000;
+    tbPhaseErrorUs = edgeUtc - (second * 1000000);
+
+    // Slew in some of the outstanding phase correction
+    slew = tbPhaseUs / TB_PHASE_SLEW;
+    if(slew == 0)
+    {
+        slew = tbPhaseUs;
+    }
+    slew = constrain(slew, -TB_MAX_SLEW_US, TB_MAX_SLEW_US);
+    tbPhaseUs = tbPhaseUs - slew;
+    tbSlewedUs = tbSlewedUs + slew;
+
+    // Move the reference on to this edge
+    tbRefBegin();
+    tbRefUtcUs = edgeUtc + slew;
+    tbRefLocalUs = edgeLocal;
+    tbRefEnd();
+
+    tbArm(tbRefUtcUs);
+
+    return true;
+}
+
+// Step the time by offsetUs and get the next edge on the new second boundary
+void tbStep(int64_t offsetUs)
+{
+    int64_t now;
+    int64_t utc;
+
+    now = tbLocalUs();
+    utc = tbUtcAt(now) + offsetUs;
+    tbRefBegin();
+    tbRefUtcUs = utc;
+    tbRefLocalUs = now;
+    tbRefEnd();
+    tbPhaseUs = 0;
+    tbSlewedUs = 0;
+
+    tbArm(tbRefUtcUs);
+}
+
+// How much phase correction has been slewed in since the last call
+long int tbTakeSlewedUs()
+{
+    long int slewed;
+
+    slewed = tbSlewedUs;
+    tbSlewedUs = 0;
+
+    return slewed;
+}
+
+// Keep the frequency correction and UTC for a warm start, in FFat as well if toFile is set
+void tbSave(boolean toFile)
+{
+#ifdef __MK2_HW
+    tbSaved_t saved;
+    struct timeval tv;
+    File fp;
+
+    if(tbSynced == false)
+    {
+        return;
+    }
+
+    saved.valid = TB_SAVE_VALID;
+    saved.freqPpb = tbFreqPpb;
+    saved.utcUs = tbNowUs();
+
+    tbRtcSaved = saved;
+
+    tv.tv_sec = saved.utcUs / 1000000;
+    tv.tv_usec = saved.utcUs % 1000000;
+    settimeofday(&tv, NULL);
+
+    if(toFile == true)
+    {
+        fp = FFat.open(TB_SAVE_FILENAME, FILE_WRITE);
+        if(!fp)
+        {
+            Serial.println("[TIME] Error opening timebase file for writing");
+            return;
+        }
+
+        fp.write((unsigned char *)&saved, sizeof(saved));
+        fp.close();
+
+        tbSavedLocalUs = tbLocalUs();
+    }
+#endif
+}
+
+// Pick up the frequency correction from FFat, and the time as well after a soft reset
+// Returns true for a warm start
+boolean tbRestore()
+{
+#ifdef __MK2_HW
+    tbSaved_t saved;
+    struct timeval tv;
+    int64_t utcUs;
+    File fp;
+    char freqStr[16];
+
+    fp = FFat.open(TB_SAVE_FILENAME, FILE_READ);
+    if(fp)
+    {
+        if(fp.read((unsigned char *)&saved, sizeof(saved)) == sizeof(saved) && saved.valid == TB_SAVE_VALID)
+        {
+            tbFreqPpb = constrain(saved.freqPpb, -TB_MAX_FREQ_PPB, TB_MAX_FREQ_PPB);
+        }
+        fp.close();
+    }
+
+    // RTC memory is random after power on, and the system time starts from 1970
+    // The system time can't have gone backwards since it was saved
+    if(tbRtcSaved.valid == TB_SAVE_VALID)
+    {
+        gettimeofday(&tv, NULL);
+        utcUs = ((int64_t)tv.tv_sec * 1000000) + tv.tv_usec;
+        if(utcUs >= tbRtcSaved.utcUs)
+        {
+            tbFreqPpb = constrain(tbRtcSaved.freqPpb, -TB_MAX_FREQ_PPB, TB_MAX_FREQ_PPB);
+            tbRefLocalUs = tbLocalUs();
+            tbRefUtcUs = utcUs;
+            tbWarm = true;
+        }
+    }
+
+    ppbToStr(tbFreqPpb, freqStr);
+    Serial.printf(" - frequency correction %s ppm\r\n", freqStr);
+#endif
+
+    return tbWarm;
+}
+
+// New NTP measurement - step, or correct phase and frequency
+// Returns true if the time was stepped
+boolean tbNtpSample(ntpSample_t *sample)
+{
+    int64_t now;
+    long int interval;
+    long int freqError;
+
+    now = tbLocalUs();
+
+    tbDelayUs = sample -> delayUs;
+    tbLastNtpUs = now;
+
+    if(tbSynced == false || abs(sample -> offsetUs) > TB_STEP_US)
+    {
+        // Could be years the first time, so whole seconds and microseconds
+        Serial.printf("[TIME] Step by %ld.%06ld seconds\r\n", (long int)(sample -> offsetUs / 1000000), (long int)abs(sample -> offsetUs % 1000000));
+        tbStep(sample -> offsetUs);
+        tbSynced = true;
+        tbLastSampleUs = now;
+        tbOffsetUs = 0;
+        tbSave(false);
+        return true;
+    }
+
+    tbOffsetUs = sample -> offsetUs;
+
+    // Frequency error is the offset built up since the last sample
+    // Phase corrections slewed in since then are part of the offset too, so only correct some of it
+    interval = (now - tbLastSampleUs) / 1000000;
+    if(interval >= TB_FLL_MIN_S)
+    {
+        freqError = ((tbOffsetUs * 1000) / interval) / TB_FLL_GAIN;
+        tbRefBegin();
+        tbFreqPpb = constrain(tbFreqPpb + freqError, -TB_MAX_FREQ_PPB, TB_MAX_FREQ_PPB);
+        tbRefEnd();
+        tbWanderPpb = ((tbWanderPpb * 3) + abs(freqError * TB_FLL_GAIN)) / 4;
+        tbLastSampleUs = now;
+    }
+
+    // The rest is slewed in a bit at a time at each second edge
+    tbPhaseUs = tbOffsetUs;
+
+#ifdef __MK2_HW
+    tbSave(now - tbSavedLocalUs >= (int64_t)TB_SAVE_S * 1000000);
+#endif
+
+    return false;
+}
+
+void tbHoldover(boolean on)
+{
+    if(on == true)
+    {
+        if(tbHoldoverUs == 0)
+        {
+            tbHoldoverUs = tbLocalUs();
+        }
+    }
+    else
+    {
+        tbHoldoverUs = 0;
+    }
+}
+
+boolean tbInHoldover()
+{
+    return tbHoldoverUs != 0;
+}
+
+// Seconds in holdover, 0 if not
+long int tbHoldoverSeconds()
+{
+    if(tbHoldoverUs == 0)
+    {
+        return 0;
+    }
+
+    return (tbLocalUs() - tbHoldoverUs) / 1000000;
+}
+
+// UTC of the last NTP sample, 0 if there hasn't been one
+int64_t tbLastNtpUtc()
+{
+    if(tbLastNtpUs == 0)
+    {
+        return 0;
+    }
+
+    return tbUtcAt(tbLastNtpUs);
+}
+
+// How far out the time might be since the last NTP sample
+long int tbErrorUs()
+{
+    int64_t seconds;
+
+    seconds = (tbLocalUs() - tbLastNtpUs) / 1000000;
+    return (tbDelayUs / 2) + ((seconds * (tbWanderPpb + TB_HOLDOVER_PPB)) / 1000);
+}
+
+void initTimebase()
+{
+    tbRefLocalUs = tbLocalUs();
+    tbRefUtcUs = 0;
+    tbPhaseUs = 0;
+    tbSlewedUs = 0;
+    tbSynced = false;
+    tbWarm = false;
+    tbHoldoverUs = 0;
+    tbWanderPpb = 0;
+    tbLastNtpUs = 0;
+    tbFreqPpb = 0;
+    tbPhaseErrorUs = 0;
+    tbOffsetUs = 0;
+    tbDelayUs = 0;
+
+    tbRestore();
+
+    tbEdgeLocalUs = tbRefLocalUs;
+    tbEdges = 0;
+    tbEdgesSeen = 0;
+
+#ifdef __MK1_HW
+    // TC3 clocked from the 48MHz GCLK0
+    GCLK -> CLKCTRL.reg = GCLK_CLKCTRL_CLKEN | GCLK_CLKCTRL_GEN_GCLK0 | GCLK_CLKCTRL_ID(GCM_TCC2_TC3);
+    while(GCLK -> STATUS.bit.SYNCBUSY);
+
+    TC3 -> COUNT16.CTRLA.reg = TC_CTRLA_SWRST;
+    while(TC3 -> COUNT16.CTRLA.bit.SWRST);
+
+    TC3 -> COUNT16.CTRLA.reg = TC_CTRLA_MODE_COUNT16 | TC_CTRLA_WAVEGEN_MFRQ | TC_CTRLA_PRESCALER_DIV1024;
+    while(TC3 -> COUNT16.STATUS.bit.SYNCBUSY);
+
+    tbArm(tbRefUtcUs);
+
+    TC3 -> COUNT16.INTENSET.reg = TC_INTENSET_MC0;
+    NVIC_EnableIRQ(TC3_IRQn);
+
+    TC3 -> COUNT16.CTRLA.reg |= TC_CTRLA_ENABLE;
+    while(TC3 -> COUNT16.STATUS.bit.SYNCBUSY);
+#else
+    tbTimer = timerBegin(TB_TIMER, TB_TIMER_PRESCALE, true);
+    timerAttachInterrupt(tbTimer, &tbEdgeInterrupt, true);
+    tbArm(tbRefUtcUs);
+    timerAlarmEnable(tbTimer);
+#endif
+}
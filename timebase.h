@@ -0,0 +1,24 @@
+int64_t tbLocalUs();
+int64_t tbUtcAt(int64_t localUs);
+int64_t tbLocalAt(int64_t utcUs);
+int64_t tbNowUs();
+time_t tbSeconds();
+boolean tbIsSynced();
+boolean tbIsWarm();
+boolean tbTimeValid();
+void tbRefBegin();
+void tbRefEnd();
+void tbEdgeInterrupt();
+void tbArm(int64_t utcUs);
+boolean tbSecondEdge();
+void tbStep(int64_t offsetUs);
+long int tbTakeSlewedUs();
+void tbSave(boolean toFile);
+boolean tbRestore();
+boolean tbNtpSample(ntpSample_t *sample);
+void tbHoldover(boolean on);
+boolean tbInHoldover();
+long int tbHoldoverSeconds();
+long int tbErrorUs();
+int64_t tbLastNtpUtc();
+void initTimebase();
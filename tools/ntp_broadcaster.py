@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+#
+#  Stand-in NTP broadcast server for testing the clock's broadcast client
+#    ntp_broadcaster.py [--group 224.0.1.1|255.255.255.255] [--interval 64] [--offset-ms 0] [--stop-after n]
+#  Sends mode 5 broadcasts from the host clock and answers client requests on UDP 123 so the clock
+#  can calibrate its delay.  Needs root for port 123 and nothing else (ntpd, chrony) using it.
+#  --offset-ms moves the time it gives out to watch the clock follow, --stop-after stops broadcasting
+#  after that many so the clock's fallback to polling can be seen.
+#
+
+import argparse
+import select
+import socket
+import struct
+import time
+
+NTP_PORT = 123
+NTP_UNIX_OFFSET = 2208988800
+STRATUM = 2
+PRECISION = -20
+REFID = b"HOST"
+
+
+def ntp_timestamp(t):
+    seconds = int(t)
+    fraction = int((t - seconds) * 4294967296.0) & 0xffffffff
+    return struct.pack("!II", seconds + NTP_UNIX_OFFSET, fraction)
+
+
+def now_with_offset(offset):
+    return time.time() + offset
+
+
+def main():
+    parser = argparse.ArgumentParser(description="NTP broadcast stand-in")
+    parser.add_argument("--group", default="255.255.255.255", help="broadcast address or multicast group")
+    parser.add_argument("--interval", type=int, default=64, help="seconds between broadcasts")
+    parser.add_argument("--offset-ms", type=float, default=0, help="add this to the time given out")
+    parser.add_argument("--stop-after", type=int, default=0, help="stop broadcasting after this many, 0 for never")
+    args = parser.parse_args()
+
+    offset = args.offset_ms / 1000.0
+    poll = max(0, args.interval.bit_length() - 1)
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_BROADCAST, 1)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, 1)
+    sock.bind(("", NTP_PORT))
+
+    sent = 0
+    next_broadcast = time.time()
+    while True:
+        ready, _, _ = select.select([sock], [], [], max(0, next_broadcast - time.time()))
+        if ready:
+            data, addr = sock.recvfrom(512)
+            received = ntp_timestamp(now_with_offset(offset))
+            if len(data) >= 48 and (data[0] & 0x07) == 3:
+                reply = struct.pack("!BBbbII4s", (data[0] & 0x38) | 4, STRATUM, data[2], PRECISION, 0, 0x00010000, REFID)
+                reply = reply + ntp_timestamp(now_with_offset(offset)) + data[40:48] + received
+                reply = reply + ntp_timestamp(now_with_offset(offset))
+                sock.sendto(reply, addr)
+                print("request from %s:%d" % addr)
+
+        if time.time() >= next_broadcast:
+            next_broadcast = next_broadcast + args.interval
+            if args.stop_after == 0 or sent < args.stop_after:
+                now = now_with_offset(offset)
+                broadcast = struct.pack("!BBbbII4s", (4 << 3) | 5, STRATUM, poll, PRECISION, 0, 0x00010000, REFID)
+                broadcast = broadcast + ntp_timestamp(now) + b"\0" * 16 + ntp_timestamp(now_with_offset(offset))
+                sock.sendto(broadcast, (args.group, NTP_PORT))
+                sent = sent + 1
+                print("broadcast %d to %s" % (sent, args.group))
+
+
+if __name__ == "__main__":
+    main()
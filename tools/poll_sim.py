@@ -0,0 +1,182 @@
+#!/usr/bin/env python3
+#
+#  Simulate a building full of clocks polling one NTP server
+#    poll_sim.py [--clocks 200] [--hours 6] [--outage-start 7200] [--outage-len 1800] [--init 20] [--sync 900]
+#  Every clock powers up within a few seconds of the others, like after a power cut.  Runs the old
+#  schedule (fixed intervals, back to the start on a timeout and a restart after MAX_NTP_TIMEOUTS) and
+#  the new one (MAC seeded phase and jitter, backoff on timeouts) and prints how the requests arrive
+#  at the server, second by second.  The server can be made to stop answering for a while to see
+#  what happens when it comes back.
+#  The schedule mirrors ntp-binary-clock.ino and the poll interval code in ntp.cpp, keep them in step.
+#
+
+import argparse
+import random
+
+NTP_BURST_COUNT = 8
+NTP_BURST_INTERVAL = 2
+NTP_BURST_MIN = 3
+NTP_POLL_LIMIT = 4
+NTP_START_SPREAD = 16
+NTP_POLL_JITTER = 8
+NTP_BACKOFF_LEVELS = 16
+MAX_NTP_TIMEOUTS = 5
+HOLDOVER_SETTLE = 2
+BOOT_SPREAD = 4
+
+
+class Rand:
+    # ntpRandom() and ntpSeedRandom()
+    def __init__(self, mac):
+        state = 2166136261
+        for byte in mac:
+            state = ((state ^ byte) * 16777619) & 0xffffffff
+        self.state = state or 1
+
+    def next(self):
+        s = self.state
+        s ^= (s << 13) & 0xffffffff
+        s ^= s >> 17
+        s ^= (s << 5) & 0xffffffff
+        self.state = s
+        return s
+
+
+class Clock:
+    def __init__(self, mac, boot, args, new):
+        self.rand = Rand(mac)
+        self.args = args
+        self.new = new
+        self.level = 0
+        self.counter = 0
+        self.timeouts = 0
+        self.updates = 0
+        self.synced = False
+        self.start(boot)
+
+    def interval(self):
+        return min(self.args.init << self.level, self.args.sync)
+
+    def jitter(self, interval):
+        spread = interval // NTP_POLL_JITTER
+        if not self.new or spread == 0:
+            return interval
+        return interval - spread + self.rand.next() % (2 * spread + 1)
+
+    def set_level(self, level):
+        # ntpPollSet()
+        self.counter = 0
+        if level < 0 or (level > self.level and self.interval() >= self.args.sync):
+            return
+        self.level = level
+
+    # startNtpClient()
+    def start(self, now):
+        self.level = 0
+        self.counter = 0
+        self.updates = 0
+        self.timeouts = 0
+        self.burst = NTP_BURST_COUNT - 1
+        self.next = now + (self.rand.next() % NTP_START_SPREAD if self.new else 0)
+
+    def reply(self, now):
+        self.updates += 1
+        self.timeouts = 0
+        if not self.synced and self.updates >= NTP_BURST_MIN:
+            self.synced = True
+        elif self.synced:
+            # Good replies, the interval goes up
+            self.counter += 1
+            if self.counter >= NTP_POLL_LIMIT:
+                self.set_level(self.level + 1)
+
+        if self.burst > 0 and not self.synced:
+            self.burst -= 1
+            self.next = now + NTP_BURST_INTERVAL
+        else:
+            self.burst = 0
+            self.next = now + self.jitter(self.interval())
+
+    def timeout(self, now):
+        self.timeouts += 1
+        self.updates = 0
+        self.burst = 0
+        self.synced = False
+        if self.new:
+            # ntpPollBackoff()
+            self.set_level(min(self.timeouts - 1, NTP_BACKOFF_LEVELS))
+            self.next = now + self.jitter(self.interval())
+        else:
+            self.set_level(0)
+            self.next = now + self.interval()
+            if self.timeouts >= MAX_NTP_TIMEOUTS:
+                # Holdover, WiFi back a couple of seconds later and everything starts again
+                self.start(now + HOLDOVER_SETTLE)
+
+
+def run(args, new):
+    rng = random.Random(args.seed)
+    clocks = []
+    for c in range(args.clocks):
+        mac = [0x24, 0x58, 0x7c] + [rng.randrange(256) for _ in range(3)]
+        clocks.append(Clock(mac, rng.randrange(BOOT_SPREAD), args, new))
+
+    seconds = args.hours * 3600
+    load = [0] * seconds
+    for now in range(seconds):
+        down = args.outage_start <= now < args.outage_start + args.outage_len
+        for clock in clocks:
+            if clock.next <= now:
+                load[now] += 1
+                if down:
+                    clock.timeout(now + 1)
+                else:
+                    clock.reply(now)
+    return load
+
+
+def summary(name, load, start, end):
+    part = load[start:end]
+    if len(part) == 0:
+        return
+    busy = sorted(part, reverse=True)
+    mean = sum(part) / len(part)
+    sd = (sum((n - mean) ** 2 for n in part) / len(part)) ** 0.5
+    print("  %-4s peak %4d/s  top 1%% %4d/s  mean %6.2f/s  sd %6.2f  idle %5.1f%% of seconds" %
+          (name, busy[0], busy[len(busy) // 100], mean, sd, 100.0 * part.count(0) / len(part)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="NTP poll scheduling simulator")
+    parser.add_argument("--clocks", type=int, default=200)
+    parser.add_argument("--hours", type=int, default=6)
+    parser.add_argument("--outage-start", type=int, default=7200, help="server stops answering at this second")
+    parser.add_argument("--outage-len", type=int, default=1800, help="for this many seconds, 0 for no outage")
+    parser.add_argument("--init", type=int, default=20, help="initUpdate")
+    parser.add_argument("--sync", type=int, default=900, help="syncUpdate")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    old = run(args, False)
+    new = run(args, True)
+    seconds = len(old)
+    back = min(seconds, args.outage_start + args.outage_len)
+
+    print("%d clocks, requests per second at the server" % args.clocks)
+    print("first hour after the power cut")
+    summary("old", old, 0, 3600)
+    summary("new", new, 0, 3600)
+    print("steady state (hour 1 to outage)")
+    summary("old", old, 3600, min(seconds, args.outage_start))
+    summary("new", new, 3600, min(seconds, args.outage_start))
+    if args.outage_len > 0:
+        print("during the outage")
+        summary("old", old, args.outage_start, back)
+        summary("new", new, args.outage_start, back)
+        print("hour after the server came back")
+        summary("old", old, back, back + 3600)
+        summary("new", new, back, back + 3600)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+#
+#  Decode the clock's time-series log to CSV
+#    tslog_decode.py segment.bin [segment.bin ...]     - segments copied off FFat (FTP or "cat")
+#    tslog_decode.py http://clock.local                 - fetched from /getTsLog a piece at a time
+#  Record layout is tslogHeader_t / tslogRecord_t in types.h, little endian and packed
+#
+
+import json
+import struct
+import sys
+import urllib.request
+
+TSLOG_MAGIC = 0x474c5354
+TSLOG_VERSION = 1
+HEADER = struct.Struct("<IHHII")
+RECORD = struct.Struct("<IiiiiIIbBH")
+FLAGS = ((0x01, "S"), (0x02, "H"), (0x04, "W"))
+READ_BYTES = 4096
+
+
+def fetch_segments(url):
+    url = url.rstrip("/")
+    index = json.load(urllib.request.urlopen(url + "/getTsLog"))
+    for seg in index["segments"]:
+        data = b""
+        while len(data) < seg["bytes"]:
+            part = urllib.request.urlopen("%s/getTsLog?seg=%d&offset=%d&length=%d" %
+                                          (url, seg["seg"], len(data), READ_BYTES)).read()
+            if len(part) == 0:
+                break
+            data = data + part
+        yield "segment %d" % seg["seg"], data
+
+
+def file_segments(names):
+    for name in names:
+        with open(name, "rb") as fp:
+            yield name, fp.read()
+
+
+def decode(name, data, out):
+    if len(data) < HEADER.size:
+        sys.stderr.write("%s: too short\n" % name)
+        return
+    magic, version, record_bytes, segment, created = HEADER.unpack_from(data, 0)
+    if magic != TSLOG_MAGIC or version != TSLOG_VERSION or record_bytes != RECORD.size:
+        sys.stderr.write("%s: not a version %d log segment\n" % (name, TSLOG_VERSION))
+        return
+
+    # Anything after the last whole record was cut off by a power cut
+    for pos in range(HEADER.size, len(data) - RECORD.size + 1, RECORD.size):
+        utc, offset, delay, freq, error, heap, loop_max, rssi, flags, poll = RECORD.unpack_from(data, pos)
+        flag_str = "".join(c for bit, c in FLAGS if flags & bit)
+        out.write("%d,%d,%d,%d,%d,%d,%d,%d,%d,%s,%d\n" %
+                  (segment, utc, offset, delay, freq, error, heap, loop_max, rssi, flag_str, poll))
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.stderr.write("usage: %s http://clock | segment.bin ...\n" % sys.argv[0])
+        return 1
+
+    if sys.argv[1].startswith("http://"):
+        segments = fetch_segments(sys.argv[1])
+    else:
+        segments = file_segments(sys.argv[1:])
+
+    sys.stdout.write("segment,utc,offset_us,delay_us,freq_ppb,error_us,free_heap,loop_max_us,rssi,flags,poll_s\n")
+    for name, data in segments:
+        decode(name, data, sys.stdout)
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,393 @@
+#include "config.h"
+
+#ifdef __MK2_HW
+
+#include <WiFi.h>
+#include <FS.h>
+#include <FFat.h>
+#ifdef __WITH_TELNET_CLI
+#include <ESPTelnet.h>
+#endif
+
+#include "types.h"
+#include "globals.h"
+#include "timebase.h"
+#include "ntp.h"
+#include "tslog.h"
+
+// Time-series log (MK2 only)...
+//   Offset, delay, frequency, RSSI, free heap and loop latency every TSLOG_SAMPLE_S seconds, kept on FFat
+//   so they're still there after a reboot.  Records are fixed size binary and collected in RAM, then
+//   appended to the current segment once a minute rather than writing the flash for every one.
+//   Segments are files in TSLOG_DIR named by a number that keeps counting up.  Each starts with a
+//   header and is closed off before it gets bigger than TSLOG_SEGMENT_BYTES.  When a new one is started
+//   the oldest are removed so there are never more than TSLOG_SEGMENTS, or less than TSLOG_MIN_FREE
+//   left on FFat for everything else.
+//   Read back in pieces over HTTP and decoded on the host with tools/tslog_decode.py.
+
+tslogRecord_t tslogBatch[TSLOG_BATCH];
+int tslogBatched;                        // Records waiting to be written
+unsigned long int tslogFirstSeg;         // Oldest segment on FFat
+unsigned long int tslogLastSeg;          // Segment being written, tslogFirstSeg - 1 if there aren't any
+unsigned long int tslogSegBytes;         // Size of the segment being written
+unsigned long int tslogLastSample;       // UTC / TSLOG_SAMPLE_S of the last record
+unsigned long int tslogFlushMs;          // When the batch was last written
+unsigned long int tslogWritten;          // Records written since start
+unsigned long int tslogDropped;          // Records that couldn't be written
+
+void tslogName(char *name, unsigned long int seg)
+{
+    sprintf(name, "%s/%08lu.bin", TSLOG_DIR, seg);
+}
+
+unsigned long int tslogSegments()
+{
+    return (tslogLastSeg + 1) - tslogFirstSeg;
+}
+
+// Find the segments already on FFat
+void initTslog()
+{
+    File dir;
+    File entry;
+    File fp;
+    char *namePtr;
+    unsigned long int seg;
+    tslogHeader_t header;
+    char name[32];
+
+    tslogBatched = 0;
+    tslogFirstSeg = 1;
+    tslogLastSeg = 0;
+    tslogSegBytes = 0;
+    tslogLastSample = 0;
+    tslogFlushMs = millis();
+    tslogWritten = 0;
+    tslogDropped = 0;
+    loopMaxUs = 0;
+
+    if(FFat.exists(TSLOG_DIR) == false)
+    {
+        FFat.mkdir(TSLOG_DIR);
+    }
+
+    dir = FFat.open(TSLOG_DIR);
+    if(!dir)
+    {
+        Serial.println("[TSLG] Can't open log directory");
+        return;
+    }
+
+    entry = dir.openNextFile();
+    while(entry)
+    {
+        namePtr = strrchr(entry.name(), '/');
+        namePtr = namePtr == NULL ? (char *)entry.name() : namePtr + 1;
+        seg = strtoul(namePtr, NULL, 10);
+        if(seg != 0)
+        {
+            if(tslogLastSeg == 0 || seg < tslogFirstSeg)
+            {
+                tslogFirstSeg = seg;
+            }
+            if(seg > tslogLastSeg)
+            {
+                tslogLastSeg = seg;
+            }
+        }
+        entry.close();
+        entry = dir.openNextFile();
+    }
+    dir.close();
+
+    if(tslogLastSeg == 0)
+    {
+        Serial.println("[TSLG] No log segments");
+        return;
+    }
+
+    // Carry on with the last one, unless it's damaged - half a record at the end after a power cut
+    tslogName(name, tslogLastSeg);
+    fp = FFat.open(name, FILE_READ);
+    if(fp)
+    {
+        tslogSegBytes = fp.size();
+        if(fp.read((unsigned char *)&header, sizeof(header)) != sizeof(header) ||
+           header.magic != TSLOG_MAGIC || header.version != TSLOG_VERSION ||
+           (tslogSegBytes - sizeof(header)) % sizeof(tslogRecord_t) != 0)
+        {
+            tslogSegBytes = TSLOG_SEGMENT_BYTES;
+        }
+        fp.close();
+    }
+    else
+    {
+        tslogSegBytes = TSLOG_SEGMENT_BYTES;
+    }
+
+    Serial.printf("[TSLG] Log segments %lu to %lu\r\n", tslogFirstSeg, tslogLastSeg);
+}
+
+// Start a new segment, removing old ones to make room
+boolean tslogNewSegment()
+{
+    File fp;
+    tslogHeader_t header;
+    char name[32];
+
+    while(tslogSegments() > 0 &&
+          (tslogSegments() >= TSLOG_SEGMENTS || FFat.freeBytes() < TSLOG_SEGMENT_BYTES + TSLOG_MIN_FREE))
+    {
+        tslogName(name, tslogFirstSeg);
+        FFat.remove(name);
+        Serial.printf("[TSLG] Removed %s\r\n", name);
+        tslogFirstSeg++;
+    }
+
+    if(FFat.freeBytes() < TSLOG_SEGMENT_BYTES + TSLOG_MIN_FREE)
+    {
+        Serial.println("[TSLG] Not enough space on FFat for a new segment");
+        return false;
+    }
+
+    tslogName(name, tslogLastSeg + 1);
+    fp = FFat.open(name, FILE_WRITE);
+    if(!fp)
+    {
+        Serial.printf("[TSLG] Error opening %s for writing\r\n", name);
+        return false;
+    }
+
+    header.magic = TSLOG_MAGIC;
+    header.version = TSLOG_VERSION;
+    header.recordBytes = sizeof(tslogRecord_t);
+    header.segment = tslogLastSeg + 1;
+    header.created = tbSeconds();
+    fp.write((unsigned char *)&header, sizeof(header));
+    fp.close();
+
+    tslogLastSeg++;
+    tslogSegBytes = sizeof(header);
+
+    Serial.printf("[TSLG] Started %s\r\n", name);
+
+    return true;
+}
+
+// Append the batch to the current segment
+void tslogFlush()
+{
+    File fp;
+    unsigned long int bytes;
+    char name[32];
+
+    tslogFlushMs = millis();
+
+    if(tslogBatched == 0)
+    {
+        return;
+    }
+
+    bytes = tslogBatched * sizeof(tslogRecord_t);
+    if(tslogSegments() == 0 || tslogSegBytes + bytes > TSLOG_SEGMENT_BYTES)
+    {
+        if(tslogNewSegment() == false)
+        {
+            tslogDropped = tslogDropped + tslogBatched;
+            tslogBatched = 0;
+            return;
+        }
+    }
+
+    tslogName(name, tslogLastSeg);
+    fp = FFat.open(name, FILE_APPEND);
+    if(!fp)
+    {
+        Serial.printf("[TSLG] Error opening %s for appending\r\n", name);
+        tslogDropped = tslogDropped + tslogBatched;
+        tslogBatched = 0;
+        return;
+    }
+
+    bytes = fp.write((unsigned char *)tslogBatch, bytes);
+    fp.close();
+
+    tslogSegBytes = tslogSegBytes + bytes;
+    tslogWritten = tslogWritten + tslogBatched;
+    tslogBatched = 0;
+
+    // Don't append to a segment that has half a record at the end
+    if(bytes % sizeof(tslogRecord_t) != 0)
+    {
+        tslogSegBytes = TSLOG_SEGMENT_BYTES;
+    }
+}
+
+// Called at every second while the time is running
+void tslogTick()
+{
+    tslogRecord_t *record;
+    time_t utc;
+
+    utc = tbSeconds();
+    if((unsigned long int)(utc / TSLOG_SAMPLE_S) != tslogLastSample)
+    {
+        tslogLastSample = utc / TSLOG_SAMPLE_S;
+
+        if(tslogBatched < TSLOG_BATCH)
+        {
+            record = &tslogBatch[tslogBatched];
+            record -> utc = utc;
+            record -> offsetUs = tbOffsetUs;
+            record -> delayUs = tbDelayUs;
+            record -> freqPpb = tbFreqPpb;
+            record -> errorUs = tbErrorUs();
+            record -> freeHeap = ESP.getFreeHeap();
+            record -> loopMaxUs = loopMaxUs;
+            record -> rssi = WiFi.status() == WL_CONNECTED ? WiFi.RSSI() : 0;
+            record -> flags = (ntpSyncState == HIGH ? TSLOG_SYNCED : 0) |
+                              (tbInHoldover() == true ? TSLOG_HOLDOVER : 0) |
+                              (WiFi.status() == WL_CONNECTED ? TSLOG_WIFI : 0);
+            record -> pollS = ntpPollInterval();
+            tslogBatched++;
+        }
+        else
+        {
+            tslogDropped++;
+        }
+
+        loopMaxUs = 0;
+    }
+
+    if(tslogBatched == TSLOG_BATCH || millis() - tslogFlushMs >= TSLOG_FLUSH_S * 1000)
+    {
+        tslogFlush();
+    }
+}
+
+// Remove all the segments
+void tslogClear()
+{
+    char name[32];
+
+    tslogBatched = 0;
+    while(tslogSegments() > 0)
+    {
+        tslogName(name, tslogFirstSeg);
+        FFat.remove(name);
+        tslogFirstSeg++;
+    }
+    tslogSegBytes = 0;
+}
+
+unsigned long int tslogFirst()
+{
+    return tslogFirstSeg;
+}
+
+unsigned long int tslogLast()
+{
+    return tslogLastSeg;
+}
+
+int tslogPending()
+{
+    return tslogBatched;
+}
+
+unsigned long int tslogGetWritten()
+{
+    return tslogWritten;
+}
+
+unsigned long int tslogGetDropped()
+{
+    return tslogDropped;
+}
+
+// Size of a segment, -1 if it isn't there
+long int tslogSegmentBytes(unsigned long int seg)
+{
+    File fp;
+    long int size;
+    char name[32];
+
+    if(seg < tslogFirstSeg || seg > tslogLastSeg)
+    {
+        return -1;
+    }
+
+    tslogName(name, seg);
+    fp = FFat.open(name, FILE_READ);
+    if(!fp)
+    {
+        return -1;
+    }
+    size = fp.size();
+    fp.close();
+
+    return size;
+}
+
+// The segments there are as JSON, for a reader to work out what to fetch
+void tslogIndex(Print &out)
+{
+    unsigned long int seg;
+    char line[128];
+
+    snprintf(line, sizeof(line), "{\"first\":%lu,\"last\":%lu,\"header_bytes\":%u,\"record_bytes\":%u,\"pending\":%d,\"segments\":[",
+             tslogFirstSeg, tslogLastSeg, (unsigned int)sizeof(tslogHeader_t), (unsigned int)sizeof(tslogRecord_t), tslogBatched);
+    out.print(line);
+
+    for(seg = tslogFirstSeg; seg <= tslogLastSeg; seg++)
+    {
+        snprintf(line, sizeof(line), "%s{\"seg\":%lu,\"bytes\":%ld}", seg == tslogFirstSeg ? "" : ",", seg, tslogSegmentBytes(seg));
+        out.print(line);
+    }
+
+    out.print("]}\r\n");
+}
+
+// Raw bytes from a segment, starting at offset
+// Returns how many were sent
+long int tslogRead(Print &out, unsigned long int seg, unsigned long int offset, unsigned long int length)
+{
+    File fp;
+    unsigned char dBuff[128];
+    long int sent;
+    int readed;
+    char name[32];
+
+    if(seg < tslogFirstSeg || seg > tslogLastSeg)
+    {
+        return -1;
+    }
+
+    tslogName(name, seg);
+    fp = FFat.open(name, FILE_READ);
+    if(!fp)
+    {
+        return -1;
+    }
+
+    sent = 0;
+    if(fp.seek(offset) == true)
+    {
+        do
+        {
+            // length comes from a web request, so no more than dBuff whatever it is
+            readed = fp.read(dBuff, min((unsigned long int)sizeof(dBuff), length - (unsigned long int)sent));
+            if(readed > 0)
+            {
+                out.write(dBuff, readed);
+                sent = sent + readed;
+            }
+        }
+        while(readed == sizeof(dBuff) && (unsigned long int)sent < length);
+    }
+    fp.close();
+
+    return sent;
+}
+
+#endif
@@ -0,0 +1,12 @@
+void initTslog();
+void tslogTick();
+void tslogFlush();
+void tslogClear();
+unsigned long int tslogFirst();
+unsigned long int tslogLast();
+int tslogPending();
+unsigned long int tslogGetWritten();
+unsigned long int tslogGetDropped();
+long int tslogSegmentBytes(unsigned long int seg);
+void tslogIndex(Print &out);
+long int tslogRead(Print &out, unsigned long int seg, unsigned long int offset, unsigned long int length);
@@ -34,6 +34,155 @@ typedef struct
     char *timeName;
 } timeNow_t;
 
+// Result of one NTP exchange, relative to the local clock
+typedef struct
+{
+    int64_t offsetUs;                    // How far the local clock is behind the server
+    long int delayUs;                    // Round trip delay
+    int stratum;                         // Server's stratum
+    long int rootDelayUs;                // Server's round trip delay to its reference clock
+    long int rootDispUs;                 // Server's dispersion from its reference clock
+    long int jitterUs;                   // Spread of the sources combined into this sample
+    unsigned long int ms;                // millis() when taken
+} ntpSample_t;
+
+// What happened at one NTP poll
+typedef struct
+{
+    unsigned long int seq;               // Counts up from 1, never reused
+    time_t utc;                          // When, after any correction
+    IPAddress server;                    // System peer, 0.0.0.0 if there wasn't one
+    char result;                         // HIST_xxx
+    int64_t offsetUs;
+    long int delayUs;
+    int stratum;
+    int pollS;                           // Poll interval after this poll
+    boolean stepped;                     // Correction was a step rather than a slew
+    long int freqPpb;                    // Frequency correction after this poll
+    long int freqChangePpb;              // Change made to it by this poll
+} ntpHistory_t;
+
+// Time-series log, little endian and packed so the host decoder can read it straight off FFat
+// Each segment starts with a header then has records up to TSLOG_SEGMENT_BYTES
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;                      // TSLOG_MAGIC
+    uint16_t version;                    // TSLOG_VERSION
+    uint16_t recordBytes;                // sizeof(tslogRecord_t)
+    uint32_t segment;                    // Segment number, same as the filename
+    uint32_t created;                    // UTC when the segment was started
+} tslogHeader_t;
+
+typedef struct __attribute__((packed))
+{
+    uint32_t utc;                        // Seconds since 1970
+    int32_t offsetUs;                    // Last NTP offset
+    int32_t delayUs;                     // Last NTP round trip delay
+    int32_t freqPpb;                     // Frequency correction
+    int32_t errorUs;                     // Estimated time error
+    uint32_t freeHeap;                   // Bytes
+    uint32_t loopMaxUs;                  // Longest loop() since the last record
+    int8_t rssi;                         // dBm, 0 if WiFi isn't connected
+    uint8_t flags;                       // TSLOG_xxx
+    uint16_t pollS;                      // NTP poll interval
+} tslogRecord_t;
+
+// A daylight saving rule from a POSIX TZ string
+typedef struct
+{
+    char type;                           // 'M' month.week.day, 'J' julian day 1-365, 'D' day 0-365
+    int month;
+    int week;                            // 1-5, 5 is the last in the month
+    int day;                             // Day of the week 0-6 (Sunday is 0) for 'M', day of the year otherwise
+    long int time;                       // Local time of day it happens, seconds
+} tzRule_t;
+
+// A time zone from a POSIX TZ string
+typedef struct
+{
+    char stdName[TZ_NAME_LEN];
+    char dstName[TZ_NAME_LEN];
+    long int stdOffset;                  // Seconds east of UTC
+    long int dstOffset;
+    boolean hasDst;
+    tzRule_t start;                      // Change to daylight saving, in standard time
+    tzRule_t end;                        // Change back, in daylight saving time
+} tzInfo_t;
+
+// Timebase state kept for a warm start
+typedef struct
+{
+    unsigned long int valid;             // TB_SAVE_VALID if the rest is
+    long int freqPpb;                    // Frequency correction
+    int64_t utcUs;                       // Last good UTC
+} tbSaved_t;
+
+// An NTP server address and what's been learned about it
+typedef struct
+{
+    char *name;                          // Configured server name this address came from
+    IPAddress addr;
+    unsigned char reach;                 // Last 8 requests, bit set for a reply
+    unsigned long int polls;
+    unsigned long int replies;
+    unsigned long int timeouts;
+    boolean waiting;                     // Request outstanding
+    int64_t t1;                          // Local time it was sent
+    unsigned char sent[8];               // Transmit timestamp sent, comes back as the reply's origin timestamp
+    ntpSample_t filter[NTP_FILTER_SIZE]; // Last few samples
+    int filterCount;
+    int filterNext;
+    int64_t offsetUs;                    // From the lowest delay sample
+    long int delayUs;
+    long int rootDelayUs;
+    long int jitterUs;                   // RMS of the samples' offsets from that one
+    long int distanceUs;                 // Root distance - how wrong it might be
+    int stratum;
+    char tally;                          // How selection used it
+    char kiss[5];                        // Last kiss-o'-death code, "" if none
+    int kissCount;                       // RATE kisses since the last good reply
+    unsigned long int holdStartMs;       // Not asked for holdMs from then, after a RATE kiss
+    unsigned long int holdMs;
+    boolean denied;                      // DENY or RSTR kiss, dropped at the next poll
+} ntpSource_t;
+
+// What other tasks see of an NTP source, copied by loop() once a second
+typedef struct
+{
+    char *name;
+    IPAddress addr;
+    unsigned char reach;
+    int stratum;
+    int64_t offsetUs;
+    long int delayUs;
+    long int jitterUs;
+    char tally;
+} ntpSourceView_t;
+
+// GPIO register masks to show one value on one display column
+typedef struct
+{
+    unsigned long int setMask[DISP_GPIO_BANKS];
+    unsigned long int clrMask[DISP_GPIO_BANKS];
+} dispMask_t;
+
+// Bit angle modulation steps for one column - rows to light and for how many timer ticks
+// Neighbouring bit planes that light the same rows are merged into one step
+typedef struct
+{
+    int count;
+    int value[DISP_PLANES];
+    unsigned long int ticks[DISP_PLANES];
+} dispBam_t;
+
+// One complete display frame, BCD data for each column
+// bam[] is filled in from col[] and the brightness settings when the frame is published
+typedef struct
+{
+    int col[MAX_COLS];
+    dispBam_t bam[MAX_COLS];
+} dispFrame_t;
+
 // Configuration data
 typedef struct
 {
@@ -47,6 +196,20 @@ typedef struct
     int initUpdate;
     int syncValid;
     unsigned long int eepromValid;
+
+    // Added after version 1.02 - configurations saved by older versions stop at eepromValid
+    // and get the default values for these
+    int brightness;                                  // Display brightness 0-15
+    int nightBrightness;                             // Display brightness at night
+    int nightStart;                                  // Hour night brightness starts
+    int nightEnd;                                    // Hour night brightness ends - same as nightStart for no night dimming
+    unsigned char ledBrightness[MAX_COLS][MAX_ROWS]; // Brightness of each LED, 0-15, scaled by brightness
+    char ntpExtraServer[NTP_EXTRA_SERVERS][32];      // More NTP servers to use along with ntpServer, "" if not used
+    char timeZone[TZ_LEN];                           // POSIX TZ string
+    char ntpBroadcast[NTP_BCAST_LEN];                // "" for polling only, "broadcast" or a multicast group to listen to as well
+    int morseWpm;                                    // Morse character speed
+    int morseFarnsworth;                             // Overall speed, gaps are longer when it's less than morseWpm
+    int morsePitch;                                  // Tone in Hz, 0 for a DC level
 } eepromData;
 
 // State machine states
@@ -56,5 +219,107 @@ typedef enum clockState_e
     STATE_CONNECTING,
     STATE_CONNECTED,
     STATE_TIMING,
+    STATE_HOLDOVER,
     STATE_STOPPED
 } clockStateType;
+
+// What's happening with an NTP exchange
+typedef enum ntpResult_e
+{
+    NTP_IDLE,
+    NTP_WAITING,
+    NTP_REPLY,
+    NTP_TIMEDOUT,
+    NTP_FAILED
+} ntpResultType;
+
+// NTP reply timestamped as it arrived, waiting for loop()
+typedef struct
+{
+    unsigned char packet[NTP_PACKET_SIZE];
+    uint32_t from;
+    int64_t t4;                          // UTC it arrived
+} ntpRxPacket_t;
+
+// Broadcast client
+typedef enum ntpBcast_e
+{
+    NTP_BCAST_OFF,                       // Not configured
+    NTP_BCAST_LISTENING,                 // Polling, waiting for a broadcast
+    NTP_BCAST_CALIBRATING,               // Measuring the delay to the broadcast server
+    NTP_BCAST_LOCKED                     // Time from broadcasts, no polling
+} ntpBcastType;
+
+// A name in the DNS cache and all the addresses it resolved to
+typedef struct
+{
+    char name[DNS_NAME_LEN];             // "" if the slot's free
+    IPAddress addr[DNS_MAX_ADDRS];
+    int addrCount;
+    unsigned char avoid;                 // Bit set for an address that's stopped answering
+    int rotate;                          // Address handed out first
+    unsigned long int ttl;               // Seconds, from the answer
+    unsigned long int resolvedMs;        // When the addresses were last refreshed, 0 if never
+    unsigned long int usedMs;            // Last looked up, the least recently used slot is reused
+    boolean refreshing;                  // Query outstanding
+    uint16_t queryId;
+    unsigned long int queryMs;           // When it was sent
+    unsigned long int answerMs;          // How long the last answer took
+    unsigned long int lookups;
+    unsigned long int hits;              // Answered from the cache, fresh
+    unsigned long int stale;             // Answered from the cache while a refresh was needed
+    unsigned long int misses;            // Nothing cached, had to wait
+    unsigned long int failures;          // Queries with no answer
+} dnsEntry_t;
+
+// Tasks that keep CPU and stack statistics
+typedef enum task_e
+{
+    TASK_CLOCK,                          // loop() - timekeeping, rendering and chimes
+    TASK_NET,                            // HTTP, FTP, OTA and telnet status servers
+    TASK_COUNT
+} taskType;
+
+// Things the network task asks loop() to do
+typedef enum taskRequest_e
+{
+    TASK_REQ_BRIGHTNESS,                 // Brightness settings changed - use and save them
+    TASK_REQ_OTA_START,                  // OTA update starting - finished with FFat
+    TASK_REQ_OTA_END,                    // OTA update done - keep the time for after the reboot
+    TASK_REQ_MORSE                       // Send the text in morse
+} taskRequestType;
+
+// A request and anything that goes with it
+typedef struct
+{
+    taskRequestType type;
+    char text[MORSE_TEXT_LEN + 1];       // TASK_REQ_MORSE - what to send
+    int brightness;                      // TASK_REQ_BRIGHTNESS - new settings, -1 to leave one as it is
+    int nightBrightness;
+    int nightStart;
+    int nightEnd;
+} taskRequest_t;
+
+// How busy a task is
+typedef struct
+{
+    char *name;
+    void *handle;                        // FreeRTOS task handle, NULL if it isn't running
+    int core;
+    unsigned long int busyUs;            // Time spent working since the last second
+    unsigned long int passes;            // and times round its loop
+    unsigned long int worstUs;           // and longest time round
+    unsigned long int secondMs;          // When the last second started
+    int cpuPermille;                     // Share of its core over the last second, in tenths of a percent
+    unsigned long int passesPerSecond;
+    unsigned long int worstPassUs;       // Longest time round in the last second
+} taskStats_t;
+
+// A morse message made into on/off elements ready to play
+// Each element is MORSE_ON if the beeper's on, or MORSE_SPACE for a gap between characters or words,
+// or'ed with its length in dot periods
+typedef struct
+{
+    int len;
+    unsigned char element[MORSE_MSG_LEN];
+} morseMsg_t;
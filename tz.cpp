@@ -0,0 +1,538 @@
+#include "config.h"
+
+#ifdef __MK1_HW
+#include <WiFi101.h>
+#else
+#include <WiFi.h>
+#ifdef __WITH_TELNET_CLI
+#include <ESPTelnet.h>
+#endif
+#endif
+
+#include "types.h"
+#include "globals.h"
+#include "tz.h"
+
+// Time zone...
+//   The time zone is a POSIX TZ string, e.g. "GMT0BST,M3.5.0/1,M10.5.0" for the UK or
+//   "CET-1CEST,M3.5.0,M10.5.0/3" for central Europe.  The offset is hours west of UTC, the rules say when
+//   daylight saving starts and ends - Mm.w.d (day d of week w of month m, week 5 is the last), Jn (day
+//   of the year 1-365 not counting 29th February) or n (day of the year 0-365) with an optional /time.
+//
+//   tzLocalTime() works out the local time in full the first time, after a resync and at a daylight
+//   saving change, and notes when the next change is.  Between changes, one second on from the last
+//   time asked for is just a second added with carries into minutes, hours, days and so on.
+
+tzInfo_t tzInfo;                         // Parsed TZ string
+boolean tzCacheValid;
+time_t tzCachedUtc;                      // UTC tzCached is the local time for
+timeNow_t tzCached;
+int64_t tzNextChange;                    // UTC of the next daylight saving change
+
+unsigned long int tzFullCount;           // Local times worked out in full
+unsigned long int tzStepCount;           // Local times worked out by adding a second
+
+// Days from 1/1/1970 to a date
+long int tzDaysFromCivil(int year, int month, int day)
+{
+    long int era;
+    long int yearOfEra;
+    long int dayOfYear;
+    long int dayOfEra;
+
+    // Years start in March so the leap day is at the end
+    if(month <= 2)
+    {
+        year = year - 1;
+    }
+    era = (year >= 0 ? year : year - 399) / 400;
+    yearOfEra = year - (era * 400);
+    dayOfYear = (((153 * (month > 2 ? month - 3 : month + 9)) + 2) / 5) + day - 1;
+    dayOfEra = (yearOfEra * 365) + (yearOfEra / 4) - (yearOfEra / 100) + dayOfYear;
+
+    return (era * 146097) + dayOfEra - 719468;
+}
+
+// Date from days since 1/1/1970
+void tzCivilFromDays(long int days, int *year, int *month, int *day)
+{
+    long int era;
+    long int dayOfEra;
+    long int yearOfEra;
+    long int dayOfYear;
+    long int monthIndex;
+
+    days = days + 719468;
+    era = (days >= 0 ? days : days - 146096) / 146097;
+    dayOfEra = days - (era * 146097);
+    yearOfEra = (dayOfEra - (dayOfEra / 1460) + (dayOfEra / 36524) - (dayOfEra / 146096)) / 365;
+    dayOfYear = dayOfEra - ((365 * yearOfEra) + (yearOfEra / 4) - (yearOfEra / 100));
+    monthIndex = ((5 * dayOfYear) + 2) / 153;
+
+    *day = dayOfYear - (((153 * monthIndex) + 2) / 5) + 1;
+    *month = monthIndex < 10 ? monthIndex + 3 : monthIndex - 9;
+    *year = yearOfEra + (era * 400) + (*month <= 2 ? 1 : 0);
+}
+
+boolean tzLeapYear(int year)
+{
+    return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+}
+
+int tzMonthDays(int year, int month)
+{
+    static const unsigned char monthDays[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+    if(month == 2 && tzLeapYear(year) == true)
+    {
+        return 29;
+    }
+
+    return monthDays[month - 1];
+}
+
+// Local time, as seconds since 1970, that a rule happens in a year
+int64_t tzRuleTime(tzRule_t *rule, int year)
+{
+    long int days;
+    long int firstDay;
+
+    switch(rule -> type)
+    {
+        case 'M':
+            // First "d" day of the month, then on to the right week
+            firstDay = tzDaysFromCivil(year, rule -> month, 1);
+            days = firstDay + ((rule -> day - ((firstDay + 4) % 7) + 7) % 7) + ((rule -> week - 1) * 7);
+            if(days - firstDay >= tzMonthDays(year, rule -> month))
+            {
+                days = days - 7;
+            }
+            break;
+
+        case 'J':
+            days = tzDaysFromCivil(year, 1, 1) + rule -> day - 1;
+            if(tzLeapYear(year) == true && rule -> day >= 60)
+            {
+                days++;
+            }
+            break;
+
+        default:
+            days = tzDaysFromCivil(year, 1, 1) + rule -> day;
+    }
+
+    return ((int64_t)days * 86400) + rule -> time;
+}
+
+// Zone name - letters, or anything in <>
+char *tzParseName(char *str, char *name)
+{
+    int len;
+
+    len = 0;
+    if(*str == '<')
+    {
+        str++;
+        while(*str != '>' && *str != '\0')
+        {
+            if(len < TZ_NAME_LEN - 1)
+            {
+                name[len++] = *str;
+            }
+            str++;
+        }
+        if(*str != '>')
+        {
+            return NULL;
+        }
+        str++;
+    }
+    else
+    {
+        while(isalpha(*str))
+        {
+            if(len < TZ_NAME_LEN - 1)
+            {
+                name[len++] = *str;
+            }
+            str++;
+        }
+    }
+    name[len] = '\0';
+
+    if(len < 3)
+    {
+        return NULL;
+    }
+
+    return str;
+}
+
+// [+-]hh[:mm[:ss]] to seconds
+char *tzParseTime(char *str, long int *seconds)
+{
+    int sign;
+    long int part;
+    long int scale;
+
+    sign = 1;
+    if(*str == '+' || *str == '-')
+    {
+        if(*str == '-')
+        {
+            sign = -1;
+        }
+        str++;
+    }
+
+    if(isdigit(*str) == false)
+    {
+        return NULL;
+    }
+
+    *seconds = 0;
+    scale = 3600;
+    while(scale > 0)
+    {
+        part = 0;
+        while(isdigit(*str))
+        {
+            part = (part * 10) + (*str - '0');
+            str++;
+        }
+        *seconds = *seconds + (part * scale);
+
+        if(*str != ':' || scale == 1)
+        {
+            break;
+        }
+        str++;
+        scale = scale / 60;
+    }
+
+    *seconds = *seconds * sign;
+
+    return str;
+}
+
+long int tzParseNumber(char **str)
+{
+    long int n;
+
+    n = 0;
+    while(isdigit(**str))
+    {
+        n = (n * 10) + (**str - '0');
+        (*str)++;
+    }
+
+    return n;
+}
+
+// ,Mm.w.d[/time] or ,Jn[/time] or ,n[/time]
+char *tzParseRule(char *str, tzRule_t *rule)
+{
+    if(*str != ',')
+    {
+        return NULL;
+    }
+    str++;
+
+    if(*str == 'M')
+    {
+        str++;
+        rule -> type = 'M';
+        rule -> month = tzParseNumber(&str);
+        if(*str++ != '.')
+        {
+            return NULL;
+        }
+        rule -> week = tzParseNumber(&str);
+        if(*str++ != '.')
+        {
+            return NULL;
+        }
+        rule -> day = tzParseNumber(&str);
+        if(rule -> month < 1 || rule -> month > 12 || rule -> week < 1 || rule -> week > 5 || rule -> day > 6)
+        {
+            return NULL;
+        }
+    }
+    else
+    {
+        rule -> type = 'D';
+        if(*str == 'J')
+        {
+            str++;
+            rule -> type = 'J';
+        }
+        if(isdigit(*str) == false)
+        {
+            return NULL;
+        }
+        rule -> day = tzParseNumber(&str);
+        if(rule -> day > 365 || (rule -> type == 'J' && rule -> day < 1))
+        {
+            return NULL;
+        }
+    }
+
+    // Changes at 02:00 local time unless it says otherwise
+    rule -> time = 7200;
+    if(*str == '/')
+    {
+        str = tzParseTime(str + 1, &rule -> time);
+    }
+
+    return str;
+}
+
+// Check and break up a TZ string, returns false if it doesn't make sense
+boolean tzParse(char *str, tzInfo_t *tz)
+{
+    long int offset;
+
+    str = tzParseName(str, tz -> stdName);
+    if(str == NULL)
+    {
+        return false;
+    }
+
+    // TZ offsets are west of UTC, these are east
+    str = tzParseTime(str, &offset);
+    if(str == NULL)
+    {
+        return false;
+    }
+    tz -> stdOffset = -offset;
+
+    tz -> hasDst = false;
+    tz -> dstName[0] = '\0';
+    if(*str == '\0')
+    {
+        return true;
+    }
+
+    str = tzParseName(str, tz -> dstName);
+    if(str == NULL)
+    {
+        return false;
+    }
+    tz -> hasDst = true;
+
+    // Daylight saving is an hour ahead unless it says otherwise
+    tz -> dstOffset = tz -> stdOffset + 3600;
+    if(*str != ',' && *str != '\0')
+    {
+        str = tzParseTime(str, &offset);
+        if(str == NULL)
+        {
+            return false;
+        }
+        tz -> dstOffset = -offset;
+    }
+
+    str = tzParseRule(str, &tz -> start);
+    if(str == NULL)
+    {
+        return false;
+    }
+    str = tzParseRule(str, &tz -> end);
+    if(str == NULL)
+    {
+        return false;
+    }
+
+    return *str == '\0';
+}
+
+// Use a new TZ string, returns false and leaves the time zone alone if it's no good
+boolean tzSet(char *str)
+{
+    tzInfo_t tz;
+
+    if(tzParse(str, &tz) == false)
+    {
+        return false;
+    }
+
+    tzInfo = tz;
+    tzCacheValid = false;
+
+    return true;
+}
+
+// Forget the cached local time so the next one is worked out in full
+void tzInvalidate()
+{
+    tzCacheValid = false;
+}
+
+// Work out the local time from scratch and when the next daylight saving change is
+void tzFull(time_t utc, timeNow_t *local)
+{
+    int64_t change;
+    int64_t lastChange;
+    int64_t localSecs;
+    long int offset;
+    long int days;
+    long int secs;
+    int year;
+    int month;
+    int day;
+    int y;
+
+    offset = tzInfo.stdOffset;
+    local -> tm_isdst = 0;
+    local -> timeName = tzInfo.stdName;
+    tzNextChange = INT64_MAX;
+
+    if(tzInfo.hasDst == true)
+    {
+        // Start uses standard time, end uses daylight saving time
+        // Last year to next year covers a change either side of now wherever the changes are in the year
+        tzCivilFromDays((utc + tzInfo.stdOffset) / 86400, &year, &month, &day);
+        lastChange = INT64_MIN;
+        for(y = year - 1; y <= year + 1; y++)
+        {
+            change = tzRuleTime(&tzInfo.start, y) - tzInfo.stdOffset;
+            if(change <= utc && change > lastChange)
+            {
+                lastChange = change;
+                offset = tzInfo.dstOffset;
+            }
+            if(change > utc && change < tzNextChange)
+            {
+                tzNextChange = change;
+            }
+
+            change = tzRuleTime(&tzInfo.end, y) - tzInfo.dstOffset;
+            if(change <= utc && change > lastChange)
+            {
+                lastChange = change;
+                offset = tzInfo.stdOffset;
+            }
+            if(change > utc && change < tzNextChange)
+            {
+                tzNextChange = change;
+            }
+        }
+
+        if(offset == tzInfo.dstOffset)
+        {
+            local -> tm_isdst = 1;
+            local -> timeName = tzInfo.dstName;
+        }
+    }
+
+    localSecs = (int64_t)utc + offset;
+    days = localSecs / 86400;
+    secs = localSecs % 86400;
+    if(secs < 0)
+    {
+        days--;
+        secs = secs + 86400;
+    }
+
+    tzCivilFromDays(days, &year, &month, &day);
+    local -> tm_year = year;
+    local -> tm_mon = month;
+    local -> tm_mday = day;
+    local -> tm_yday = days - tzDaysFromCivil(year, 1, 1);
+    local -> tm_wday = (days + 4) % 7;
+    if(local -> tm_wday < 0)
+    {
+        local -> tm_wday = local -> tm_wday + 7;
+    }
+    local -> tm_hour = secs / 3600;
+    local -> tm_min = (secs / 60) % 60;
+    local -> tm_sec = secs % 60;
+}
+
+// One second on
+void tzStep(timeNow_t *local)
+{
+    local -> tm_sec++;
+    if(local -> tm_sec < 60)
+    {
+        return;
+    }
+    local -> tm_sec = 0;
+
+    local -> tm_min++;
+    if(local -> tm_min < 60)
+    {
+        return;
+    }
+    local -> tm_min = 0;
+
+    local -> tm_hour++;
+    if(local -> tm_hour < 24)
+    {
+        return;
+    }
+    local -> tm_hour = 0;
+
+    local -> tm_wday = (local -> tm_wday + 1) % 7;
+    local -> tm_yday++;
+    local -> tm_mday++;
+    if(local -> tm_mday <= tzMonthDays(local -> tm_year, local -> tm_mon))
+    {
+        return;
+    }
+    local -> tm_mday = 1;
+
+    local -> tm_mon++;
+    if(local -> tm_mon <= 12)
+    {
+        return;
+    }
+    local -> tm_mon = 1;
+    local -> tm_yday = 0;
+    local -> tm_year++;
+}
+
+// Local time for a UTC time
+// Asking for the same second again, or the one after, is cheap
+void tzLocalTime(time_t utc, timeNow_t *local)
+{
+    if(tzCacheValid == true && utc == tzCachedUtc)
+    {
+        // Nothing to do
+    }
+    else if(tzCacheValid == true && utc == tzCachedUtc + 1 && utc < tzNextChange)
+    {
+        tzStep(&tzCached);
+        tzStepCount++;
+    }
+    else
+    {
+        tzFull(utc, &tzCached);
+        tzFullCount++;
+    }
+
+    tzCacheValid = true;
+    tzCachedUtc = utc;
+    *local = tzCached;
+}
+
+tzInfo_t *tzGetInfo()
+{
+    return &tzInfo;
+}
+
+// UTC of the next daylight saving change, INT64_MAX if there isn't one
+int64_t tzGetNextChange()
+{
+    return tzNextChange;
+}
+
+unsigned long int tzGetFullCount()
+{
+    return tzFullCount;
+}
+
+unsigned long int tzGetStepCount()
+{
+    return tzStepCount;
+}
@@ -0,0 +1,19 @@
+long int tzDaysFromCivil(int year, int month, int day);
+void tzCivilFromDays(long int days, int *year, int *month, int *day);
+boolean tzLeapYear(int year);
+int tzMonthDays(int year, int month);
+int64_t tzRuleTime(tzRule_t *rule, int year);
+char *tzParseName(char *str, char *name);
+char *tzParseTime(char *str, long int *seconds);
+long int tzParseNumber(char **str);
+char *tzParseRule(char *str, tzRule_t *rule);
+boolean tzParse(char *str, tzInfo_t *tz);
+boolean tzSet(char *str);
+void tzInvalidate();
+void tzFull(time_t utc, timeNow_t *local);
+void tzStep(timeNow_t *local);
+void tzLocalTime(time_t utc, timeNow_t *local);
+tzInfo_t *tzGetInfo();
+int64_t tzGetNextChange();
+unsigned long int tzGetFullCount();
+unsigned long int tzGetStepCount();
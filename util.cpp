@@ -52,6 +52,52 @@ void binToStr(unsigned int bin, char *str, int len)
     *str = '\0';
 }
 
+// Parts per billion as parts per million with three decimal places and a sign
+void ppbToStr(long int ppb, char *str)
+{
+    char sign;
+
+    sign = '+';
+    if(ppb < 0)
+    {
+        sign = '-';
+        ppb = -ppb;
+    }
+
+    sprintf(str, "%c%ld.%03ld", sign, ppb / 1000, ppb % 1000);
+}
+
+// Decode a URL encoded form value in place - "+" is a space, %xx is a character
+void urlDecode(char *str)
+{
+    char *out;
+    char hex[3];
+
+    out = str;
+    while(*str != '\0')
+    {
+        if(*str == '+')
+        {
+            *out = ' ';
+        }
+        else if(*str == '%' && isxdigit(str[1]) && isxdigit(str[2]))
+        {
+            hex[0] = str[1];
+            hex[1] = str[2];
+            hex[2] = '\0';
+            *out = strtol(hex, NULL, 16);
+            str = str + 2;
+        }
+        else
+        {
+            *out = *str;
+        }
+        out++;
+        str++;
+    }
+    *out = '\0';
+}
+
 void splitDigit(int x, volatile int *digPtr)
 {
     *digPtr = (x / 10);
@@ -1,4 +1,6 @@
 boolean mode12(void);
 boolean chimesEnabled(void);
 void binToStr(unsigned int bin, char *str, int len);
+void ppbToStr(long int ppb, char *str);
+void urlDecode(char *str);
 void splitDigit(int x, volatile int *digPtr);
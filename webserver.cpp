@@ -11,6 +11,15 @@
 
 #include "globals.h"
 #include "util.h"
+#include "display.h"
+#include "ntp.h"
+#include "timebase.h"
+#include "tz.h"
+#include "history.h"
+#include "tslog.h"
+#include "ntpserver.h"
+#include "tasks.h"
+#include "morse.h"
 
 #ifdef __WITH_HTTP
 
@@ -40,6 +49,14 @@ getRequestType normalGetRequestList[] =
     { "/index.html", httpStatusPage },
     { "/getClockState", httpClockState },
     { "/getLedData", httpLedData },
+    { "/setBrightness", httpBrightness },
+    { "/sendMorse", httpSendMorse },
+    { "/getNtpSources", httpNtpSources },
+    { "/getNtpHistory", httpNtpHistory },
+    { "/getJitter", httpJitter },
+#ifdef __MK2_HW
+    { "/getTsLog", httpTsLog },
+#endif
     { NULL, NULL }
 };
 
@@ -48,12 +65,20 @@ httpParamType httpParamHandlers[] =
     { "ssid", httpSetSsid },
     { "password", httpSetPassword },
     { "ntpserver", httpSetNtpServer },
+    { "ntpserver2", httpSetNtpServer2 },
+    { "ntpserver3", httpSetNtpServer3 },
+    { "ntpserver4", httpSetNtpServer4 },
     { "initupdate", httpSetInitUpdate },
     { "syncupdate", httpSetSyncUpdate },
     { "syncvalid", httpSetSyncValid },
     { "hostname", httpSetHostName },
     { "ftpuser", httpSetFtpUsername },
     { "ftppassword", httpSetFtpPassword },
+    { "brightness", httpSetBrightness },
+    { "nightbright", httpSetNightBrightness },
+    { "nightstart", httpSetNightStart },
+    { "nightend", httpSetNightEnd },
+    { "timezone", httpSetTimezone },
     { NULL, NULL }
 };
 
@@ -93,9 +118,15 @@ void httpStartAP()
 }
 
 void httpHeaderTop()
+{
+    httpHeaderType("text/html");
+}
+
+void httpHeaderType(char *contentType)
 {
     httpClient.println("HTTP/1.1 200 OK");
-    httpClient.println("Content-type:text/html");
+    httpClient.print("Content-type:");
+    httpClient.println(contentType);
     httpClient.println();  
 }
 
@@ -144,6 +175,16 @@ void httpConfigPage()
     httpClient.print("<input type=\"text\" id=\"ntpserver\" name=\"ntpserver\" value=\"");
     httpClient.print(clockConfig.ntpServer);
     httpClient.println("\"><br><br>");
+    httpClient.println("<label for=\"ntpserver2\">More NTP servers (can be blank):</label><br>");
+    httpClient.print("<input type=\"text\" id=\"ntpserver2\" name=\"ntpserver2\" value=\"");
+    httpClient.print(clockConfig.ntpExtraServer[0]);
+    httpClient.println("\"><br>");
+    httpClient.print("<input type=\"text\" id=\"ntpserver3\" name=\"ntpserver3\" value=\"");
+    httpClient.print(clockConfig.ntpExtraServer[1]);
+    httpClient.println("\"><br>");
+    httpClient.print("<input type=\"text\" id=\"ntpserver4\" name=\"ntpserver4\" value=\"");
+    httpClient.print(clockConfig.ntpExtraServer[2]);
+    httpClient.println("\"><br><br>");
     httpClient.println("<label for=\"syncupdate\">Normal update period:</label><br>");
     httpClient.print("<input type=\"text\" id=\"syncupdate\" name=\"syncupdate\" value=\"");
     httpClient.print(clockConfig.syncUpdate);
@@ -156,6 +197,26 @@ void httpConfigPage()
     httpClient.print("<input type=\"text\" id=\"syncvalid\" name=\"syncvalid\" value=\"");
     httpClient.print(clockConfig.syncValid);
     httpClient.println("\"><br><br>");
+    httpClient.println("<label for=\"brightness\">Display brightness (0-15):</label><br>");
+    httpClient.print("<input type=\"text\" id=\"brightness\" name=\"brightness\" value=\"");
+    httpClient.print(clockConfig.brightness);
+    httpClient.println("\"><br><br>");
+    httpClient.println("<label for=\"nightbright\">Night brightness (0-15):</label><br>");
+    httpClient.print("<input type=\"text\" id=\"nightbright\" name=\"nightbright\" value=\"");
+    httpClient.print(clockConfig.nightBrightness);
+    httpClient.println("\"><br><br>");
+    httpClient.println("<label for=\"nightstart\">Night starts at hour:</label><br>");
+    httpClient.print("<input type=\"text\" id=\"nightstart\" name=\"nightstart\" value=\"");
+    httpClient.print(clockConfig.nightStart);
+    httpClient.println("\"><br><br>");
+    httpClient.println("<label for=\"nightend\">Night ends at hour:</label><br>");
+    httpClient.print("<input type=\"text\" id=\"nightend\" name=\"nightend\" value=\"");
+    httpClient.print(clockConfig.nightEnd);
+    httpClient.println("\"><br><br>");
+    httpClient.println("<label for=\"timezone\">Time zone (POSIX TZ string):</label><br>");
+    httpClient.print("<input type=\"text\" id=\"timezone\" name=\"timezone\" value=\"");
+    httpClient.print(clockConfig.timeZone);
+    httpClient.println("\"><br><br>");
     httpClient.println("<input type=\"submit\" value=\"Save settings\">");
     httpClient.println("</form>");
 
@@ -212,6 +273,21 @@ void httpSetNtpServer(char *ntpServer)
     strcpy(clockConfig.ntpServer, ntpServer);
 }
 
+void httpSetNtpServer2(char *ntpServer)
+{
+    strncpy(clockConfig.ntpExtraServer[0], ntpServer, 31);
+}
+
+void httpSetNtpServer3(char *ntpServer)
+{
+    strncpy(clockConfig.ntpExtraServer[1], ntpServer, 31);
+}
+
+void httpSetNtpServer4(char *ntpServer)
+{
+    strncpy(clockConfig.ntpExtraServer[2], ntpServer, 31);
+}
+
 void httpSetSyncUpdate(char *syncUpdate)
 {
     clockConfig.syncUpdate = atoi(syncUpdate);  
@@ -227,6 +303,36 @@ void httpSetSyncValid(char *syncValid)
     clockConfig.syncValid = atoi(syncValid);  
 }
 
+void httpSetBrightness(char *brightness)
+{
+    clockConfig.brightness = constrain(atoi(brightness), 0, DISP_MAX_LEVEL);
+}
+
+void httpSetNightBrightness(char *nightBrightness)
+{
+    clockConfig.nightBrightness = constrain(atoi(nightBrightness), 0, DISP_MAX_LEVEL);
+}
+
+void httpSetNightStart(char *nightStart)
+{
+    clockConfig.nightStart = constrain(atoi(nightStart), 0, 23);
+}
+
+void httpSetNightEnd(char *nightEnd)
+{
+    clockConfig.nightEnd = constrain(atoi(nightEnd), 0, 23);
+}
+
+// Commas, slashes and so on come URL encoded, anything that isn't a good TZ string is ignored
+void httpSetTimezone(char *timeZone)
+{
+    urlDecode(timeZone);
+    if(strlen(timeZone) < TZ_LEN && tzSet(timeZone) == true)
+    {
+        strcpy(clockConfig.timeZone, timeZone);
+    }
+}
+
 void httpParseParam(char *paramName, char *paramValue)
 {
     int c;
@@ -341,6 +447,14 @@ void httpNotFound()
     httpClient.println("HTTP/1.1 404 Not Found");
 }
 
+void httpBadRequest(const char *why)
+{
+    httpClient.println("HTTP/1.1 400 Bad Request");
+    httpClient.println("Content-type:text/html");
+    httpClient.println();
+    httpClient.print(why);
+}
+
 void httpHandleGetRequest(char *url, getRequestType *getRequests)
 {
     char *tokPtr;
@@ -350,13 +464,14 @@ void httpHandleGetRequest(char *url, getRequestType *getRequests)
     c = 0;
 
     tokPtr = strtok(url, "?& ");
-    while(tokPtr != NULL)
+    while(tokPtr != NULL && c < 15)
     {
         httpParams[c] = tokPtr;
         c++;
 
         tokPtr = strtok(NULL, "?& ");
     }
+    httpParams[c] = NULL;
 
     Serial.print("GET ");
     Serial.println(httpParams[0]);
@@ -449,7 +564,11 @@ void httpBuiltinStatusPage()
 {
     char c;
     char *filename;
-    char txtBuff[80];
+    char txtBuff[128];
+    int n;
+    int count;
+    ntpSourceView_t sources[NTP_MAX_SOURCES + 1];
+    ntpSourceView_t *source;
 
     httpClient.println("HTTP/1.1 200 OK");
     httpClient.println("Content-type:text/html\r\n");
@@ -524,6 +643,58 @@ void httpBuiltinStatusPage()
     sprintf(txtBuff, "    <td>%d</td>", reSyncCount);
     httpClient.println(txtBuff);
     httpClient.println("  </tr>");
+    httpClient.println("  <tr>");
+    httpClient.println("    <th>Poll interval</th>");
+    sprintf(txtBuff, "    <td>%d seconds (%s)</td>", ntpPollInterval(), ntpPollReason());
+    httpClient.println(txtBuff);
+    httpClient.println("  </tr>");
+    httpClient.println("  <tr>");
+    httpClient.println("    <th>Time to sync</th>");
+    sprintf(txtBuff, "    <td>%ld.%03ld s from boot, %ld.%03ld s from NTP start</td>", syncBootMs / 1000, syncBootMs % 1000,
+            syncTimeMs / 1000, syncTimeMs % 1000);
+    httpClient.println(txtBuff);
+    httpClient.println("  </tr>");
+    httpClient.println("  <tr>");
+    httpClient.println("    <th>Holdover</th>");
+    sprintf(txtBuff, "    <td>%ld seconds, estimated error %ld us</td>", tbHoldoverSeconds(), tbErrorUs());
+    httpClient.println(txtBuff);
+    httpClient.println("  </tr>");
+    httpClient.println("  <tr>");
+    httpClient.println("    <th>Valid time displayed</th>");
+    sprintf(txtBuff, "    <td>%ld.%03ld s from boot (%s start)</td>", validBootMs / 1000, validBootMs % 1000,
+            tbIsWarm() == true ? "warm" : "cold");
+    httpClient.println(txtBuff);
+    httpClient.println("  </tr>");
+#ifdef __WITH_NTP_SERVER
+    httpClient.println("  <tr>");
+    httpClient.println("    <th>Serving time</th>");
+    sprintf(txtBuff, "    <td>%lu requests/s (peak %lu), latency %lu us average, %lu us worst</td>", ntpServerRate(),
+            ntpServerPeakRate(), ntpServerAvgUs(), ntpServerWorstUs());
+    httpClient.println(txtBuff);
+    httpClient.println("  </tr>");
+#endif
+    httpClient.println("</table>");
+
+    httpClient.println("<br>");
+
+    httpClient.println("<table>");
+    httpClient.println("  <tr>");
+    httpClient.println("    <th></th><th>Source</th><th>Name</th><th>Reach</th><th>Stratum</th>");
+    httpClient.println("    <th>Offset us</th><th>Delay us</th><th>Jitter us</th>");
+    httpClient.println("  </tr>");
+    count = ntpGetSourceViews(sources);
+    for(n = 0; n < count; n++)
+    {
+        source = &sources[n];
+        httpClient.println("  <tr>");
+        sprintf(txtBuff, "    <td>%c</td><td>%s</td><td>%s</td>", source -> tally, source -> addr.toString().c_str(), source -> name);
+        httpClient.println(txtBuff);
+        sprintf(txtBuff, "    <td>0x%02x</td><td>%d</td>", source -> reach, source -> stratum);
+        httpClient.println(txtBuff);
+        sprintf(txtBuff, "    <td>%ld</td><td>%ld</td><td>%ld</td>", (long int)source -> offsetUs, source -> delayUs, source -> jitterUs);
+        httpClient.println(txtBuff);
+        httpClient.println("  </tr>");
+    }
     httpClient.println("</table>");
 
     httpClient.println("<br>");
@@ -657,15 +828,242 @@ void httpClockState()
     }
     httpClient.print("|");
 
-    httpClient.printf("%ld|%s|%s", FFat.freeBytes(), SW_VER, SW_DATE);
+    httpClient.printf("%ld|%s|%s|", FFat.freeBytes(), SW_VER, SW_DATE);
+
+    httpClient.printf("%d|%s|", ntpPollInterval(), ntpPollReason());
+
+    httpClient.printf("%ld|%ld|", syncBootMs, syncTimeMs);
+
+    httpClient.printf("%ld|%ld|", tbHoldoverSeconds(), tbErrorUs());
+
+#ifdef __WITH_NTP_SERVER
+    httpClient.printf("%lu|%lu", ntpServerRate(), ntpServerAvgUs());
+#else
+    httpClient.print("-|-");
+#endif
+}
+
+// GET /setBrightness?brightness=n&nightbright=n&nightstart=h&nightend=h
+// Any subset of the parameters can be given, reply is the resulting settings
+// Nothing else in the configuration can be changed from here - there's no login
+// The new settings go to loop() with the request, the web server might be in another task
+// loop() keeps them in range, a negative one is left as it is
+void httpBrightness()
+{
+    int c;
+    char *paramName;
+    char *paramValue;
+    taskRequest_t request;
+
+    taskInitRequest(&request, TASK_REQ_BRIGHTNESS);
+
+    c = 1;
+    while(httpParams[c] != NULL)
+    {
+        paramName = strtok(httpParams[c], "=");
+        paramValue = strtok(NULL, "=");
+        if(paramName != NULL && paramValue != NULL)
+        {
+            if(strcmp(paramName, "brightness") == 0)
+            {
+                request.brightness = atoi(paramValue);
+            }
+            else if(strcmp(paramName, "nightbright") == 0)
+            {
+                request.nightBrightness = atoi(paramValue);
+            }
+            else if(strcmp(paramName, "nightstart") == 0)
+            {
+                request.nightStart = atoi(paramValue);
+            }
+            else if(strcmp(paramName, "nightend") == 0)
+            {
+                request.nightEnd = atoi(paramValue);
+            }
+        }
+        c++;
+    }
+
+    // The display and the configuration belong to loop()
+    taskCallRequest(&request);
+
+    httpHeaderTop();
+    httpClient.printf("%d|%d|%d|%d|%d", dispGetBrightness(), clockConfig.brightness, clockConfig.nightBrightness,
+                      clockConfig.nightStart, clockConfig.nightEnd);
+}
+
+// Send some text in morse - /sendMorse?text=...
+// Returns the text as it'll be sent, or a 400 if it won't fit in a message
+void httpSendMorse()
+{
+    int c;
+    char *paramName;
+    char *paramValue;
+    char text[MORSE_TEXT_LEN + 1];
+    morseMsg_t msg;
+
+    text[0] = '\0';
+    c = 1;
+    while(httpParams[c] != NULL)
+    {
+        paramName = strtok(httpParams[c], "=");
+        paramValue = strtok(NULL, "=");
+        if(paramName != NULL && paramValue != NULL && strcmp(paramName, "text") == 0)
+        {
+            urlDecode(paramValue);
+            strncpy(text, paramValue, MORSE_TEXT_LEN);
+            text[MORSE_TEXT_LEN] = '\0';
+        }
+        c++;
+    }
+
+    // Only the message is made up here to see it fits, the morse queue belongs to loop()
+    morseClear(&msg);
+    if(morseAddText(&msg, text) == false)
+    {
+        httpBadRequest("Too long to send");
+        return;
+    }
+
+    if(text[0] != '\0')
+    {
+        taskCallText(TASK_REQ_MORSE, text);
+    }
+
+    httpHeaderTop();
+    httpClient.print(text);
+}
+
+// One line for each NTP source
+// tally|address|name|reach|stratum|offset|delay|jitter
+// The broadcast server is last, if there is one
+// Comes from loop()'s copy of the sources, the web server might be in another task
+void httpNtpSources()
+{
+    int c;
+    int count;
+    ntpSourceView_t sources[NTP_MAX_SOURCES + 1];
+    ntpSourceView_t *source;
+
+    httpHeaderTop();
+    count = ntpGetSourceViews(sources);
+    for(c = 0; c < count; c++)
+    {
+        source = &sources[c];
+        httpClient.printf("%c|%s|%s|0x%02x|%d|%ld|%ld|%ld\n", source -> tally, source -> addr.toString().c_str(), source -> name,
+                          source -> reach, source -> stratum, (long int)source -> offsetUs, source -> delayUs, source -> jitterUs);
+    }
+}
+
+// Jitter and reply waiting time histograms
+// under us|jitter count|wait count
+void httpJitter()
+{
+    httpHeaderTop();
+    ntpHistExport(httpClient);
+}
+
+// GET /getNtpHistory?since=n&format=json|csv
+// NTP polls after sequence number "since", JSON unless CSV is asked for
+void httpNtpHistory()
+{
+    int c;
+    char *paramName;
+    char *paramValue;
+    unsigned long int since;
+    boolean json;
+
+    since = 0;
+    json = true;
+    c = 1;
+    while(httpParams[c] != NULL)
+    {
+        paramName = strtok(httpParams[c], "=");
+        paramValue = strtok(NULL, "=");
+        if(paramName != NULL && paramValue != NULL)
+        {
+            if(strcmp(paramName, "since") == 0)
+            {
+                since = strtoul(paramValue, NULL, 10);
+            }
+            else if(strcmp(paramName, "format") == 0 && strcmp(paramValue, "csv") == 0)
+            {
+                json = false;
+            }
+        }
+        c++;
+    }
+
+    if(json == true)
+    {
+        httpHeaderType("application/json");
+    }
+    else
+    {
+        httpHeaderType("text/csv");
+    }
+    histExport(httpClient, since, json);
 }
 
-void httpSplitLedData(int col)
+#ifdef __MK2_HW
+// GET /getTsLog for the list of time-series log segments
+// GET /getTsLog?seg=n&offset=x&length=y for raw bytes from one
+void httpTsLog()
 {
-    int x;
     int c;
+    char *paramName;
+    char *paramValue;
+    unsigned long int seg;
+    unsigned long int offset;
+    unsigned long int length;
 
-    x = ledColData[col];
+    seg = 0;
+    offset = 0;
+    length = TSLOG_SEGMENT_BYTES;
+    c = 1;
+    while(httpParams[c] != NULL)
+    {
+        paramName = strtok(httpParams[c], "=");
+        paramValue = strtok(NULL, "=");
+        if(paramName != NULL && paramValue != NULL)
+        {
+            if(strcmp(paramName, "seg") == 0)
+            {
+                seg = strtoul(paramValue, NULL, 10);
+            }
+            else if(strcmp(paramName, "offset") == 0)
+            {
+                offset = strtoul(paramValue, NULL, 10);
+            }
+            else if(strcmp(paramName, "length") == 0)
+            {
+                length = min(strtoul(paramValue, NULL, 10), (unsigned long int)TSLOG_SEGMENT_BYTES);
+            }
+        }
+        c++;
+    }
+
+    if(seg == 0)
+    {
+        httpHeaderType("application/json");
+        tslogIndex(httpClient);
+    }
+    else if(tslogSegmentBytes(seg) < 0)
+    {
+        httpNotFound();
+    }
+    else
+    {
+        httpHeaderType("application/octet-stream");
+        tslogRead(httpClient, seg, offset, length);
+        httpClient.flush();
+    }
+}
+#endif
+
+void httpSplitLedData(int x)
+{
+    int c;
 
     for(c = 0; c < 4; c++)
     {
@@ -691,12 +1089,14 @@ void httpLedData()
 {
     int col;
     int led;
+    dispFrame_t frame;
     
     httpHeaderTop();
 
+    dispGetFrame(&frame);
     for(col = 0; col < MAX_COLS; col++)
     {
-        httpSplitLedData(col);
+        httpSplitLedData(frame.col[col]);
         httpClient.print("|");
     }
 
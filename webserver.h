@@ -1,4 +1,5 @@
 void httpStartAP();
+void httpHeaderType(char *contentType);
 void httpHeader();
 void httpFooter();
 void httpConfigPage();
@@ -6,15 +7,24 @@ void httpResetConfiguration();
 void httpSetSsid(char *ssid);
 void httpSetPassword(char *password);
 void httpSetNtpServer(char *ntpServer);
+void httpSetNtpServer2(char *ntpServer);
+void httpSetNtpServer3(char *ntpServer);
+void httpSetNtpServer4(char *ntpServer);
 void httpSetSyncUpdate(char *syncUpdate);
 void httpSetInitUpdate(char *initUpdate);
 void httpSetSyncValid(char *syncValid);
 void httpSetHostName(char *hostName);
 void httpSetFtpUsername(char *username);
 void httpSetFtpPassword(char *password);
+void httpSetBrightness(char *brightness);
+void httpSetNightBrightness(char *nightBrightness);
+void httpSetNightStart(char *nightStart);
+void httpSetNightEnd(char *nightEnd);
+void httpSetTimezone(char *timeZone);
 void httpParseParam(char *paramName, char *paramValue);
 void httpSaveConfiguration();
 void httpNotFound();
+void httpBadRequest(const char *why);
 void httpHandleGetRequest(char *url, getRequestType *getRequests);
 void httpWebServer();
 void httpBuiltinStatusPage();
@@ -22,3 +32,9 @@ void httpStatusPage();
 void httpRequestHandler();
 void httpClockState();
 void httpLedData();
+void httpBrightness();
+void httpSendMorse();
+void httpNtpSources();
+void httpNtpHistory();
+void httpJitter();
+void httpTsLog();